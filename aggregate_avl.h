@@ -0,0 +1,317 @@
+#ifndef AGGREGATE_AVL_H
+#define AGGREGATE_AVL_H
+
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include "avlbst.h"
+
+/**
+* Aggregate policies for AggregateAVLTree. A policy is a monoid over the
+* values: a type, an identity element, lift() turning one value into an
+* aggregate, and an associative combine(). combine needn't be commutative;
+* the tree always combines in key order.
+*/
+template <typename Value>
+struct SumAggregate
+{
+    typedef Value type;
+    static type identity() { return Value(); }
+    static type lift(const Value& value) { return value; }
+    static type combine(const type& a, const type& b) { return a + b; }
+};
+
+template <typename Value>
+struct MinAggregate
+{
+    typedef Value type;
+    static type identity() { return std::numeric_limits<Value>::max(); }
+    static type lift(const Value& value) { return value; }
+    static type combine(const type& a, const type& b) { return std::min(a, b); }
+};
+
+template <typename Value>
+struct MaxAggregate
+{
+    typedef Value type;
+    static type identity() { return std::numeric_limits<Value>::lowest(); }
+    static type lift(const Value& value) { return value; }
+    static type combine(const type& a, const type& b) { return std::max(a, b); }
+};
+
+template <typename Value>
+struct CountAggregate
+{
+    typedef size_t type;
+    static type identity() { return 0; }
+    static type lift(const Value&) { return 1; }
+    static type combine(const type& a, const type& b) { return a + b; }
+};
+
+/**
+* An AVLNode that caches the aggregate of its whole subtree.
+*/
+template <typename Key, typename Value, typename Policy>
+class AggregateAVLNode : public AVLNode<Key, Value>
+{
+public:
+    typedef typename Policy::type AggregateType;
+
+    AggregateAVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
+
+    const AggregateType& getAggregate() const;
+    // Recomputes the aggregate from the node's value and its children's
+    // aggregates, which must already be up to date.
+    void updateAggregate();
+
+    virtual AggregateAVLNode<Key, Value, Policy>* clone(Node<Key, Value>* parent) const override;
+
+    // Aggregate of a possibly empty subtree
+    static AggregateType aggregateOf(const Node<Key, Value>* node);
+
+protected:
+    AggregateType aggregate_;
+};
+
+/*
+  -------------------------------------------------
+  Begin implementations for the AggregateAVLNode class.
+  -------------------------------------------------
+*/
+
+template<class Key, class Value, class Policy>
+AggregateAVLNode<Key, Value, Policy>::AggregateAVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent) :
+    AVLNode<Key, Value>(key, value, parent), aggregate_(Policy::lift(value))
+{
+
+}
+
+template<class Key, class Value, class Policy>
+const typename AggregateAVLNode<Key, Value, Policy>::AggregateType& AggregateAVLNode<Key, Value, Policy>::getAggregate() const
+{
+    return aggregate_;
+}
+
+template<class Key, class Value, class Policy>
+void AggregateAVLNode<Key, Value, Policy>::updateAggregate()
+{
+    aggregate_ = Policy::combine(Policy::combine(aggregateOf(this->left_), Policy::lift(this->item_.second)),
+                                 aggregateOf(this->right_));
+}
+
+/**
+* Copies the item, balance, leaf depths and aggregate into a new childless node.
+*/
+template<class Key, class Value, class Policy>
+AggregateAVLNode<Key, Value, Policy>* AggregateAVLNode<Key, Value, Policy>::clone(Node<Key, Value>* parent) const
+{
+    AggregateAVLNode<Key, Value, Policy>* copy = new AggregateAVLNode<Key, Value, Policy>(this->item_.first, this->item_.second, static_cast<AVLNode<Key, Value>*>(parent));
+    copy->setBalance(this->getBalance());
+    copy->setLeafDepths(this->getMinLeafDepth(), this->getMaxLeafDepth());
+    copy->aggregate_ = aggregate_;
+    return copy;
+}
+
+template<class Key, class Value, class Policy>
+typename AggregateAVLNode<Key, Value, Policy>::AggregateType AggregateAVLNode<Key, Value, Policy>::aggregateOf(const Node<Key, Value>* node)
+{
+    if (node == NULL) {
+        return Policy::identity();
+    }
+    return static_cast<const AggregateAVLNode<Key, Value, Policy>*>(node)->aggregate_;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the AggregateAVLNode class.
+  -----------------------------------------------
+*/
+
+/**
+* An AVL tree that keeps a monoid aggregate (see SumAggregate and friends)
+* of every subtree, so aggregate(lo, hi) over a key range is O(log n)
+* instead of a scan. The aggregates are fixed up through AVLTree's pullUp
+* hook, which every rotation, insert and remove already runs bottom-up
+* along the nodes whose subtrees changed.
+*
+* Values must change through insert() or update(), which fix the
+* aggregates on the path to the root, or parallelTransformValues(), which
+* recomputes them all afterwards. operator[] is read-only here for that
+* reason; writing through an iterator's ->second bypasses the tree and
+* leaves the aggregates stale.
+*/
+template <class Key, class Value, class Policy = SumAggregate<Value> >
+class AggregateAVLTree : public AVLTree<Key, Value>
+{
+public:
+    typedef typename Policy::type AggregateType;
+    typedef AggregateAVLNode<Key, Value, Policy> NodeType;
+
+    virtual void insert(const std::pair<const Key, Value>& new_item);
+    using AVLTree<Key, Value>::insert;
+
+    // Sets key's value, throwing std::out_of_range if key isn't in the tree
+    void update(const Key& key, const Value& value);
+    Value const & operator[](const Key& key) const;
+
+    // Aggregate of the values with lo <= key <= hi, in key order; the
+    // identity if there are none
+    AggregateType aggregate(const Key& lo, const Key& hi) const;
+    // Aggregate of the whole tree, O(1)
+    AggregateType aggregate() const;
+
+protected:
+    virtual NodeType* createNode(const Key& key, const Value& value, Node<Key, Value>* parent) const override;
+    virtual void linkNode(Node<Key, Value>* node, Node<Key, Value>* parent) override;
+    virtual bool canLink(const Node<Key, Value>* node) const override;
+    virtual void pullUp(AVLNode<Key, Value>* node) override;
+    virtual void valuesRewritten() override;
+};
+
+/*
+------------------------------------------------
+Begin implementations for the AggregateAVLTree class.
+------------------------------------------------
+*/
+
+/**
+* Inserts or overwrites like AVLTree. An overwrite changes the aggregate of
+* every subtree holding the key, so it pulls up to the root.
+*/
+template<class Key, class Value, class Policy>
+void AggregateAVLTree<Key, Value, Policy>::insert(const std::pair<const Key, Value>& new_item)
+{
+    BST_METRIC_OP(this, METRIC_INSERT);
+    Node<Key, Value>* existing = NULL;
+    Node<Key, Value>* parent = this->findLinkParent(new_item.first, existing);
+    if (existing != NULL) {
+        existing->setValue(new_item.second);
+        this->pullUpToRoot(static_cast<AVLNode<Key, Value>*>(existing));
+        return;
+    }
+    BST_METRIC_ADD(this, METRIC_ALLOCATIONS, 1);
+    linkNode(createNode(new_item.first, new_item.second, NULL), parent);
+}
+
+template<class Key, class Value, class Policy>
+void AggregateAVLTree<Key, Value, Policy>::update(const Key& key, const Value& value)
+{
+    Node<Key, Value>* node = this->internalFind(key);
+    if (node == NULL) {
+        throw std::out_of_range("Invalid key");
+    }
+    node->setValue(value);
+    this->pullUpToRoot(static_cast<AVLNode<Key, Value>*>(node));
+}
+
+template<class Key, class Value, class Policy>
+Value const & AggregateAVLTree<Key, Value, Policy>::operator[](const Key& key) const
+{
+    return AVLTree<Key, Value>::operator[](key);
+}
+
+template<class Key, class Value, class Policy>
+typename AggregateAVLTree<Key, Value, Policy>::NodeType* AggregateAVLTree<Key, Value, Policy>::createNode(const Key& key, const Value& value, Node<Key, Value>* parent) const
+{
+    return new NodeType(key, value, static_cast<AVLNode<Key, Value>*>(parent));
+}
+
+/**
+* Descends to the highest node inside [lo, hi], then walks its left and
+* right spines down to the range ends. Along the left spine every node
+* at or above lo contributes itself and its whole right subtree; the right
+* spine mirrors that. Only keys' operator< is used.
+*/
+template<class Key, class Value, class Policy>
+typename AggregateAVLTree<Key, Value, Policy>::AggregateType AggregateAVLTree<Key, Value, Policy>::aggregate(const Key& lo, const Key& hi) const
+{
+    BST_METRIC_OP(this, METRIC_FIND);
+    Node<Key, Value>* split = this->root_;
+    while (split != NULL) {
+        if (split->getKey() < lo) {
+            split = split->getRight();
+        }
+        else if (hi < split->getKey()) {
+            split = split->getLeft();
+        }
+        else {
+            break;
+        }
+    }
+    if (split == NULL) {
+        return Policy::identity();
+    }
+
+    // everything in range left of split, combined in key order
+    AggregateType left = Policy::identity();
+    for (Node<Key, Value>* node = split->getLeft(); node != NULL; ) {
+        if (node->getKey() < lo) {
+            node = node->getRight();
+        }
+        else {
+            left = Policy::combine(Policy::combine(Policy::lift(node->getValue()), NodeType::aggregateOf(node->getRight())), left);
+            node = node->getLeft();
+        }
+    }
+
+    AggregateType right = Policy::identity();
+    for (Node<Key, Value>* node = split->getRight(); node != NULL; ) {
+        if (hi < node->getKey()) {
+            node = node->getLeft();
+        }
+        else {
+            right = Policy::combine(right, Policy::combine(NodeType::aggregateOf(node->getLeft()), Policy::lift(node->getValue())));
+            node = node->getRight();
+        }
+    }
+
+    return Policy::combine(Policy::combine(left, Policy::lift(split->getValue())), right);
+}
+
+template<class Key, class Value, class Policy>
+typename AggregateAVLTree<Key, Value, Policy>::AggregateType AggregateAVLTree<Key, Value, Policy>::aggregate() const
+{
+    return NodeType::aggregateOf(this->root_);
+}
+
+template<class Key, class Value, class Policy>
+bool AggregateAVLTree<Key, Value, Policy>::canLink(const Node<Key, Value>* node) const
+{
+    return dynamic_cast<const NodeType*>(node) != NULL;
+}
+
+template<class Key, class Value, class Policy>
+void AggregateAVLTree<Key, Value, Policy>::linkNode(Node<Key, Value>* node, Node<Key, Value>* parent)
+{
+    if (canLink(node)) {
+        // it goes in as a leaf
+        static_cast<NodeType*>(node)->updateAggregate();
+    }
+    AVLTree<Key, Value>::linkNode(node, parent);
+}
+
+template<class Key, class Value, class Policy>
+void AggregateAVLTree<Key, Value, Policy>::valuesRewritten()
+{
+    this->pullUpAll();
+}
+
+template<class Key, class Value, class Policy>
+void AggregateAVLTree<Key, Value, Policy>::pullUp(AVLNode<Key, Value>* node)
+{
+    AVLTree<Key, Value>::pullUp(node);
+    static_cast<NodeType*>(node)->updateAggregate();
+}
+
+/*
+----------------------------------------------
+End implementations for the AggregateAVLTree class.
+----------------------------------------------
+*/
+
+#endif
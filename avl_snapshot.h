@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "snapshot_serializer.h"
+
+#ifndef AVL_SNAPSHOT_H
+#define AVL_SNAPSHOT_H
+
+// AVLTree binary snapshots
+// Included at the bottom of avlbst.h, like print_bst.h is for bst.h.
+//
+// File layout (all integers little-endian, as written by the host):
+//   header:  "AVLSNAP\0", uint32 version, uint32 tag (the caller's, 0 by
+//            default; DurableAVLTree keeps its checkpoint generation here),
+//            uint64 item count, uint32 sizeof(Key), uint32 sizeof(Value)
+//   payload: one record per node in pre-order:
+//            uint8 shape (bit 0: has left, bit 1: has right,
+//                         bits 2-3: balance + 1, bits 4-7: the tree's
+//                         snapshotFlags for the node, 0 for a plain AVLTree),
+//            serialized key, serialized value
+//   trailer: uint64 checksum of the header and payload
+//
+// Pre-order plus the shape bits pins down the exact tree, so loading
+// rebuilds it in one linear pass without comparing a single key. Nodes
+// come from the tree's createNode and get their flags back through
+// restoreSnapshotFlags, and whatever a subclass caches per subtree is
+// recomputed by its pullUp, so subclasses round-trip too.
+
+#define AVL_SNAPSHOT_MAGIC "AVLSNAP"
+#define AVL_SNAPSHOT_VERSION 1
+#define AVL_SNAPSHOT_BUFFER_SIZE (1 << 20)
+
+/**
+* 64-bit checksum over a byte stream. It consumes 8 bytes per step (with
+* one multiply on the dependency chain) so it keeps up with sequential disk
+* bandwidth, and buffers partial words so it can be fed in chunks.
+*/
+class SnapshotChecksum
+{
+public:
+    SnapshotChecksum() : state_(0x9E3779B97F4A7C15ULL), length_(0) {}
+
+    void update(const char* data, size_t len)
+    {
+        while (len > 0 && (length_ & 7) != 0) {
+            pending_[length_ & 7] = *data++;
+            --len;
+            if ((++length_ & 7) == 0) {
+                mix(pending_);
+            }
+        }
+        while (len >= 8) {
+            mix(data);
+            data += 8;
+            len -= 8;
+            length_ += 8;
+        }
+        for (size_t i = 0; i < len; ++i) {
+            pending_[length_++ & 7] = data[i];
+        }
+    }
+
+    uint64_t value() const
+    {
+        uint64_t h = state_;
+        uint64_t tail = 0;
+        memcpy(&tail, pending_, length_ & 7);
+        h = (h ^ tail ^ length_) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+private:
+    void mix(const char* word)
+    {
+        uint64_t w;
+        memcpy(&w, word, 8);
+        state_ = ((state_ ^ w) * 0x100000001B3ULL);
+        state_ ^= state_ >> 29;
+    }
+
+    uint64_t state_;
+    uint64_t length_;
+    char pending_[8];
+};
+
+/**
+* Writes the tree to path. The records are built in a 1 MB buffer and
+* written out in large sequential chunks. The walk runs pushDown on each
+* node once it is written, so a subclass's pending updates reach the
+* children before they are.
+*
+* The snapshot goes to path + ".tmp" first and is renamed over path once
+* it is complete, so a failed save leaves any earlier snapshot at path
+* intact. (It isn't fsynced; DurableAVLTree::checkpoint does that itself.)
+*/
+template<class Key, class Value>
+template<class KeySerializer, class ValueSerializer>
+void AVLTree<Key, Value>::saveSnapshot(const std::string& path, uint32_t tag) const
+{
+    std::string tempPath = path + ".tmp";
+    std::ofstream out(tempPath.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Could not open snapshot file " + tempPath);
+    }
+
+    // count first, so the header can be written before the payload
+    uint64_t count = 0;
+    for (typename BinarySearchTree<Key, Value>::iterator it = this->begin(); it != this->end(); ++it) {
+        ++count;
+    }
+
+    SnapshotChecksum checksum;
+    std::string buffer;
+    buffer.reserve(AVL_SNAPSHOT_BUFFER_SIZE + 256);
+    buffer.append(AVL_SNAPSHOT_MAGIC, sizeof(AVL_SNAPSHOT_MAGIC));
+    SnapshotSerializer<uint32_t>::write(buffer, AVL_SNAPSHOT_VERSION);
+    SnapshotSerializer<uint32_t>::write(buffer, tag);
+    SnapshotSerializer<uint64_t>::write(buffer, count);
+    SnapshotSerializer<uint32_t>::write(buffer, sizeof(Key));
+    SnapshotSerializer<uint32_t>::write(buffer, sizeof(Value));
+
+    // iterative pre-order walk; the stack holds right subtrees still to visit
+    std::vector<AVLNode<Key, Value>*> stack;
+    if (this->root_ != NULL) {
+        stack.push_back(static_cast<AVLNode<Key, Value>*>(this->root_));
+    }
+    while (!stack.empty()) {
+        AVLNode<Key, Value>* node = stack.back();
+        stack.pop_back();
+
+        // A node missing a child leans toward the other one, whatever its
+        // balance field says (remove can leave stale fields behind), and
+        // loadSnapshot rejects anything else, so write the shape's balance.
+        int balance = std::max(-1, std::min(1, static_cast<int>(node->getBalance())));
+        if (node->getLeft() == NULL) {
+            balance = (node->getRight() == NULL) ? 0 : 1;
+        }
+        else if (node->getRight() == NULL) {
+            balance = -1;
+        }
+        uint8_t shape = static_cast<uint8_t>(((balance + 1) << 2) | (snapshotFlags(node) << 4));
+        if (node->getLeft() != NULL) shape |= 1;
+        if (node->getRight() != NULL) shape |= 2;
+        buffer.push_back(static_cast<char>(shape));
+        KeySerializer::write(buffer, node->getKey());
+        ValueSerializer::write(buffer, node->getValue());
+        const_cast<AVLTree<Key, Value>*>(this)->pushDown(node);
+
+        if (node->getRight() != NULL) stack.push_back(node->getRight());
+        if (node->getLeft() != NULL) stack.push_back(node->getLeft());
+
+        if (buffer.size() >= AVL_SNAPSHOT_BUFFER_SIZE) {
+            checksum.update(buffer.data(), buffer.size());
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+
+    checksum.update(buffer.data(), buffer.size());
+    SnapshotSerializer<uint64_t>::write(buffer, checksum.value());
+    out.write(buffer.data(), buffer.size());
+    out.close();
+    if (!out) {
+        std::remove(tempPath.c_str());
+        throw std::runtime_error("Error writing snapshot file " + tempPath);
+    }
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::remove(tempPath.c_str());
+        throw std::runtime_error("Could not rename snapshot file " + tempPath + " to " + path);
+    }
+}
+
+/**
+* Replaces the contents of the tree with the snapshot at path. The file is
+* read with a single read() call, verified, and then rebuilt node by node
+* in pre-order. If anything is wrong with the file the tree is left as it was.
+*/
+template<class Key, class Value>
+template<class KeySerializer, class ValueSerializer>
+void AVLTree<Key, Value>::loadSnapshot(const std::string& path, uint32_t* tag)
+{
+    std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!in) {
+        throw std::runtime_error("Could not open snapshot file " + path);
+    }
+    std::streamoff fileSize = in.tellg();
+    const size_t headerSize = sizeof(AVL_SNAPSHOT_MAGIC) + 4 + 4 + 8 + 4 + 4;
+    if (fileSize < static_cast<std::streamoff>(headerSize + 8)) {
+        throw std::runtime_error("Snapshot is truncated");
+    }
+    std::vector<char> data(static_cast<size_t>(fileSize));
+    in.seekg(0);
+    if (!in.read(&data[0], fileSize)) {
+        throw std::runtime_error("Error reading snapshot file " + path);
+    }
+
+    const char* pos = &data[0];
+    const char* end = pos + data.size() - 8;
+    const char* trailer = end;
+    SnapshotChecksum checksum;
+    checksum.update(pos, end - pos);
+    if (SnapshotSerializer<uint64_t>::read(trailer, trailer + 8) != checksum.value()) {
+        throw std::runtime_error("Snapshot checksum mismatch");
+    }
+
+    if (memcmp(pos, AVL_SNAPSHOT_MAGIC, sizeof(AVL_SNAPSHOT_MAGIC)) != 0) {
+        throw std::runtime_error("Not an AVLTree snapshot");
+    }
+    pos += sizeof(AVL_SNAPSHOT_MAGIC);
+    if (SnapshotSerializer<uint32_t>::read(pos, end) != AVL_SNAPSHOT_VERSION) {
+        throw std::runtime_error("Unsupported snapshot version");
+    }
+    uint32_t savedTag = SnapshotSerializer<uint32_t>::read(pos, end);
+    uint64_t count = SnapshotSerializer<uint64_t>::read(pos, end);
+    if (SnapshotSerializer<uint32_t>::read(pos, end) != sizeof(Key) ||
+        SnapshotSerializer<uint32_t>::read(pos, end) != sizeof(Value)) {
+        throw std::runtime_error("Snapshot key/value types don't match this tree");
+    }
+
+    // Rebuild. After each node, the next record is its left child if it has
+    // one, otherwise the right child of the nearest node still waiting for it.
+    AVLNode<Key, Value>* newRoot = NULL;
+    AVLNode<Key, Value>* attachTo = NULL;
+    bool attachLeft = false;
+    std::vector<AVLNode<Key, Value>*> pendingRight;
+    std::vector<AVLNode<Key, Value>*> preorder;
+    try {
+        for (uint64_t i = 0; i < count; ++i) {
+            if (i > 0 && attachTo == NULL) {
+                throw std::runtime_error("Snapshot shape is corrupt");
+            }
+            if (pos >= end) {
+                throw std::runtime_error("Snapshot is truncated");
+            }
+            uint8_t shape = static_cast<uint8_t>(*pos++);
+            // balance + 1 is 0-2, and a node missing a child leans the
+            // other way: a leaf is 0, a lone left child -1, a lone right +1
+            int balance = ((shape >> 2) & 3) - 1;
+            if (balance == 2 ||
+                ((shape & 3) == 0 && balance != 0) ||
+                ((shape & 3) == 1 && balance != -1) ||
+                ((shape & 3) == 2 && balance != 1)) {
+                throw std::runtime_error("Snapshot shape is corrupt");
+            }
+            Key key = KeySerializer::read(pos, end);
+            Value value = ValueSerializer::read(pos, end);
+
+            AVLNode<Key, Value>* node = this->createNode(key, value, attachTo);
+            node->setBalance(static_cast<int8_t>(balance));
+            if (attachTo == NULL) {
+                newRoot = node;
+            }
+            else if (attachLeft) {
+                attachTo->setLeft(node);
+            }
+            else {
+                attachTo->setRight(node);
+            }
+            preorder.push_back(node);
+            restoreSnapshotFlags(node, shape >> 4);
+
+            if (shape & 2) {
+                pendingRight.push_back(node);
+            }
+            if (shape & 1) {
+                attachTo = node;
+                attachLeft = true;
+            }
+            else if (!pendingRight.empty()) {
+                attachTo = pendingRight.back();
+                attachLeft = false;
+                pendingRight.pop_back();
+            }
+            else {
+                attachTo = NULL;
+            }
+        }
+        if (attachTo != NULL || pos != end) {
+            throw std::runtime_error("Snapshot shape is corrupt");
+        }
+    }
+    catch (...) {
+        this->clearHelper(newRoot);
+        throw;
+    }
+
+    // per-subtree data isn't stored; children come after parents in pre-order
+    for (size_t i = preorder.size(); i > 0; --i) {
+        pullUp(preorder[i - 1]);
+    }
+
+    this->replaceRoot(newRoot, this->deferredDestruction_);
+    if (tag != NULL) {
+        *tag = savedTag;
+    }
+}
+
+#endif
@@ -6,6 +6,8 @@
 #include <cstdlib>
 #include <cstdint>
 #include <algorithm>
+#include <stdexcept>
+#include <string>
 #include "bst.h"
 
 struct KeyError { };
@@ -28,6 +30,13 @@ public:
     void setBalance (int8_t balance);
     void updateBalance(int8_t diff);
 
+    // Shallowest and deepest leaf in this node's subtree, counted from this
+    // node (0 for a leaf). updateLeafDepths() recomputes them from the children.
+    uint8_t getMinLeafDepth() const;
+    uint8_t getMaxLeafDepth() const;
+    void setLeafDepths(uint8_t minDepth, uint8_t maxDepth);
+    void updateLeafDepths();
+
     // Getters for parent, left, and right. These need to be redefined since they
     // return pointers to AVLNodes - not plain Nodes. See the Node class in bst.h
     // for more information.
@@ -35,8 +44,12 @@ public:
     virtual AVLNode<Key, Value>* getLeft() const override;
     virtual AVLNode<Key, Value>* getRight() const override;
 
+    virtual AVLNode<Key, Value>* clone(Node<Key, Value>* parent) const override;
+
 protected:
     int8_t balance_;    // effectively a signed char
+    uint8_t minLeafDepth_;
+    uint8_t maxLeafDepth_;
 };
 
 /*
@@ -50,7 +63,7 @@ protected:
 */
 template<class Key, class Value>
 AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value> *parent) :
-    Node<Key, Value>(key, value, parent), balance_(0)
+    Node<Key, Value>(key, value, parent), balance_(0), minLeafDepth_(0), maxLeafDepth_(0)
 {
 
 }
@@ -91,6 +104,68 @@ void AVLNode<Key, Value>::updateBalance(int8_t diff)
     balance_ += diff;
 }
 
+/**
+* Getters for the leaf depths of a AVLNode's subtree.
+*/
+template<class Key, class Value>
+uint8_t AVLNode<Key, Value>::getMinLeafDepth() const
+{
+    return minLeafDepth_;
+}
+
+template<class Key, class Value>
+uint8_t AVLNode<Key, Value>::getMaxLeafDepth() const
+{
+    return maxLeafDepth_;
+}
+
+/**
+* A setter for the leaf depths of a AVLNode.
+*/
+template<class Key, class Value>
+void AVLNode<Key, Value>::setLeafDepths(uint8_t minDepth, uint8_t maxDepth)
+{
+    minLeafDepth_ = minDepth;
+    maxLeafDepth_ = maxDepth;
+}
+
+/**
+* Recomputes the leaf depths of a AVLNode from its children's, which must
+* already be up to date.
+*/
+template<class Key, class Value>
+void AVLNode<Key, Value>::updateLeafDepths()
+{
+    AVLNode<Key, Value>* left = getLeft();
+    AVLNode<Key, Value>* right = getRight();
+    if (left == NULL && right == NULL) {
+        minLeafDepth_ = 0;
+        maxLeafDepth_ = 0;
+    }
+    else if (left == NULL || right == NULL) {
+        AVLNode<Key, Value>* only = (left != NULL) ? left : right;
+        minLeafDepth_ = only->minLeafDepth_ + 1;
+        maxLeafDepth_ = only->maxLeafDepth_ + 1;
+    }
+    else {
+        minLeafDepth_ = std::min(left->minLeafDepth_, right->minLeafDepth_) + 1;
+        maxLeafDepth_ = std::max(left->maxLeafDepth_, right->maxLeafDepth_) + 1;
+    }
+}
+
+/**
+* Copies the item, balance and leaf depths into a new childless node.
+*/
+template<class Key, class Value>
+AVLNode<Key, Value>* AVLNode<Key, Value>::clone(Node<Key, Value>* parent) const
+{
+    AVLNode<Key, Value>* copy = new AVLNode<Key, Value>(this->item_.first, this->item_.second, static_cast<AVLNode<Key, Value>*>(parent));
+    copy->balance_ = balance_;
+    copy->minLeafDepth_ = minLeafDepth_;
+    copy->maxLeafDepth_ = maxLeafDepth_;
+    return copy;
+}
+
 /**
 * An overridden function for getting the parent since a static_cast is necessary to make sure
 * that our node is a AVLNode.
@@ -127,14 +202,41 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
 */
 
 
+template <typename T>
+struct SnapshotSerializer;
+
 template <class Key, class Value>
 class AVLTree : public BinarySearchTree<Key, Value>
 {
 public:
     virtual void insert (const std::pair<const Key, Value> &new_item); // TODO
     virtual void remove(const Key& key);  // TODO
+    // node handle insert (bst.h), hidden by the insert above otherwise
+    using BinarySearchTree<Key, Value>::insert;
+
+    // Leaf depth profile, kept up to date by insert and remove so these are O(1).
+    // Depths count edges from the root; an empty tree has no leaves (-1).
+    bool allLeavesSameDepth() const;
+    int minLeafDepth() const;
+    int maxLeafDepth() const;
+
+    // Binary snapshots of the exact tree shape (see avl_snapshot.h).
+    // The default serializers handle trivially copyable keys and values.
+    // tag is stored in the header for the caller's own use; loadSnapshot
+    // hands it back through tag if that isn't NULL.
+    template<class KeySerializer = SnapshotSerializer<Key>, class ValueSerializer = SnapshotSerializer<Value> >
+    void saveSnapshot(const std::string& path, uint32_t tag = 0) const;
+    template<class KeySerializer = SnapshotSerializer<Key>, class ValueSerializer = SnapshotSerializer<Value> >
+    void loadSnapshot(const std::string& path, uint32_t* tag = NULL);
 protected:
     virtual void nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
+    virtual AVLNode<Key, Value>* createNode(const Key& key, const Value& value, Node<Key, Value>* parent) const override;
+    virtual void linkNode(Node<Key, Value>* node, Node<Key, Value>* parent) override;
+    virtual Node<Key, Value>* unlinkNode(Node<Key, Value>* node) override;
+    // Whether linkNode can take node, which may come from any tree through
+    // a node handle: it has to be of the type createNode makes (or derived
+    // from it), since the tree reads that type's fields.
+    virtual bool canLink(const Node<Key, Value>* node) const;
 
     // Helper functions for AVL operations
     // I made these because I was repeating the same logic over and over
@@ -142,9 +244,24 @@ protected:
     void fixTree(AVLNode<Key, Value>* node, int8_t diff);
     void rotateLeft(AVLNode<Key, Value>* node);
     void rotateRight(AVLNode<Key, Value>* node);
-    
-    // Recursive helper for insert to replace the loop
-    AVLNode<Key, Value>* insertHelper(AVLNode<Key, Value>* curr, const std::pair<const Key, Value>& new_item, AVLNode<Key, Value>*& newNode);
+    void pullUpToRoot(AVLNode<Key, Value>* node);
+    // pullUp on every node, children before parents, O(n)
+    void pullUpAll();
+    // Recomputes what node caches about its subtree (here the leaf depths)
+    // from its children's. Rotations, insert and remove call it bottom-up
+    // on every node whose subtree changed, so a subclass can override it
+    // to keep its own per-subtree data (see aggregate_avl.h).
+    virtual void pullUp(AVLNode<Key, Value>* node);
+    // The other direction: hands whatever node holds pending for its
+    // descendants down to its children. Rotations call it on both nodes
+    // before relinking them (see lazy_avl.h). Does nothing here.
+    virtual void pushDown(AVLNode<Key, Value>* node);
+    // Per-node state a subclass wants kept in snapshots, up to four bits
+    // stored alongside each node's shape (see avl_snapshot.h). Nodes have
+    // none here: snapshotFlags is 0 and loading rejects anything else.
+    virtual uint8_t snapshotFlags(const AVLNode<Key, Value>* node) const;
+    virtual void restoreSnapshotFlags(AVLNode<Key, Value>* node, uint8_t flags);
+
 
 };
 
@@ -155,21 +272,41 @@ protected:
 template<class Key, class Value>
 void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
 {
-    // handle empty tree first, thats the easy case
-    if (this->root_ == NULL) {
-        this->root_ = new AVLNode<Key, Value>(new_item.first, new_item.second, NULL);
+    BST_METRIC_OP(this, METRIC_INSERT);
+
+    Node<Key, Value>* existing = NULL;
+    Node<Key, Value>* parent = this->findLinkParent(new_item.first, existing);
+    if (existing != NULL) {
+        // key already exists, just update the value and we're done
+        existing->setValue(new_item.second);
         return;
     }
-    
-    // Use recursive helper to find insertion point and insert
-    AVLNode<Key, Value>* newNode = nullptr;
-    AVLNode<Key, Value>* parent = insertHelper(static_cast<AVLNode<Key, Value>*>(this->root_), new_item, newNode);
-    
-    // If newNode is null, the key already existed and value was updated
-    if (newNode == nullptr) {
-        return;
+
+    BST_METRIC_ADD(this, METRIC_ALLOCATIONS, 1);
+    linkNode(createNode(new_item.first, new_item.second, NULL), parent);
+}
+
+/*
+ * Hangs a detached AVLNode under parent and rebalances. Nodes canLink
+ * refuses (say, plain Nodes extracted from a BinarySearchTree) throw.
+ */
+template<class Key, class Value>
+void AVLTree<Key, Value>::linkNode(Node<Key, Value>* node, Node<Key, Value>* linkParent)
+{
+    if (!canLink(node)) {
+        throw std::logic_error("Node was extracted from a tree with a different node type");
     }
-    
+    AVLNode<Key, Value>* newNode = static_cast<AVLNode<Key, Value>*>(node);
+    // whatever it was in its old tree, it's a leaf here
+    newNode->setBalance(0);
+    newNode->setLeafDepths(0, 0);
+    BinarySearchTree<Key, Value>::linkNode(newNode, linkParent);
+
+    AVLNode<Key, Value>* parent = newNode->getParent();
+    if (parent == NULL) {
+        return; // new root, nothing to balance
+    }
+
     // now handle the AVL balancing part. this was tricky to get right
     if (newNode == parent->getLeft()) {
         // adding to left side
@@ -185,6 +322,7 @@ void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
             // Need to rotate around parent immediately
             if (newNode->getKey() < parent->getKey()) {
                 // Left Left case: newNode is left child of parent
+                BST_METRIC_ADD(this, METRIC_SINGLE_ROTATIONS, 1);
                 rotateRight(parent);
                 parent->setBalance(0);
                 newNode->setBalance(0);
@@ -210,6 +348,7 @@ void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
             // Need to rotate around parent immediately
             if (newNode->getKey() > parent->getKey()) {
                 // Right Right case: newNode is right child of parent
+                BST_METRIC_ADD(this, METRIC_SINGLE_ROTATIONS, 1);
                 rotateLeft(parent);
                 parent->setBalance(0);
                 newNode->setBalance(0);
@@ -222,6 +361,9 @@ void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
             }
         }
     }
+
+    // every subtree that gained a node is an ancestor of newNode, even after rotating
+    pullUpToRoot(newNode->getParent());
 }
 
 /*
@@ -231,12 +373,26 @@ void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
 template<class Key, class Value>
 void AVLTree<Key, Value>:: remove(const Key& key)
 {
-    AVLNode<Key, Value>* toDelete = static_cast<AVLNode<Key, Value>*>(this->internalFind(key));
+    BST_METRIC_OP(this, METRIC_REMOVE);
+
+    Node<Key, Value>* toDelete = this->internalFind(key);
     
     if (toDelete == NULL) {
         return; // not there, nothing to do
     }
     
+    delete unlinkNode(toDelete);
+    BST_METRIC_ADD(this, METRIC_FREES, 1);
+}
+
+/*
+ * Takes a node out and rebalances, returning it detached.
+ */
+template<class Key, class Value>
+Node<Key, Value>* AVLTree<Key, Value>::unlinkNode(Node<Key, Value>* node)
+{
+    AVLNode<Key, Value>* toDelete = static_cast<AVLNode<Key, Value>*>(node);
+
     // if it has 2 kids, swap with predecessor like regular BST
     if (toDelete->getLeft() != NULL && toDelete->getRight() != NULL) {
         AVLNode<Key, Value>* pred = static_cast<AVLNode<Key, Value>*>(BinarySearchTree<Key, Value>::predecessor(toDelete));
@@ -280,13 +436,20 @@ void AVLTree<Key, Value>:: remove(const Key& key)
         }
     }
     
-    delete toDelete;
+    toDelete->setParent(NULL);
+    toDelete->setLeft(NULL);
+    toDelete->setRight(NULL);
     
     // rebalance the tree starting from parent using the standard AVL approach
     // I spent way too much time debugging this part
     if (parent != NULL) {
         fixTree(parent, diff);
     }
+
+    // parent still holds the spot toDelete was unlinked from, so every
+    // subtree that lost a node is parent or above it
+    pullUpToRoot(parent);
+    return toDelete;
 }
 
 template<class Key, class Value>
@@ -296,6 +459,11 @@ void AVLTree<Key, Value>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>*
     int8_t tempB = n1->getBalance();
     n1->setBalance(n2->getBalance());
     n2->setBalance(tempB);
+    // the two nodes traded places, so they trade subtree profiles too
+    uint8_t tempMin = n1->getMinLeafDepth();
+    uint8_t tempMax = n1->getMaxLeafDepth();
+    n1->setLeafDepths(n2->getMinLeafDepth(), n2->getMaxLeafDepth());
+    n2->setLeafDepths(tempMin, tempMax);
 }
 
 // this is where all the AVL rotation stuff happens
@@ -307,6 +475,7 @@ void AVLTree<Key, Value>::bubbleUp(AVLNode<Key, Value>* parent, AVLNode<Key, Val
     }
     
     AVLNode<Key, Value>* g = parent->getParent(); // grandparent
+    BST_METRIC_ADD(this, METRIC_REBALANCE_STEPS, 1);
     
     if (parent == g->getLeft()) {
         // parent is left child, so g gets more left heavy
@@ -321,6 +490,7 @@ void AVLTree<Key, Value>::bubbleUp(AVLNode<Key, Value>* parent, AVLNode<Key, Val
             AVLNode<Key, Value>* leftChild = static_cast<AVLNode<Key, Value>*>(g->getLeft());
             if (leftChild->getBalance() <= 0) {
                 // left left case (balance is -1 or 0)
+                BST_METRIC_ADD(this, METRIC_SINGLE_ROTATIONS, 1);
                 rotateRight(g);
                 if (leftChild->getBalance() == 0) {
                     // This case can happen in deletions, not insertions
@@ -333,6 +503,7 @@ void AVLTree<Key, Value>::bubbleUp(AVLNode<Key, Value>* parent, AVLNode<Key, Val
             } else {
                 // left right case (leftChild balance is 1)
                 AVLNode<Key, Value>* grandchild = static_cast<AVLNode<Key, Value>*>(leftChild->getRight());
+                BST_METRIC_ADD(this, METRIC_DOUBLE_ROTATIONS, 1);
                 rotateLeft(leftChild);
                 rotateRight(g);
                 
@@ -361,6 +532,7 @@ void AVLTree<Key, Value>::bubbleUp(AVLNode<Key, Value>* parent, AVLNode<Key, Val
                 AVLNode<Key, Value>* rightChild = static_cast<AVLNode<Key, Value>*>(g->getRight());
                 if (rightChild->getBalance() >= 0) {
                     // right right case (balance is 1 or 0)
+                    BST_METRIC_ADD(this, METRIC_SINGLE_ROTATIONS, 1);
                     rotateLeft(g);
                     if (rightChild->getBalance() == 0) {
                         // This case can happen in deletions, not insertions  
@@ -373,6 +545,7 @@ void AVLTree<Key, Value>::bubbleUp(AVLNode<Key, Value>* parent, AVLNode<Key, Val
                 } else {
                     // right left case (rightChild balance is -1)
                     AVLNode<Key, Value>* grandchild = static_cast<AVLNode<Key, Value>*>(rightChild->getLeft());
+                    BST_METRIC_ADD(this, METRIC_DOUBLE_ROTATIONS, 1);
                     rotateRight(rightChild);
                     rotateLeft(g);
                     
@@ -402,6 +575,7 @@ void AVLTree<Key, Value>::fixTree(AVLNode<Key, Value>* node, int8_t diff)
     
     AVLNode<Key, Value>* parent = node->getParent();
     int8_t nextDiff = 0;
+    BST_METRIC_ADD(this, METRIC_REBALANCE_STEPS, 1);
     
     // figure out what diff to use for parent
     if (parent != NULL) {
@@ -438,6 +612,7 @@ void AVLTree<Key, Value>::fixTree(AVLNode<Key, Value>* node, int8_t diff)
             
             if (child->getBalance() <= 0) {
                 // left left case
+                BST_METRIC_ADD(this, METRIC_SINGLE_ROTATIONS, 1);
                 rotateRight(node);
                 if (child->getBalance() == 0) {
                     // special case for removal
@@ -454,6 +629,7 @@ void AVLTree<Key, Value>::fixTree(AVLNode<Key, Value>* node, int8_t diff)
                 if (grandchild == NULL) {
                     return; // shouldn't happen in balanced tree, but safety check
                 }
+                BST_METRIC_ADD(this, METRIC_DOUBLE_ROTATIONS, 1);
                 rotateLeft(child);
                 rotateRight(node);
                 
@@ -486,6 +662,7 @@ void AVLTree<Key, Value>::fixTree(AVLNode<Key, Value>* node, int8_t diff)
             
             if (child->getBalance() >= 0) {
                 // right-right case
+                BST_METRIC_ADD(this, METRIC_SINGLE_ROTATIONS, 1);
                 rotateLeft(node);
                 if (child->getBalance() == 0) {
                     // special case for removal
@@ -502,6 +679,7 @@ void AVLTree<Key, Value>::fixTree(AVLNode<Key, Value>* node, int8_t diff)
                 if (grandchild == NULL) {
                     return; // shouldn't happen in balanced tree, but safety check
                 }
+                BST_METRIC_ADD(this, METRIC_DOUBLE_ROTATIONS, 1);
                 rotateRight(child);
                 rotateLeft(node);
                 
@@ -527,6 +705,8 @@ template<class Key, class Value>
 void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value>* node)
 {
     AVLNode<Key, Value>* rightKid = node->getRight();
+    pushDown(node);
+    pushDown(rightKid);
     node->setRight(rightKid->getLeft());
     
     if (rightKid->getLeft() != NULL) {
@@ -545,6 +725,9 @@ void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value>* node)
     
     rightKid->setLeft(node);
     node->setParent(rightKid);
+
+    pullUp(node);
+    pullUp(rightKid);
 }
 
 // rotate right. node goes down, left child goes up
@@ -552,6 +735,8 @@ template<class Key, class Value>
 void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value>* node)
 {
     AVLNode<Key, Value>* leftKid = node->getLeft();
+    pushDown(node);
+    pushDown(leftKid);
     node->setLeft(leftKid->getRight());
     
     if (leftKid->getRight() != NULL) {
@@ -570,45 +755,109 @@ void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value>* node)
     
     leftKid->setRight(node);
     node->setParent(leftKid);
+
+    pullUp(node);
+    pullUp(leftKid);
 }
 
-// Recursive helper for insert - replaces the while loop
+// pulls up per-subtree data from node up to the root, O(log n)
 template<class Key, class Value>
-AVLNode<Key, Value>* AVLTree<Key, Value>::insertHelper(AVLNode<Key, Value>* curr, const std::pair<const Key, Value>& new_item, AVLNode<Key, Value>*& newNode)
+void AVLTree<Key, Value>::pullUpToRoot(AVLNode<Key, Value>* node)
 {
-    if (curr == nullptr) {
-        // This shouldn't happen since we check for empty tree before calling this
-        return nullptr;
+    while (node != NULL) {
+        pullUp(node);
+        node = node->getParent();
     }
-    
-    if (new_item.first == curr->getKey()) {
-        // key already exists, just update the value and we're done
-        curr->setValue(new_item.second);
-        newNode = nullptr; // signal that no new node was created
-        return curr;
+}
+
+template<class Key, class Value>
+void AVLTree<Key, Value>::pullUpAll()
+{
+    // reversed pre-order visits every child before its parent
+    std::vector<AVLNode<Key, Value>*> preorder;
+    std::vector<AVLNode<Key, Value>*> stack;
+    if (this->root_ != NULL) {
+        stack.push_back(static_cast<AVLNode<Key, Value>*>(this->root_));
     }
-    
-    if (new_item.first < curr->getKey()) {
-        if (curr->getLeft() == nullptr) {
-            // Found insertion point on left
-            newNode = new AVLNode<Key, Value>(new_item.first, new_item.second, curr);
-            curr->setLeft(newNode);
-            return curr; // return parent of new node
-        } else {
-            // Keep searching left
-            return insertHelper(curr->getLeft(), new_item, newNode);
+    while (!stack.empty()) {
+        AVLNode<Key, Value>* node = stack.back();
+        stack.pop_back();
+        preorder.push_back(node);
+        if (node->getRight() != NULL) {
+            stack.push_back(node->getRight());
         }
-    } else {
-        if (curr->getRight() == nullptr) {
-            // Found insertion point on right
-            newNode = new AVLNode<Key, Value>(new_item.first, new_item.second, curr);
-            curr->setRight(newNode);
-            return curr; // return parent of new node
-        } else {
-            // Keep searching right
-            return insertHelper(curr->getRight(), new_item, newNode);
+        if (node->getLeft() != NULL) {
+            stack.push_back(node->getLeft());
         }
     }
+    for (size_t i = preorder.size(); i > 0; --i) {
+        pullUp(preorder[i - 1]);
+    }
+}
+
+template<class Key, class Value>
+void AVLTree<Key, Value>::pullUp(AVLNode<Key, Value>* node)
+{
+    node->updateLeafDepths();
+}
+
+template<class Key, class Value>
+void AVLTree<Key, Value>::pushDown(AVLNode<Key, Value>*)
+{
+
+}
+
+template<class Key, class Value>
+AVLNode<Key, Value>* AVLTree<Key, Value>::createNode(const Key& key, const Value& value, Node<Key, Value>* parent) const
+{
+    return new AVLNode<Key, Value>(key, value, static_cast<AVLNode<Key, Value>*>(parent));
+}
+
+template<class Key, class Value>
+bool AVLTree<Key, Value>::canLink(const Node<Key, Value>* node) const
+{
+    return dynamic_cast<const AVLNode<Key, Value>*>(node) != NULL;
+}
+
+template<class Key, class Value>
+uint8_t AVLTree<Key, Value>::snapshotFlags(const AVLNode<Key, Value>*) const
+{
+    return 0;
+}
+
+template<class Key, class Value>
+void AVLTree<Key, Value>::restoreSnapshotFlags(AVLNode<Key, Value>*, uint8_t flags)
+{
+    if (flags != 0) {
+        throw std::runtime_error("Snapshot has node flags this tree doesn't keep");
+    }
+}
+
+template<class Key, class Value>
+bool AVLTree<Key, Value>::allLeavesSameDepth() const
+{
+    return minLeafDepth() == maxLeafDepth();
+}
+
+template<class Key, class Value>
+int AVLTree<Key, Value>::minLeafDepth() const
+{
+    if (this->root_ == NULL) {
+        return -1;
+    }
+    return static_cast<AVLNode<Key, Value>*>(this->root_)->getMinLeafDepth();
 }
 
+template<class Key, class Value>
+int AVLTree<Key, Value>::maxLeafDepth() const
+{
+    if (this->root_ == NULL) {
+        return -1;
+    }
+    return static_cast<AVLNode<Key, Value>*>(this->root_)->getMaxLeafDepth();
+}
+
+// snapshot save/load (in its own file, like print_bst.h)
+#include "avl_snapshot.h"
+
 #endif
@@ -5,6 +5,23 @@
 #include <exception>
 #include <cstdlib>
 #include <utility>
+#include <vector>
+#include "bst_metrics.h"
+#include "work_pool.h"
+#include "tree_reclaimer.h"
+#include "snapshot_serializer.h"
+
+// Number of lookups findBatch keeps in flight at once
+#define BST_FIND_BATCH_GROUP 16
+
+template <typename Key>
+struct TreeExportOptions;
+
+#if defined(__GNUC__)
+#define BST_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define BST_PREFETCH(addr) ((void)0)
+#endif
 
 /**
  * A templated class for a Node in a search tree.
@@ -35,6 +52,10 @@ public:
     void setRight(Node<Key, Value>* right);
     void setValue(const Value &value);
 
+    // A copy of this node (item, plus whatever a subclass keeps per node)
+    // with no children, hung under parent. Used to copy trees node for node.
+    virtual Node<Key, Value>* clone(Node<Key, Value>* parent) const;
+
 protected:
     std::pair<const Key, Value> item_;
     Node<Key, Value>* parent_;
@@ -180,6 +201,15 @@ void Node<Key, Value>::setValue(const Value& value)
     item_.second = value;
 }
 
+/**
+* Copies the item into a new childless node under parent.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>* Node<Key, Value>::clone(Node<Key, Value>* parent) const
+{
+    return new Node<Key, Value>(item_.first, item_.second, parent);
+}
+
 /*
   ---------------------------------------
   End implementations for the Node class.
@@ -194,14 +224,34 @@ class BinarySearchTree
 {
 public:
     BinarySearchTree(); //TODO
+    BinarySearchTree(const BinarySearchTree<Key, Value>& other);
+    BinarySearchTree<Key, Value>& operator=(const BinarySearchTree<Key, Value>& other);
+    // Moves and swaps hand the nodes over in O(1). Both trees must be the
+    // same kind of tree (e.g. don't swap an AVLTree with a plain BST).
+    BinarySearchTree(BinarySearchTree<Key, Value>&& other) noexcept;
+    BinarySearchTree<Key, Value>& operator=(BinarySearchTree<Key, Value>&& other) noexcept;
+    void swap(BinarySearchTree<Key, Value>& other) noexcept;
     virtual ~BinarySearchTree(); //TODO
     virtual void insert(const std::pair<const Key, Value>& keyValuePair); //TODO
     virtual void remove(const Key& key); //TODO
     void clear(); //TODO
+    void clearAsync();
+    void setDeferredDestruction(bool enabled);
+    bool deferredDestruction() const;
     bool isBalanced() const; //TODO
     void print() const;
     bool empty() const;
 
+    // Operation counters and latency histograms (see bst_metrics.h).
+    // All zero unless compiled with -DBST_METRICS.
+    TreeMetricsSnapshot metrics() const;
+    void resetMetrics();
+
+    // Streams the whole tree as Graphviz DOT, JSON or a binary shape dump
+    // in one O(n) pass (see bst_export.h). For trees too big for print().
+    template<class KeySerializer = SnapshotSerializer<Key>, class ValueSerializer = SnapshotSerializer<Value> >
+    void exportTree(std::ostream& out, const TreeExportOptions<Key>& options = TreeExportOptions<Key>()) const;
+
     template<typename PPKey, typename PPValue>
     friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue> & tree);
 public:
@@ -227,16 +277,81 @@ public:
         Node<Key, Value> *current_;
     };
 
+    /**
+    * Owns a node taken out of a tree by extract() until it is inserted into
+    * a tree, or freed when the handle goes away. Move-only, like the C++17
+    * node handles. A node extracted from an AVLTree can go into any tree;
+    * an AVLTree only takes nodes that came from an AVLTree.
+    */
+    class node_type
+    {
+    public:
+        node_type();
+        node_type(node_type&& other) noexcept;
+        node_type& operator=(node_type&& other) noexcept;
+        ~node_type();
+
+        bool empty() const;
+        explicit operator bool() const;
+        const Key& key() const;
+        Value& mapped() const;
+
+    protected:
+        friend class BinarySearchTree<Key, Value>;
+        explicit node_type(Node<Key, Value>* node);
+        Node<Key, Value>* node_;
+
+    private:
+        // Not copyable: owns the node
+        node_type(const node_type& other);
+        node_type& operator=(const node_type& other);
+    };
+
+    /**
+    * Result of insert(node_type&&). If the key was already there nothing is
+    * inserted: position points at the existing entry and node gives the
+    * handle back.
+    */
+    struct insert_return_type
+    {
+        iterator position;
+        bool inserted;
+        node_type node;
+    };
+
 public:
+    // Move entries between trees without freeing, allocating or copying them
+    node_type extract(const Key& key);
+    node_type extract(iterator position);
+    insert_return_type insert(node_type&& handle);
+
     iterator begin() const;
     iterator end() const;
     iterator find(const Key& key) const;
+    void findBatch(const std::vector<Key>& keys, std::vector<iterator>& out) const;
     Value& operator[](const Key& key);
     Value const & operator[](const Key& key) const;
 
+    // Multi-threaded traversals over subtrees (see bst_parallel.h).
+    // The tree must not be modified while one is running.
+    template<class Function>
+    void parallelForEach(Function fn, const ParallelOptions& options = ParallelOptions()) const;
+    template<class T, class Fold>
+    T parallelReduce(T identity, Fold fold, const ParallelOptions& options = ParallelOptions()) const;
+    template<class T, class Fold, class Merge>
+    T parallelReduce(T identity, Fold fold, Merge merge, const ParallelOptions& options = ParallelOptions()) const;
+    template<class Function>
+    void parallelTransformValues(Function fn, const ParallelOptions& options = ParallelOptions());
+    // Replaces copy's contents with a copy of this tree, cloning subtrees
+    // concurrently. copy must be the same kind of tree as this one.
+    void parallelClone(BinarySearchTree<Key, Value>& copy, const ParallelOptions& options = ParallelOptions()) const;
+
 protected:
     // Mandatory helper functions
-    Node<Key, Value>* internalFind(const Key& k) const; // TODO
+    // find, operator[], remove and extract all look keys up through
+    // internalFind, so a subclass that hides some nodes or has a faster
+    // lookup overrides it once for all of them.
+    virtual Node<Key, Value>* internalFind(const Key& k) const; // TODO
     Node<Key, Value> *getSmallestNode() const;  // TODO
     static Node<Key, Value>* predecessor(Node<Key, Value>* current); // TODO
     // Note:  static means these functions don't have a "this" pointer
@@ -246,22 +361,75 @@ protected:
     virtual void printRoot (Node<Key, Value> *r) const;
     virtual void nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2) ;
 
+    // Allocates a detached node of the type this tree keeps. insert and
+    // the snapshot loader go through it, so subclasses with their own node
+    // type override it.
+    virtual Node<Key, Value>* createNode(const Key& key, const Value& value, Node<Key, Value>* parent) const;
+    // The structural halves of insert and remove, shared with the node
+    // handle versions. linkNode hangs a detached node under parent (NULL
+    // for an empty tree) on the side its key belongs, and rebalances if the
+    // tree does that. unlinkNode takes a node out (rebalancing too) and
+    // returns it detached, for the caller to free or keep.
+    virtual void linkNode(Node<Key, Value>* node, Node<Key, Value>* parent);
+    virtual Node<Key, Value>* unlinkNode(Node<Key, Value>* node);
+    // Where key goes: its node if it's already in the tree (returns NULL),
+    // else the node to hang it under (NULL if the tree is empty)
+    Node<Key, Value>* findLinkParent(const Key& key, Node<Key, Value>*& existing) const;
+    // Makes root, a detached tree built elsewhere (a copy, a clone, a
+    // snapshot, or NULL to empty the tree), the tree's contents and drops
+    // the old nodes, on the reclaimer thread if async. Every wholesale
+    // replacement of the contents goes through here.
+    void replaceRoot(Node<Key, Value>* root, bool async);
+    // Called by replaceRoot once the new contents are in. Subclasses that
+    // keep state about their nodes (counts, indexes) override it to
+    // recompute that state from the new tree. Does nothing here.
+    virtual void rootReplaced();
+    // The whole-tree passes that read nodes directly (print, exportTree
+    // and the parallel traversals) call settleNodes first, so a subclass
+    // holding deferred work for its nodes (see lazy_avl.h) can finish it.
+    // parallelTransformValues calls valuesRewritten once it has changed
+    // values in place, for subclasses that keep something computed from
+    // them (see aggregate_avl.h). Both do nothing here.
+    virtual void settleNodes() const;
+    virtual void valuesRewritten();
+
     // Add helper functions here
     void clearHelper(Node<Key, Value>* node);
     int getHeight(Node<Key, Value>* node) const;
     bool checkBalance(Node<Key, Value>* node) const;
-    Node<Key, Value>* insertHelper(Node<Key, Value>* node, const std::pair<const Key, Value>& keyValuePair, Node<Key, Value>* parent);
     Node<Key, Value>* internalFindHelper(Node<Key, Value>* node, const Key& key) const;
     Node<Key, Value>* getSmallestHelper(Node<Key, Value>* node) const;
     static Node<Key, Value>* getRightmostHelper(Node<Key, Value>* node);
     static Node<Key, Value>* findPredecessorAncestorHelper(Node<Key, Value>* current, Node<Key, Value>* parent);
+    Node<Key, Value>* cloneTree(const Node<Key, Value>* root);
+    static void cloneChildren(const Node<Key, Value>* src, Node<Key, Value>* dst, int depth, int splitDepth, WorkStealingPool* pool, TaskGroup* group);
+
+    // Parallel traversal helpers (bst_parallel.h)
+    template<class Visitor>
+    void parallelVisit(const Visitor& visitor, const ParallelOptions& options) const;
+    template<class Visitor>
+    static void splitWalk(WorkStealingPool& pool, TaskGroup& group, Node<Key, Value>* node, int depth, int splitDepth, Visitor visitor);
+    template<class Visitor>
+    static void visitChunk(Node<Key, Value>* subtree, Node<Key, Value>* after, Visitor& visitor);
+    static void collectChunks(Node<Key, Value>* node, int depth, int chunkDepth, std::vector<std::pair<Node<Key, Value>*, Node<Key, Value>*> >& chunks);
 
 
 protected:
     Node<Key, Value>* root_;
     // You should not need other data members
+    bool deferredDestruction_;
+#ifdef BST_METRICS
+    mutable TreeMetrics metrics_;
+#endif
 };
 
+// Non-member swap, so generic code using swap(a, b) gets the O(1) one
+template<class Key, class Value>
+void swap(BinarySearchTree<Key, Value>& a, BinarySearchTree<Key, Value>& b) noexcept
+{
+    a.swap(b);
+}
+
 /*
 --------------------------------------------------------------
 Begin implementations for the BinarySearchTree::iterator class.
@@ -368,6 +536,97 @@ BinarySearchTree<Key, Value>::iterator::operator++()
 /*
 -------------------------------------------------------------
 End implementations for the BinarySearchTree::iterator class.
+---------------------------------------------------------------
+*/
+
+/*
+--------------------------------------------------------------
+Begin implementations for the BinarySearchTree::node_type class.
+---------------------------------------------------------------
+*/
+
+/**
+* An empty handle.
+*/
+template<class Key, class Value>
+BinarySearchTree<Key, Value>::node_type::node_type() :
+    node_(NULL)
+{
+
+}
+
+/**
+* A handle owning a detached node.
+*/
+template<class Key, class Value>
+BinarySearchTree<Key, Value>::node_type::node_type(Node<Key, Value>* node) :
+    node_(node)
+{
+
+}
+
+template<class Key, class Value>
+BinarySearchTree<Key, Value>::node_type::node_type(node_type&& other) noexcept :
+    node_(other.node_)
+{
+    other.node_ = NULL;
+}
+
+template<class Key, class Value>
+typename BinarySearchTree<Key, Value>::node_type&
+BinarySearchTree<Key, Value>::node_type::operator=(node_type&& other) noexcept
+{
+    if (this != &other) {
+        delete node_;
+        node_ = other.node_;
+        other.node_ = NULL;
+    }
+    return *this;
+}
+
+/**
+* Frees the node if it was never inserted anywhere.
+*/
+template<class Key, class Value>
+BinarySearchTree<Key, Value>::node_type::~node_type()
+{
+    delete node_;
+}
+
+template<class Key, class Value>
+bool BinarySearchTree<Key, Value>::node_type::empty() const
+{
+    return node_ == NULL;
+}
+
+template<class Key, class Value>
+BinarySearchTree<Key, Value>::node_type::operator bool() const
+{
+    return node_ != NULL;
+}
+
+/**
+* The key of the owned node. The handle must not be empty.
+*/
+template<class Key, class Value>
+const Key& BinarySearchTree<Key, Value>::node_type::key() const
+{
+    return node_->getKey();
+}
+
+/**
+* The value of the owned node, which may be changed before inserting it.
+* The handle must not be empty.
+*/
+template<class Key, class Value>
+Value& BinarySearchTree<Key, Value>::node_type::mapped() const
+{
+    return node_->getValue();
+}
+
+/*
+---------------------------------------------------------------
+End implementations for the BinarySearchTree::node_type class.
 -------------------------------------------------------------
 */
 
@@ -384,15 +643,87 @@ template<class Key, class Value>
 BinarySearchTree<Key, Value>::BinarySearchTree() 
 {
     root_ = NULL;
+    deferredDestruction_ = false;
+}
+
+/**
+* Copy constructor. Clones other node for node in O(n), so the copy has the
+* same shape (and, for AVL trees, the same balance factors) without
+* re-inserting anything. Metrics start from zero.
+*/
+template<class Key, class Value>
+BinarySearchTree<Key, Value>::BinarySearchTree(const BinarySearchTree<Key, Value>& other)
+{
+    root_ = cloneTree(other.root_);
+    deferredDestruction_ = other.deferredDestruction_;
+}
+
+/**
+* Copy assignment. The copy is made before the old nodes are dropped, so
+* if it throws this tree is left as it was.
+*/
+template<class Key, class Value>
+BinarySearchTree<Key, Value>& BinarySearchTree<Key, Value>::operator=(const BinarySearchTree<Key, Value>& other)
+{
+    if (this != &other) {
+        replaceRoot(cloneTree(other.root_), deferredDestruction_);
+    }
+    return *this;
+}
+
+/**
+* Move constructor. Takes other's nodes in O(1), leaving it empty.
+* Metrics stay with the tree object, so the new tree starts from zero.
+*/
+template<class Key, class Value>
+BinarySearchTree<Key, Value>::BinarySearchTree(BinarySearchTree<Key, Value>&& other) noexcept
+{
+    root_ = other.root_;
+    deferredDestruction_ = other.deferredDestruction_;
+    other.root_ = NULL;
+}
+
+/**
+* Move assignment. Frees this tree's nodes right away, even in deferred
+* destruction mode, since handing them to the reclaimer allocates and
+* could throw. Then takes other's.
+*/
+template<class Key, class Value>
+BinarySearchTree<Key, Value>& BinarySearchTree<Key, Value>::operator=(BinarySearchTree<Key, Value>&& other) noexcept
+{
+    if (this != &other) {
+        clearHelper(root_);
+        root_ = other.root_;
+        other.root_ = NULL;
+    }
+    return *this;
+}
+
+/**
+* Exchanges the contents of two trees in O(1). Settings such as deferred
+* destruction and the metrics stay with each tree object.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::swap(BinarySearchTree<Key, Value>& other) noexcept
+{
+    std::swap(root_, other.root_);
 }
 
 /**
-* Destructor - called when BST object is destroyed
+* Destructor - called when BST object is destroyed. In deferred
+* destruction mode the nodes go to the reclaimer, unless handing them over
+* throws, in which case they are freed here.
 */
 template<typename Key, typename Value>
 BinarySearchTree<Key, Value>::~BinarySearchTree()
 {
-    clear();
+    try {
+        clear();
+    }
+    catch (...) {
+        clearHelper(root_);
+        root_ = NULL;
+    }
 }
 
 /**
@@ -404,9 +735,31 @@ bool BinarySearchTree<Key, Value>::empty() const
     return root_ == NULL;
 }
 
+/**
+ * Returns a snapshot of the tree's operation metrics
+*/
+template<class Key, class Value>
+TreeMetricsSnapshot BinarySearchTree<Key, Value>::metrics() const
+{
+#ifdef BST_METRICS
+    return metrics_.snapshot();
+#else
+    return TreeMetricsSnapshot();
+#endif
+}
+
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::resetMetrics()
+{
+#ifdef BST_METRICS
+    metrics_.reset();
+#endif
+}
+
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::print() const
 {
+    settleNodes();
     printRoot(root_);
     std::cout << "\n";
 }
@@ -441,11 +794,70 @@ template<class Key, class Value>
 typename BinarySearchTree<Key, Value>::iterator
 BinarySearchTree<Key, Value>::find(const Key & k) const
 {
+    BST_METRIC_OP(this, METRIC_FIND);
     Node<Key, Value> *curr = internalFind(k);
     BinarySearchTree<Key, Value>::iterator it(curr);
     return it;
 }
 
+/**
+* Looks up every key in keys and stores the results in out, so that
+* out[i] == find(keys[i]).
+*
+* Up to BST_FIND_BATCH_GROUP descents are interleaved: each round moves
+* every in-flight lookup down one level and prefetches the node it will
+* read next, so the cache misses of different lookups overlap instead of
+* being paid one after another. A finished lookup's slot is refilled with
+* the next key straight away. With metrics on, a batch counts as one find.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::findBatch(const std::vector<Key>& keys, std::vector<iterator>& out) const
+{
+    BST_METRIC_OP(this, METRIC_FIND);
+    out.resize(keys.size());
+
+    Node<Key, Value>* cursor[BST_FIND_BATCH_GROUP];
+    size_t slot[BST_FIND_BATCH_GROUP];
+    size_t next = 0;
+    size_t active = 0;
+    while (active < BST_FIND_BATCH_GROUP && next < keys.size()) {
+        cursor[active] = root_;
+        slot[active++] = next++;
+    }
+    BST_PREFETCH(root_);
+
+    while (active > 0) {
+        for (size_t i = 0; i < active; ) {
+            Node<Key, Value>* node = cursor[i];
+            const Key& key = keys[slot[i]];
+            if (node != NULL) {
+                BST_METRIC_ADD(this, METRIC_NODES_VISITED, 1);
+                BST_METRIC_ADD(this, METRIC_COMPARISONS, 1);
+            }
+            if (node == NULL || key == node->getKey()) {
+                // done: record the result and reuse the slot for the next key
+                out[slot[i]] = iterator(node);
+                if (next < keys.size()) {
+                    cursor[i] = root_;
+                    slot[i] = next++;
+                    ++i;
+                }
+                else {
+                    --active;
+                    cursor[i] = cursor[active];
+                    slot[i] = slot[active];
+                }
+                continue;
+            }
+            BST_METRIC_ADD(this, METRIC_COMPARISONS, 1);
+            node = (key < node->getKey()) ? node->getLeft() : node->getRight();
+            BST_PREFETCH(node);
+            cursor[i] = node;
+            ++i;
+        }
+    }
+}
+
 /**
  * @precondition The key exists in the map
  * Returns the value associated with the key
@@ -453,6 +865,7 @@ BinarySearchTree<Key, Value>::find(const Key & k) const
 template<class Key, class Value>
 Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
 {
+    BST_METRIC_OP(this, METRIC_FIND);
     Node<Key, Value> *curr = internalFind(key);
     if(curr == NULL) throw std::out_of_range("Invalid key");
     return curr->getValue();
@@ -460,6 +873,7 @@ Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
 template<class Key, class Value>
 Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
 {
+    BST_METRIC_OP(this, METRIC_FIND);
     Node<Key, Value> *curr = internalFind(key);
     if(curr == NULL) throw std::out_of_range("Invalid key");
     return curr->getValue();
@@ -475,8 +889,16 @@ Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
 template<class Key, class Value>
 void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &keyValuePair)
 {
-    // Use recursive helper
-    root_ = insertHelper(root_, keyValuePair, NULL);
+    BST_METRIC_OP(this, METRIC_INSERT);
+    Node<Key, Value>* existing = NULL;
+    Node<Key, Value>* parent = findLinkParent(keyValuePair.first, existing);
+    if (existing != NULL) {
+        // Key already exists, just update value
+        existing->setValue(keyValuePair.second);
+        return;
+    }
+    BST_METRIC_ADD(this, METRIC_ALLOCATIONS, 1);
+    linkNode(createNode(keyValuePair.first, keyValuePair.second, parent), parent);
 }
 
 
@@ -488,12 +910,96 @@ void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &key
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::remove(const Key& key)
 {
+    BST_METRIC_OP(this, METRIC_REMOVE);
     Node<Key, Value>* toDelete = internalFind(key);
     
     if (toDelete == NULL) {
         return; // key not found, nothing to do
     }
     
+    delete unlinkNode(toDelete);
+    BST_METRIC_ADD(this, METRIC_FREES, 1);
+}
+
+/**
+* Takes the entry with the given key out of the tree without freeing it.
+* Returns an empty handle if the key isn't there.
+*/
+template<typename Key, typename Value>
+typename BinarySearchTree<Key, Value>::node_type BinarySearchTree<Key, Value>::extract(const Key& key)
+{
+    BST_METRIC_OP(this, METRIC_REMOVE);
+    Node<Key, Value>* node = internalFind(key);
+    if (node == NULL) {
+        return node_type();
+    }
+    return node_type(unlinkNode(node));
+}
+
+/**
+* Takes the entry at position (which must point into this tree) out of the
+* tree without freeing it. Only iterators to that entry are invalidated.
+*/
+template<typename Key, typename Value>
+typename BinarySearchTree<Key, Value>::node_type BinarySearchTree<Key, Value>::extract(iterator position)
+{
+    BST_METRIC_OP(this, METRIC_REMOVE);
+    if (position.current_ == NULL) {
+        return node_type();
+    }
+    return node_type(unlinkNode(position.current_));
+}
+
+/**
+* Links the handle's node into the tree as is: nothing is allocated or
+* copied. If the key is already in the tree the tree is left alone and the
+* handle is given back in the result.
+*/
+template<typename Key, typename Value>
+typename BinarySearchTree<Key, Value>::insert_return_type BinarySearchTree<Key, Value>::insert(node_type&& handle)
+{
+    BST_METRIC_OP(this, METRIC_INSERT);
+    insert_return_type result = { end(), false, node_type() };
+    if (handle.empty()) {
+        return result;
+    }
+    Node<Key, Value>* existing = NULL;
+    Node<Key, Value>* parent = findLinkParent(handle.key(), existing);
+    if (existing != NULL) {
+        result.position = iterator(existing);
+        result.node = std::move(handle);
+        return result;
+    }
+    // linkNode may refuse the node, in which case the handle keeps it
+    linkNode(handle.node_, parent);
+    result.position = iterator(handle.node_);
+    result.inserted = true;
+    handle.node_ = NULL;
+    return result;
+}
+
+/**
+* Hangs node (with no links of its own) under parent, or makes it the root.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::linkNode(Node<Key, Value>* node, Node<Key, Value>* parent)
+{
+    node->setParent(parent);
+    if (parent == NULL) {
+        root_ = node;
+    } else if (node->getKey() < parent->getKey()) {
+        parent->setLeft(node);
+    } else {
+        parent->setRight(node);
+    }
+}
+
+/**
+* Takes toDelete out of the tree and returns it with its links cleared.
+*/
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::unlinkNode(Node<Key, Value>* toDelete)
+{
     // Three cases to handle: 0 children, 1 child, or 2 children
     
     // Case 1: Node has 2 children - this is the tricky one
@@ -530,7 +1036,10 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
         toDelete->getParent()->setRight(child);
     }
     
-    delete toDelete;
+    toDelete->setParent(NULL);
+    toDelete->setLeft(NULL);
+    toDelete->setRight(NULL);
+    return toDelete;
 }
 
 
@@ -563,8 +1072,153 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
 template<typename Key, typename Value>
 void BinarySearchTree<Key, Value>::clear()
 {
-    clearHelper(root_);
-    root_ = NULL;
+    replaceRoot(NULL, deferredDestruction_);
+}
+
+/**
+* Empties the tree in O(1) by detaching the root; the nodes are freed
+* later on the background reclaimer thread (see tree_reclaimer.h).
+* TreeReclaimer::shared().drain() waits for that to finish.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::clearAsync()
+{
+    replaceRoot(NULL, true);
+}
+
+/**
+* If handing the old nodes to the reclaimer throws, root is freed and the
+* tree is left as it was.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::replaceRoot(Node<Key, Value>* root, bool async)
+{
+    if (root_ != NULL && async) {
+        try {
+            TreeReclaimer::defer(new NodeReclaimJob<Node<Key, Value> >(root_));
+        }
+        catch (...) {
+            clearHelper(root);
+            throw;
+        }
+    }
+    else {
+        clearHelper(root_);
+    }
+    root_ = root;
+    rootReplaced();
+}
+
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::rootReplaced()
+{
+
+}
+
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::settleNodes() const
+{
+
+}
+
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::valuesRewritten()
+{
+
+}
+
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::createNode(const Key& key, const Value& value, Node<Key, Value>* parent) const
+{
+    return new Node<Key, Value>(key, value, parent);
+}
+
+/**
+* In deferred destruction mode clear(), copy assignment, loadSnapshot and
+* the destructor hand the old nodes to the reclaimer like clearAsync(), so
+* dropping a huge tree doesn't stall the caller. Move assignment is
+* noexcept and always frees them itself.
+*
+* The setting belongs to the tree object: the copy and move constructors
+* take it from the source, while assignment and swap leave each tree's
+* own setting alone.
+*/
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::setDeferredDestruction(bool enabled)
+{
+    deferredDestruction_ = enabled;
+}
+
+template<typename Key, typename Value>
+bool BinarySearchTree<Key, Value>::deferredDestruction() const
+{
+    return deferredDestruction_;
+}
+
+// Clones a whole subtree, freeing the partial copy if an allocation throws
+template<typename Key, typename Value>
+Node<Key, Value>* BinarySearchTree<Key, Value>::cloneTree(const Node<Key, Value>* root)
+{
+    if (root == NULL) {
+        return NULL;
+    }
+    Node<Key, Value>* copy = root->clone(NULL);
+    try {
+        cloneChildren(root, copy, 0, -1, NULL, NULL);
+    }
+    catch (...) {
+        // every clone is linked in as soon as it's made, so this frees them all
+        clearHelper(copy);
+        throw;
+    }
+    return copy;
+}
+
+// Clones src's descendants under dst (already src's clone), with an explicit
+// stack so skinny trees can't overflow the call stack. Right subtrees above
+// splitDepth go to the pool as tasks of their own (see parallelClone).
+template<typename Key, typename Value>
+void BinarySearchTree<Key, Value>::cloneChildren(const Node<Key, Value>* src, Node<Key, Value>* dst, int depth, int splitDepth, WorkStealingPool* pool, TaskGroup* group)
+{
+    struct CloneFrame
+    {
+        const Node<Key, Value>* from;
+        Node<Key, Value>* to;
+        int depth;
+    };
+
+    std::vector<CloneFrame> pending;
+    CloneFrame first = { src, dst, depth };
+    pending.push_back(first);
+    while (!pending.empty()) {
+        const Node<Key, Value>* from = pending.back().from;
+        Node<Key, Value>* to = pending.back().to;
+        int d = pending.back().depth;
+        pending.pop_back();
+
+        if (from->getLeft() != NULL) {
+            Node<Key, Value>* left = from->getLeft()->clone(to);
+            to->setLeft(left);
+            CloneFrame frame = { from->getLeft(), left, d + 1 };
+            pending.push_back(frame);
+        }
+        if (from->getRight() != NULL) {
+            const Node<Key, Value>* rightSrc = from->getRight();
+            Node<Key, Value>* right = rightSrc->clone(to);
+            to->setRight(right);
+            if (d < splitDepth) {
+                // only this task writes below right, so no locking needed
+                int childDepth = d + 1;
+                pool->submit(*group, [rightSrc, right, childDepth, splitDepth, pool, group]() {
+                    cloneChildren(rightSrc, right, childDepth, splitDepth, pool, group);
+                });
+            }
+            else {
+                CloneFrame frame = { rightSrc, right, d + 1 };
+                pending.push_back(frame);
+            }
+        }
+    }
 }
 
 // Helper function to recursively delete nodes
@@ -581,6 +1235,7 @@ void BinarySearchTree<Key, Value>::clearHelper(Node<Key, Value>* node)
     
     // then delete current node
     delete node;
+    BST_METRIC_ADD(this, METRIC_FREES, 1);
 }
 
 
@@ -743,11 +1398,18 @@ void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value
    It will print up to 5 levels of the tree rooted at the passed node,
    in ASCII graphics format.
    We hope it will make debugging easier!
+   (To dump a whole tree, however big, use exportTree() instead.)
   */
 
 // include print function (in its own file because it's fairly long)
 #include "print_bst.h"
 
+// parallel traversals, also in their own file
+#include "bst_parallel.h"
+
+// streaming DOT/JSON/binary export
+#include "bst_export.h"
+
 // Recursive helper for getSmallestNode
 template<class Key, class Value>
 Node<Key, Value>* BinarySearchTree<Key, Value>::getSmallestHelper(Node<Key, Value>* node) const
@@ -761,34 +1423,24 @@ Node<Key, Value>* BinarySearchTree<Key, Value>::getSmallestHelper(Node<Key, Valu
     return getSmallestHelper(node->getLeft());
 }
 
-// Recursive helper for BST insert
+// Iterative descent for insert, counted like a lookup
 template<class Key, class Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::insertHelper(Node<Key, Value>* node, const std::pair<const Key, Value>& keyValuePair, Node<Key, Value>* parent)
+Node<Key, Value>* BinarySearchTree<Key, Value>::findLinkParent(const Key& key, Node<Key, Value>*& existing) const
 {
-    // Base case: found the spot to insert
-    if (node == NULL) {
-        return new Node<Key, Value>(keyValuePair.first, keyValuePair.second, parent);
-    }
-    
-    // Key already exists, just update value
-    if (keyValuePair.first == node->getKey()) {
-        node->setValue(keyValuePair.second);
-        return node;
-    }
-    
-    // Update parent pointer
-    node->setParent(parent);
-    
-    // Recurse left or right
-    if (keyValuePair.first < node->getKey()) {
-        Node<Key, Value>* newLeft = insertHelper(node->getLeft(), keyValuePair, node);
-        node->setLeft(newLeft);
-    } else {
-        Node<Key, Value>* newRight = insertHelper(node->getRight(), keyValuePair, node);
-        node->setRight(newRight);
+    Node<Key, Value>* parent = NULL;
+    Node<Key, Value>* node = root_;
+    existing = NULL;
+    while (node != NULL) {
+        BST_METRIC_ADD(this, METRIC_NODES_VISITED, 1);
+        BST_METRIC_ADD(this, METRIC_COMPARISONS, 2);
+        if (key == node->getKey()) {
+            existing = node;
+            return NULL;
+        }
+        parent = node;
+        node = (key < node->getKey()) ? node->getLeft() : node->getRight();
     }
-    
-    return node;
+    return parent;
 }
 
 // Recursive helper for BST internalFind
@@ -796,9 +1448,15 @@ template<class Key, class Value>
 Node<Key, Value>* BinarySearchTree<Key, Value>::internalFindHelper(Node<Key, Value>* node, const Key& key) const
 {
     // Base case: node is null or we found the key
-    if (node == NULL || key == node->getKey()) {
+    if (node == NULL) {
+        return node;
+    }
+    BST_METRIC_ADD(this, METRIC_NODES_VISITED, 1);
+    BST_METRIC_ADD(this, METRIC_COMPARISONS, 1);
+    if (key == node->getKey()) {
         return node;
     }
+    BST_METRIC_ADD(this, METRIC_COMPARISONS, 1);
     
     // Recurse left or right
     if (key < node->getKey()) {
@@ -0,0 +1,438 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <ostream>
+#include <streambuf>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifndef BST_EXPORT_H
+#define BST_EXPORT_H
+
+// Streaming tree export for offline analysis
+// Included at the bottom of bst.h, like print_bst.h.
+//
+// printRoot() is for eyeballing small trees: it stops at a few levels,
+// recomputes depths and heights for every node, and writes to std::cout.
+// exportTree() instead makes one iterative post-order pass over the whole
+// tree (O(n), no recursion, so skinny trees are fine), computing each
+// node's height and balance (right height - left height) from its
+// children on the way up. Records are built in a buffer and handed to the
+// ostream in EXPORT_BUFFER_SIZE chunks.
+//
+// Nodes come out in post-order, so a node's children are always written
+// before it. Filtered-out nodes are still walked (their heights count
+// toward their ancestors' balance) but not written. A filtered export is
+// the tree with those nodes spliced out: each written node's left/right
+// link goes to the nearest written node down that side, skipping any
+// filtered-out nodes in between. That is always one binary tree. A node
+// outside the key range has in-range nodes on one side at most, and a
+// node past the depth limit has none, so no written node is ever left
+// without its nearest written ancestor. depth, height and balance still
+// describe the node in the full tree.
+//
+// Formats:
+//   EXPORT_DOT     Graphviz digraph. Labels hold key, value (optional) and
+//                  balance; edges are labelled L and R.
+//   EXPORT_JSON    {"format":"bst-export","version":1,"order":"post",
+//                   "nodes":[{"id","key","value","depth","height",
+//                   "balance","left","right"}...],"count":n}
+//                  left/right are node ids, or null. Numbers stay numbers,
+//                  everything else is written with operator<< as a string.
+//   EXPORT_BINARY  header: "BSTEXPT\0", uint32 version, uint32 flags
+//                          (bit 0: values included)
+//                  records: uint8 shape (bit 0: left child written,
+//                           bit 1: right child written), varint depth,
+//                           zigzag varint balance, serialized key,
+//                           serialized value (if included)
+//                  trailer: uint8 0xFF, uint64 record count
+//                  Keys and values use the same serializers as
+//                  AVLTree snapshots (snapshot_serializer.h). Rebuild by
+//                  keeping a stack: each record pops its children. Filtered
+//                  or not, the stack ends with one node (the root) or none.
+
+#define EXPORT_BINARY_MAGIC "BSTEXPT"
+#define EXPORT_BINARY_VERSION 1
+#define EXPORT_BINARY_END 0xFF
+#define EXPORT_BUFFER_SIZE (1 << 16)
+
+enum TreeExportFormat { EXPORT_DOT, EXPORT_JSON, EXPORT_BINARY };
+
+/**
+* What exportTree writes, and which nodes. By default: every node, with
+* values. maxDepth counts edges from the root (0 is the root only), -1
+* means no limit. The key range is inclusive.
+*/
+template <typename Key>
+struct TreeExportOptions
+{
+    TreeExportOptions(TreeExportFormat exportFormat = EXPORT_DOT) :
+        format(exportFormat),
+        maxDepth(-1),
+        includeValues(true),
+        hasKeyRange(false),
+        minKey(),
+        maxKey()
+    {
+
+    }
+
+    TreeExportOptions& depthLimit(int depth)
+    {
+        maxDepth = depth;
+        return *this;
+    }
+
+    TreeExportOptions& keyRange(const Key& low, const Key& high)
+    {
+        hasKeyRange = true;
+        minKey = low;
+        maxKey = high;
+        return *this;
+    }
+
+    TreeExportOptions& values(bool include)
+    {
+        includeValues = include;
+        return *this;
+    }
+
+    TreeExportFormat format;
+    int maxDepth;
+    bool includeValues;
+    bool hasKeyRange;
+    Key minKey;
+    Key maxKey;
+};
+
+// Appends text with the characters DOT or JSON strings can't hold escaped
+inline void exportAppendEscaped(std::string& out, const std::string& text, bool json)
+{
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\n') {
+            out += "\\n";
+        }
+        else if (json && static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", static_cast<unsigned>(c));
+            out += escape;
+        }
+        else {
+            out += c;
+        }
+    }
+}
+
+// Appends text as a string value: quoted for JSON, bare inside a DOT label
+inline void exportAppendString(std::string& out, const std::string& text, bool json)
+{
+    if (json) {
+        out += '"';
+    }
+    exportAppendEscaped(out, text, json);
+    if (json) {
+        out += '"';
+    }
+}
+
+// Integers are most of the text, and snprintf is several times slower
+inline void exportAppendUnsigned(std::string& out, unsigned long long n)
+{
+    char digits[24];
+    char* start = digits + sizeof(digits);
+    do {
+        *--start = static_cast<char>('0' + n % 10);
+        n /= 10;
+    } while (n != 0);
+    out.append(start, digits + sizeof(digits) - start);
+}
+
+inline void exportAppendInteger(std::string& out, long long n)
+{
+    if (n < 0) {
+        out += '-';
+        exportAppendUnsigned(out, 0ULL - static_cast<unsigned long long>(n));
+    }
+    else {
+        exportAppendUnsigned(out, static_cast<unsigned long long>(n));
+    }
+}
+
+// Collects operator<< output in a string. (Not <sstream>: the test
+// harness includes bst.h with private redefined, which that header can't take.)
+class ExportStringBuf : public std::streambuf
+{
+public:
+    std::string text;
+
+protected:
+    virtual int_type overflow(int_type c)
+    {
+        if (c != traits_type::eof()) {
+            text += traits_type::to_char_type(c);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    virtual std::streamsize xsputn(const char* s, std::streamsize n)
+    {
+        text.append(s, static_cast<size_t>(n));
+        return n;
+    }
+};
+
+// Keys and values as text: numbers as they are, anything else through
+// operator<< as an escaped (and, for JSON, quoted) string
+template <typename T, bool Arithmetic = std::is_arithmetic<T>::value>
+struct ExportText
+{
+    static void append(std::string& out, const T& item, bool json)
+    {
+        ExportStringBuf buf;
+        std::ostream text(&buf);
+        text << item;
+        exportAppendString(out, buf.text, json);
+    }
+};
+
+template <typename T>
+struct ExportText<T, true>
+{
+    static void append(std::string& out, const T& item, bool json)
+    {
+        if (std::is_floating_point<T>::value) {
+            double d = static_cast<double>(item);
+            if (json && !std::isfinite(d)) {
+                out += "null";
+                return;
+            }
+            char digits[32];
+            int length = snprintf(digits, sizeof(digits), "%.17g", d);
+            out.append(digits, length);
+        }
+        else if (std::is_signed<T>::value) {
+            exportAppendInteger(out, static_cast<long long>(item));
+        }
+        else {
+            exportAppendUnsigned(out, static_cast<unsigned long long>(item));
+        }
+    }
+};
+
+template <>
+struct ExportText<std::string, false>
+{
+    static void append(std::string& out, const std::string& item, bool json)
+    {
+        exportAppendString(out, item, json);
+    }
+};
+
+inline void exportWriteVarint(std::string& out, uint64_t n)
+{
+    while (n >= 0x80) {
+        out += static_cast<char>((n & 0x7F) | 0x80);
+        n >>= 7;
+    }
+    out += static_cast<char>(n);
+}
+
+// Hands the buffer to the stream once it fills up
+inline void exportFlush(std::ostream& out, std::string& buffer, bool force)
+{
+    if (buffer.size() >= EXPORT_BUFFER_SIZE || (force && !buffer.empty())) {
+        out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+        if (!out) {
+            throw std::runtime_error("Could not write tree export");
+        }
+    }
+}
+
+/**
+* Writes the tree to out in the format and with the filters in options.
+* See the top of bst_export.h for the formats.
+*/
+template<class Key, class Value>
+template<class KeySerializer, class ValueSerializer>
+void BinarySearchTree<Key, Value>::exportTree(std::ostream& out, const TreeExportOptions<Key>& options) const
+{
+    // A node on the walk. Children report their height and the id of the
+    // nearest written node down their side (-1 if none) back into it
+    // before it is finished.
+    struct Frame
+    {
+        Node<Key, Value>* node;
+        int depth;
+        int stage;  // 0: left not walked yet, 1: walking left, 2: walking right
+        int leftHeight;
+        int rightHeight;
+        long long leftId;
+        long long rightId;
+    };
+
+    settleNodes();
+    const TreeExportFormat format = options.format;
+    const bool json = (format == EXPORT_JSON);
+    std::string buffer;
+    buffer.reserve(EXPORT_BUFFER_SIZE + 256);
+
+    if (format == EXPORT_DOT) {
+        buffer += "digraph BST {\n  node [shape=box];\n";
+    }
+    else if (json) {
+        buffer += "{\"format\":\"bst-export\",\"version\":1,\"order\":\"post\",\"nodes\":[";
+    }
+    else {
+        buffer.append(EXPORT_BINARY_MAGIC, sizeof(EXPORT_BINARY_MAGIC));
+        SnapshotSerializer<uint32_t>::write(buffer, EXPORT_BINARY_VERSION);
+        SnapshotSerializer<uint32_t>::write(buffer, options.includeValues ? 1 : 0);
+    }
+
+    long long written = 0;
+    std::vector<Frame> stack;
+    if (root_ != NULL) {
+        Frame rootFrame = { root_, 0, 0, 0, 0, -1, -1 };
+        stack.push_back(rootFrame);
+    }
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        if (frame.stage < 2) {
+            Node<Key, Value>* child = (frame.stage == 0) ? frame.node->getLeft() : frame.node->getRight();
+            ++frame.stage;
+            if (child != NULL) {
+                Frame childFrame = { child, frame.depth + 1, 0, 0, 0, -1, -1 };
+                stack.push_back(childFrame);
+            }
+            continue;
+        }
+
+        Node<Key, Value>* node = frame.node;
+        int height = std::max(frame.leftHeight, frame.rightHeight) + 1;
+        int balance = frame.rightHeight - frame.leftHeight;
+        const Key& key = node->getKey();
+        bool keep = (options.maxDepth < 0 || frame.depth <= options.maxDepth) &&
+                    (!options.hasKeyRange || (!(key < options.minKey) && !(options.maxKey < key)));
+        long long id = -1;
+        if (keep) {
+            id = written++;
+            if (format == EXPORT_DOT) {
+                buffer += "  n";
+                exportAppendInteger(buffer, id);
+                buffer += " [label=\"";
+                ExportText<Key>::append(buffer, key, false);
+                if (options.includeValues) {
+                    buffer += "\\n";
+                    ExportText<Value>::append(buffer, node->getValue(), false);
+                }
+                buffer += "\\nb=";
+                exportAppendInteger(buffer, balance);
+                buffer += "\"];\n";
+                if (frame.leftId >= 0) {
+                    buffer += "  n";
+                    exportAppendInteger(buffer, id);
+                    buffer += " -> n";
+                    exportAppendInteger(buffer, frame.leftId);
+                    buffer += " [label=\"L\"];\n";
+                }
+                if (frame.rightId >= 0) {
+                    buffer += "  n";
+                    exportAppendInteger(buffer, id);
+                    buffer += " -> n";
+                    exportAppendInteger(buffer, frame.rightId);
+                    buffer += " [label=\"R\"];\n";
+                }
+            }
+            else if (json) {
+                buffer += (id == 0) ? "\n{\"id\":" : ",\n{\"id\":";
+                exportAppendInteger(buffer, id);
+                buffer += ",\"key\":";
+                ExportText<Key>::append(buffer, key, true);
+                if (options.includeValues) {
+                    buffer += ",\"value\":";
+                    ExportText<Value>::append(buffer, node->getValue(), true);
+                }
+                buffer += ",\"depth\":";
+                exportAppendInteger(buffer, frame.depth);
+                buffer += ",\"height\":";
+                exportAppendInteger(buffer, height);
+                buffer += ",\"balance\":";
+                exportAppendInteger(buffer, balance);
+                buffer += ",\"left\":";
+                if (frame.leftId >= 0) {
+                    exportAppendInteger(buffer, frame.leftId);
+                }
+                else {
+                    buffer += "null";
+                }
+                buffer += ",\"right\":";
+                if (frame.rightId >= 0) {
+                    exportAppendInteger(buffer, frame.rightId);
+                }
+                else {
+                    buffer += "null";
+                }
+                buffer += '}';
+            }
+            else {
+                buffer += static_cast<char>((frame.leftId >= 0 ? 1 : 0) | (frame.rightId >= 0 ? 2 : 0));
+                exportWriteVarint(buffer, static_cast<uint64_t>(frame.depth));
+                // zigzag, so small negative balances stay one byte
+                exportWriteVarint(buffer, (static_cast<uint64_t>(balance) << 1) ^ static_cast<uint64_t>(balance >> 31));
+                KeySerializer::write(buffer, key);
+                if (options.includeValues) {
+                    ValueSerializer::write(buffer, node->getValue());
+                }
+            }
+            exportFlush(out, buffer, false);
+        }
+
+        // A filtered-out node passes up the nearest written node below it
+        // instead, so the parent links straight to that. Only one side can
+        // have one (see the top of the file).
+        if (!keep) {
+            id = (frame.leftId >= 0) ? frame.leftId : frame.rightId;
+        }
+
+        // frame is invalid once popped
+        stack.pop_back();
+        if (!stack.empty()) {
+            Frame& parent = stack.back();
+            if (parent.stage == 1) {
+                parent.leftHeight = height;
+                parent.leftId = id;
+            }
+            else {
+                parent.rightHeight = height;
+                parent.rightId = id;
+            }
+        }
+    }
+
+    if (format == EXPORT_DOT) {
+        buffer += "}\n";
+    }
+    else if (json) {
+        buffer += "\n],\"count\":";
+        exportAppendInteger(buffer, written);
+        buffer += "}\n";
+    }
+    else {
+        buffer += static_cast<char>(EXPORT_BINARY_END);
+        SnapshotSerializer<uint64_t>::write(buffer, static_cast<uint64_t>(written));
+    }
+    exportFlush(out, buffer, true);
+    out.flush();
+    if (!out) {
+        throw std::runtime_error("Could not write tree export");
+    }
+}
+
+#endif
@@ -0,0 +1,439 @@
+#ifndef BST_HASH_INDEX_H
+#define BST_HASH_INDEX_H
+
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+
+// smallest table the hash index allocates (a power of two)
+#define NODE_HASH_INDEX_MIN_CAPACITY 16
+
+/**
+* An open-addressing hash table from keys to the tree nodes holding them.
+* Slots hold the node pointer and the key's mixed hash, so a probe only
+* dereferences a node when the whole hash matches. Linear probing, at most
+* half full, and removal shifts later entries back instead of leaving
+* tombstones, so probe sequences stay short however many keys come and go.
+*/
+template <typename Key, typename Value, typename Hash = std::hash<Key> >
+class NodeHashIndex
+{
+public:
+    NodeHashIndex();
+
+    Node<Key, Value>* find(const Key& key) const;
+    // node must not be in the index yet
+    void insert(Node<Key, Value>* node);
+    void erase(const Key& key);
+    void clear();
+    // makes room for count entries, so inserts up to that size can't throw
+    void reserve(size_t count);
+
+    size_t size() const;
+    size_t memoryUsage() const;
+
+protected:
+    struct Slot
+    {
+        uint64_t hash;
+        Node<Key, Value>* node;     // NULL for an empty slot
+    };
+
+    uint64_t hashOf(const Key& key) const;
+    void grow();
+
+    std::vector<Slot> slots_;
+    size_t mask_;
+    size_t size_;
+    Hash hasher_;
+};
+
+/*
+-----------------------------------------------
+Begin implementations for the NodeHashIndex class.
+-----------------------------------------------
+*/
+
+template <typename Key, typename Value, typename Hash>
+NodeHashIndex<Key, Value, Hash>::NodeHashIndex() :
+    mask_(0),
+    size_(0)
+{
+
+}
+
+template <typename Key, typename Value, typename Hash>
+Node<Key, Value>* NodeHashIndex<Key, Value, Hash>::find(const Key& key) const
+{
+    if (size_ == 0) {
+        return NULL;
+    }
+    uint64_t hash = hashOf(key);
+    for (size_t i = hash & mask_; slots_[i].node != NULL; i = (i + 1) & mask_) {
+        if (slots_[i].hash == hash && slots_[i].node->getKey() == key) {
+            return slots_[i].node;
+        }
+    }
+    return NULL;
+}
+
+template <typename Key, typename Value, typename Hash>
+void NodeHashIndex<Key, Value, Hash>::insert(Node<Key, Value>* node)
+{
+    reserve(size_ + 1);
+    uint64_t hash = hashOf(node->getKey());
+    size_t i = hash & mask_;
+    while (slots_[i].node != NULL) {
+        i = (i + 1) & mask_;
+    }
+    slots_[i].hash = hash;
+    slots_[i].node = node;
+    ++size_;
+}
+
+/**
+* Backward-shift deletion: every later entry of the same probe run that
+* could sit in the freed slot moves back into it.
+*/
+template <typename Key, typename Value, typename Hash>
+void NodeHashIndex<Key, Value, Hash>::erase(const Key& key)
+{
+    if (size_ == 0) {
+        return;
+    }
+    uint64_t hash = hashOf(key);
+    size_t i = hash & mask_;
+    while (slots_[i].node != NULL && !(slots_[i].hash == hash && slots_[i].node->getKey() == key)) {
+        i = (i + 1) & mask_;
+    }
+    if (slots_[i].node == NULL) {
+        return;
+    }
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask_; slots_[j].node != NULL; j = (j + 1) & mask_) {
+        // distance from the entry's home slot to the hole vs. to where it is
+        size_t home = slots_[j].hash & mask_;
+        if (((hole - home) & mask_) < ((j - home) & mask_)) {
+            slots_[hole] = slots_[j];
+            hole = j;
+        }
+    }
+    slots_[hole].node = NULL;
+    --size_;
+}
+
+template <typename Key, typename Value, typename Hash>
+void NodeHashIndex<Key, Value, Hash>::clear()
+{
+    std::vector<Slot>().swap(slots_);
+    mask_ = 0;
+    size_ = 0;
+}
+
+template <typename Key, typename Value, typename Hash>
+void NodeHashIndex<Key, Value, Hash>::reserve(size_t count)
+{
+    while (count * 2 > slots_.size()) {
+        grow();
+    }
+}
+
+template <typename Key, typename Value, typename Hash>
+size_t NodeHashIndex<Key, Value, Hash>::size() const
+{
+    return size_;
+}
+
+template <typename Key, typename Value, typename Hash>
+size_t NodeHashIndex<Key, Value, Hash>::memoryUsage() const
+{
+    return sizeof(*this) + slots_.capacity() * sizeof(Slot);
+}
+
+// Mixes the user hash so identity hashes (std::hash<int>) of sequential
+// keys still spread over the table
+template <typename Key, typename Value, typename Hash>
+uint64_t NodeHashIndex<Key, Value, Hash>::hashOf(const Key& key) const
+{
+    uint64_t hash = static_cast<uint64_t>(hasher_(key)) * 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 32);
+}
+
+// Allocates the new table before touching the old one, so a failed
+// allocation leaves the index as it was
+template <typename Key, typename Value, typename Hash>
+void NodeHashIndex<Key, Value, Hash>::grow()
+{
+    size_t capacity = slots_.empty() ? NODE_HASH_INDEX_MIN_CAPACITY : slots_.size() * 2;
+    Slot empty = { 0, NULL };
+    std::vector<Slot> old(capacity, empty);
+    old.swap(slots_);
+    mask_ = capacity - 1;
+    for (size_t i = 0; i < old.size(); ++i) {
+        if (old[i].node != NULL) {
+            size_t j = old[i].hash & mask_;
+            while (slots_[j].node != NULL) {
+                j = (j + 1) & mask_;
+            }
+            slots_[j] = old[i];
+        }
+    }
+}
+
+/*
+---------------------------------------------
+End implementations for the NodeHashIndex class.
+---------------------------------------------
+*/
+
+/**
+* A tree with an opt-in hash side-index for point lookups: find,
+* findBatch, operator[] and the lookups of remove and extract go through a
+* NodeHashIndex in O(1) expected time, while iteration and everything
+* ordered still use the tree. Base
+* is the tree to index, AVLTree by default or BinarySearchTree; any tree
+* whose nodes all hold live entries works.
+*
+* The index is kept in sync through the linkNode and unlinkNode hooks, so
+* insert, remove and the node handle moves all maintain it, and rebuilt
+* through rootReplaced whenever the whole tree is replaced (clear, copy
+* assignment, parallelClone, loadSnapshot). nodeSwap moves nodes, not
+* keys, so a key's node never changes while it is in the tree and swaps
+* need no index update. indexMemoryUsage() reports what the index costs
+* on top of the tree.
+*/
+template <class Key, class Value, class Base = AVLTree<Key, Value>, class Hash = std::hash<Key> >
+class HashIndexedTree : public Base
+{
+public:
+    HashIndexedTree();
+    HashIndexedTree(const HashIndexedTree& other);
+    HashIndexedTree& operator=(const HashIndexedTree& other);
+    HashIndexedTree(HashIndexedTree&& other) noexcept;
+    HashIndexedTree& operator=(HashIndexedTree&& other) noexcept;
+    void swap(HashIndexedTree& other) noexcept;
+
+    /**
+    * The base tree's iterator, which the index lookups can also create.
+    */
+    class iterator : public Base::iterator
+    {
+    public:
+        iterator();
+        iterator(const typename Base::iterator& it);
+
+    protected:
+        friend class HashIndexedTree<Key, Value, Base, Hash>;
+        iterator(Node<Key, Value>* ptr);
+    };
+
+    iterator find(const Key& key) const;
+    void findBatch(const std::vector<Key>& keys, std::vector<typename Base::iterator>& out) const;
+
+    size_t size() const;
+    size_t indexMemoryUsage() const;
+
+protected:
+    virtual Node<Key, Value>* internalFind(const Key& key) const override;
+    virtual void linkNode(Node<Key, Value>* node, Node<Key, Value>* parent) override;
+    virtual Node<Key, Value>* unlinkNode(Node<Key, Value>* node) override;
+    virtual void rootReplaced() override;
+
+    // Indexes every node in the tree, from scratch
+    void rebuildIndex();
+
+    NodeHashIndex<Key, Value, Hash> index_;
+};
+
+/*
+---------------------------------------------------------
+Begin implementations for the HashIndexedTree::iterator class.
+---------------------------------------------------------
+*/
+
+template <class Key, class Value, class Base, class Hash>
+HashIndexedTree<Key, Value, Base, Hash>::iterator::iterator()
+{
+
+}
+
+template <class Key, class Value, class Base, class Hash>
+HashIndexedTree<Key, Value, Base, Hash>::iterator::iterator(const typename Base::iterator& it) :
+    Base::iterator(it)
+{
+
+}
+
+template <class Key, class Value, class Base, class Hash>
+HashIndexedTree<Key, Value, Base, Hash>::iterator::iterator(Node<Key, Value>* ptr)
+{
+    this->current_ = ptr;
+}
+
+/*
+-------------------------------------------------------
+End implementations for the HashIndexedTree::iterator class.
+-------------------------------------------------------
+*/
+
+/*
+-----------------------------------------------
+Begin implementations for the HashIndexedTree class.
+-----------------------------------------------
+*/
+
+template <class Key, class Value, class Base, class Hash>
+HashIndexedTree<Key, Value, Base, Hash>::HashIndexedTree()
+{
+
+}
+
+/**
+* The copy's nodes are new, so its index is rebuilt rather than copied.
+*/
+template <class Key, class Value, class Base, class Hash>
+HashIndexedTree<Key, Value, Base, Hash>::HashIndexedTree(const HashIndexedTree& other) :
+    Base(other)
+{
+    rebuildIndex();
+}
+
+template <class Key, class Value, class Base, class Hash>
+HashIndexedTree<Key, Value, Base, Hash>& HashIndexedTree<Key, Value, Base, Hash>::operator=(const HashIndexedTree& other)
+{
+    if (this != &other) {
+        // rebuilds the index through rootReplaced
+        Base::operator=(other);
+    }
+    return *this;
+}
+
+template <class Key, class Value, class Base, class Hash>
+HashIndexedTree<Key, Value, Base, Hash>::HashIndexedTree(HashIndexedTree&& other) noexcept :
+    Base(std::move(other)),
+    index_(std::move(other.index_))
+{
+    other.index_.clear();
+}
+
+template <class Key, class Value, class Base, class Hash>
+HashIndexedTree<Key, Value, Base, Hash>& HashIndexedTree<Key, Value, Base, Hash>::operator=(HashIndexedTree&& other) noexcept
+{
+    if (this != &other) {
+        Base::operator=(std::move(other));
+        index_ = std::move(other.index_);
+        other.index_.clear();
+    }
+    return *this;
+}
+
+template <class Key, class Value, class Base, class Hash>
+void HashIndexedTree<Key, Value, Base, Hash>::swap(HashIndexedTree& other) noexcept
+{
+    Base::swap(other);
+    std::swap(index_, other.index_);
+}
+
+// Non-member swap, so the index travels with the nodes
+template <class Key, class Value, class Base, class Hash>
+void swap(HashIndexedTree<Key, Value, Base, Hash>& a, HashIndexedTree<Key, Value, Base, Hash>& b) noexcept
+{
+    a.swap(b);
+}
+
+template <class Key, class Value, class Base, class Hash>
+typename HashIndexedTree<Key, Value, Base, Hash>::iterator HashIndexedTree<Key, Value, Base, Hash>::find(const Key& key) const
+{
+    BST_METRIC_OP(this, METRIC_FIND);
+    return iterator(index_.find(key));
+}
+
+template <class Key, class Value, class Base, class Hash>
+void HashIndexedTree<Key, Value, Base, Hash>::findBatch(const std::vector<Key>& keys, std::vector<typename Base::iterator>& out) const
+{
+    BST_METRIC_OP(this, METRIC_FIND);
+    out.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        out[i] = iterator(index_.find(keys[i]));
+    }
+}
+
+template <class Key, class Value, class Base, class Hash>
+size_t HashIndexedTree<Key, Value, Base, Hash>::size() const
+{
+    return index_.size();
+}
+
+template <class Key, class Value, class Base, class Hash>
+size_t HashIndexedTree<Key, Value, Base, Hash>::indexMemoryUsage() const
+{
+    return index_.memoryUsage();
+}
+
+template <class Key, class Value, class Base, class Hash>
+Node<Key, Value>* HashIndexedTree<Key, Value, Base, Hash>::internalFind(const Key& key) const
+{
+    return index_.find(key);
+}
+
+/**
+* The index grows before the node is linked: once the node is in the tree,
+* a failed allocation would leave it there unindexed, invisible to find
+* and size(). Hash must not throw.
+*/
+template <class Key, class Value, class Base, class Hash>
+void HashIndexedTree<Key, Value, Base, Hash>::linkNode(Node<Key, Value>* node, Node<Key, Value>* parent)
+{
+    index_.reserve(index_.size() + 1);
+    Base::linkNode(node, parent);
+    index_.insert(node);
+}
+
+template <class Key, class Value, class Base, class Hash>
+Node<Key, Value>* HashIndexedTree<Key, Value, Base, Hash>::unlinkNode(Node<Key, Value>* node)
+{
+    index_.erase(node->getKey());
+    return Base::unlinkNode(node);
+}
+
+template <class Key, class Value, class Base, class Hash>
+void HashIndexedTree<Key, Value, Base, Hash>::rootReplaced()
+{
+    Base::rootReplaced();
+    rebuildIndex();
+}
+
+template <class Key, class Value, class Base, class Hash>
+void HashIndexedTree<Key, Value, Base, Hash>::rebuildIndex()
+{
+    index_.clear();
+    std::vector<Node<Key, Value>*> stack;
+    if (this->root_ != NULL) {
+        stack.push_back(this->root_);
+    }
+    while (!stack.empty()) {
+        Node<Key, Value>* node = stack.back();
+        stack.pop_back();
+        index_.insert(node);
+        if (node->getLeft() != NULL) {
+            stack.push_back(node->getLeft());
+        }
+        if (node->getRight() != NULL) {
+            stack.push_back(node->getRight());
+        }
+    }
+}
+
+/*
+---------------------------------------------
+End implementations for the HashIndexedTree class.
+---------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,336 @@
+#ifndef BST_METRICS_H
+#define BST_METRICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifdef BST_METRICS
+#include <atomic>
+#include <chrono>
+#include <new>
+#endif
+
+// Operation counters and latency histograms for BinarySearchTree/AVLTree.
+//
+// Compile with -DBST_METRICS to turn them on. Without it the BST_METRIC_*
+// macros expand to nothing, the trees carry no extra data members, and
+// metrics() returns an all-zero snapshot.
+//
+// Counts are attributed to the outermost public operation running on the
+// calling thread (insert, remove or find), or to METRIC_OTHER otherwise.
+
+enum MetricOperation
+{
+    METRIC_INSERT,
+    METRIC_REMOVE,
+    METRIC_FIND,
+    METRIC_OTHER,
+    METRIC_OPERATION_COUNT
+};
+
+enum MetricCounter
+{
+    METRIC_COMPARISONS,
+    METRIC_NODES_VISITED,
+    METRIC_SINGLE_ROTATIONS,
+    METRIC_DOUBLE_ROTATIONS,
+    METRIC_REBALANCE_STEPS,
+    METRIC_ALLOCATIONS,
+    METRIC_FREES,
+    METRIC_COUNTER_COUNT
+};
+
+// HDR-style log-linear buckets: exact below 16ns, then 8 buckets per power of two
+#define METRIC_HISTOGRAM_BUCKETS 496
+
+/**
+* A latency histogram in nanoseconds, as returned in a snapshot.
+* Values are recorded with at most 12.5% relative error.
+*/
+struct LatencyHistogram
+{
+    LatencyHistogram()
+    {
+        memset(buckets, 0, sizeof(buckets));
+    }
+
+    static unsigned bucketFor(uint64_t nanos)
+    {
+        if (nanos < 16) {
+            return static_cast<unsigned>(nanos);
+        }
+        unsigned exponent = 63 - __builtin_clzll(nanos);
+        return 16 + (exponent - 4) * 8 + static_cast<unsigned>((nanos >> (exponent - 3)) & 7);
+    }
+
+    static uint64_t bucketLowerBound(unsigned bucket)
+    {
+        if (bucket < 16) {
+            return bucket;
+        }
+        unsigned exponent = (bucket - 16) / 8 + 4;
+        return static_cast<uint64_t>(8 + (bucket - 16) % 8) << (exponent - 3);
+    }
+
+    uint64_t count() const
+    {
+        uint64_t total = 0;
+        for (unsigned i = 0; i < METRIC_HISTOGRAM_BUCKETS; ++i) {
+            total += buckets[i];
+        }
+        return total;
+    }
+
+    // Returns the lower bound of the bucket holding the p-th quantile (0 <= p <= 1)
+    uint64_t percentile(double p) const
+    {
+        uint64_t total = count();
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p * (total - 1));
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < METRIC_HISTOGRAM_BUCKETS; ++i) {
+            seen += buckets[i];
+            if (seen > rank) {
+                return bucketLowerBound(i);
+            }
+        }
+        return bucketLowerBound(METRIC_HISTOGRAM_BUCKETS - 1);
+    }
+
+    uint64_t buckets[METRIC_HISTOGRAM_BUCKETS];
+};
+
+/**
+* Totals for one kind of operation.
+*/
+struct OperationMetrics
+{
+    OperationMetrics() : calls(0)
+    {
+        memset(counters, 0, sizeof(counters));
+    }
+
+    // average of a counter per call, e.g. perCall(METRIC_COMPARISONS)
+    double perCall(MetricCounter counter) const
+    {
+        return calls == 0 ? 0.0 : static_cast<double>(counters[counter]) / calls;
+    }
+
+    uint64_t calls;
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    LatencyHistogram latency;
+};
+
+/**
+* A point-in-time copy of a tree's metrics, indexed by MetricOperation.
+*/
+struct TreeMetricsSnapshot
+{
+    const OperationMetrics& operator[](MetricOperation op) const
+    {
+        return operations[op];
+    }
+
+    OperationMetrics operations[METRIC_OPERATION_COUNT];
+};
+
+#ifdef BST_METRICS
+
+/**
+* The live metrics of one tree. Each thread is assigned one of
+* METRIC_SHARDS cache-line-aligned shards and only ever does relaxed
+* atomic adds to it, so recording never takes a lock and threads don't
+* fight over the same cache lines. metrics() sums the shards.
+*
+* A shard is about 16 KB, almost all of it latency histograms, so shards
+* are only allocated the first time a thread records into them: a tree
+* that is never used costs METRIC_SHARDS pointers, and one only ever used
+* from one thread costs a single shard.
+*/
+class TreeMetrics
+{
+public:
+    static const unsigned METRIC_SHARDS = 8;
+
+    TreeMetrics()
+    {
+        for (unsigned s = 0; s < METRIC_SHARDS; ++s) {
+            shards_[s].store(NULL, std::memory_order_relaxed);
+        }
+    }
+
+    ~TreeMetrics()
+    {
+        for (unsigned s = 0; s < METRIC_SHARDS; ++s) {
+            Shard* shard = shards_[s].load(std::memory_order_relaxed);
+            if (shard != NULL) {
+                delete [] shard->storage;
+            }
+        }
+    }
+
+    void add(MetricCounter counter, uint64_t n)
+    {
+        Shard* s = shard();
+        if (s != NULL) {
+            s->counters[currentOperation()][counter].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    void record(MetricOperation op, uint64_t nanos)
+    {
+        Shard* s = shard();
+        if (s != NULL) {
+            s->calls[op].fetch_add(1, std::memory_order_relaxed);
+            s->latency[op][LatencyHistogram::bucketFor(nanos)].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void reset()
+    {
+        for (unsigned s = 0; s < METRIC_SHARDS; ++s) {
+            Shard* shard = shards_[s].load(std::memory_order_acquire);
+            if (shard != NULL) {
+                clearShard(*shard);
+            }
+        }
+    }
+
+    TreeMetricsSnapshot snapshot() const
+    {
+        TreeMetricsSnapshot result;
+        for (unsigned s = 0; s < METRIC_SHARDS; ++s) {
+            const Shard* shard = shards_[s].load(std::memory_order_acquire);
+            if (shard == NULL) {
+                continue;
+            }
+            for (unsigned op = 0; op < METRIC_OPERATION_COUNT; ++op) {
+                OperationMetrics& out = result.operations[op];
+                out.calls += shard->calls[op].load(std::memory_order_relaxed);
+                for (unsigned c = 0; c < METRIC_COUNTER_COUNT; ++c) {
+                    out.counters[c] += shard->counters[op][c].load(std::memory_order_relaxed);
+                }
+                for (unsigned b = 0; b < METRIC_HISTOGRAM_BUCKETS; ++b) {
+                    out.latency.buckets[b] += shard->latency[op][b].load(std::memory_order_relaxed);
+                }
+            }
+        }
+        return result;
+    }
+
+    static MetricOperation& currentOperation()
+    {
+        static thread_local MetricOperation op = METRIC_OTHER;
+        return op;
+    }
+
+    /**
+    * Marks the outermost public operation on this thread and records its
+    * latency when it ends. Nested scopes (e.g. an insert made by a derived
+    * tree's insert) are ignored.
+    */
+    class OperationScope
+    {
+    public:
+        OperationScope(TreeMetrics* metrics, MetricOperation op) :
+            metrics_(NULL)
+        {
+            if (currentOperation() == METRIC_OTHER) {
+                metrics_ = metrics;
+                op_ = op;
+                currentOperation() = op;
+                start_ = std::chrono::steady_clock::now();
+            }
+        }
+
+        ~OperationScope()
+        {
+            if (metrics_ != NULL) {
+                uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start_).count();
+                metrics_->record(op_, nanos);
+                currentOperation() = METRIC_OTHER;
+            }
+        }
+
+    private:
+        TreeMetrics* metrics_;
+        MetricOperation op_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+private:
+    // Not copyable: a copied tree starts with fresh metrics
+    TreeMetrics(const TreeMetrics& other);
+    TreeMetrics& operator=(const TreeMetrics& other);
+
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> calls[METRIC_OPERATION_COUNT];
+        std::atomic<uint64_t> counters[METRIC_OPERATION_COUNT][METRIC_COUNTER_COUNT];
+        std::atomic<uint64_t> latency[METRIC_OPERATION_COUNT][METRIC_HISTOGRAM_BUCKETS];
+        char* storage; // the allocation the shard was aligned within
+    };
+
+    static void clearShard(Shard& shard)
+    {
+        for (unsigned op = 0; op < METRIC_OPERATION_COUNT; ++op) {
+            shard.calls[op].store(0, std::memory_order_relaxed);
+            for (unsigned c = 0; c < METRIC_COUNTER_COUNT; ++c) {
+                shard.counters[op][c].store(0, std::memory_order_relaxed);
+            }
+            for (unsigned b = 0; b < METRIC_HISTOGRAM_BUCKETS; ++b) {
+                shard.latency[op][b].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // This thread's shard, allocated on first use. NULL if that allocation
+    // fails: recording runs inside destructors and noexcept moves, so it
+    // drops the sample rather than throw.
+    Shard* shard()
+    {
+        static std::atomic<unsigned> nextShard(0);
+        static thread_local unsigned index = nextShard.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+        Shard* existing = shards_[index].load(std::memory_order_acquire);
+        return (existing != NULL) ? existing : createShard(index);
+    }
+
+    // Threads that share an index can race to create its shard; the loser
+    // frees its copy and uses the winner's
+    Shard* createShard(unsigned index)
+    {
+        char* storage = new (std::nothrow) char[sizeof(Shard) + 64];
+        if (storage == NULL) {
+            return NULL;
+        }
+        // over-aligned types aren't aligned by new[] before C++17, so align by hand
+        uintptr_t aligned = (reinterpret_cast<uintptr_t>(storage) + 63) & ~static_cast<uintptr_t>(63);
+        Shard* created = new (reinterpret_cast<char*>(aligned)) Shard;
+        created->storage = storage;
+        clearShard(*created);
+        Shard* expected = NULL;
+        if (!shards_[index].compare_exchange_strong(expected, created, std::memory_order_acq_rel)) {
+            delete [] storage;
+            return expected;
+        }
+        return created;
+    }
+
+    std::atomic<Shard*> shards_[METRIC_SHARDS];
+};
+
+#define BST_METRIC_ADD(tree, counter, n) ((tree)->metrics_.add(counter, n))
+#define BST_METRIC_OP(tree, op) TreeMetrics::OperationScope bstMetricScope_(&(tree)->metrics_, op)
+
+#else
+
+#define BST_METRIC_ADD(tree, counter, n) ((void)0)
+#define BST_METRIC_OP(tree, op) ((void)0)
+
+#endif
+
+#endif
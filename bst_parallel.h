@@ -0,0 +1,383 @@
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#ifndef BST_PARALLEL_H
+#define BST_PARALLEL_H
+
+// Parallel traversals for BinarySearchTree
+// Included at the bottom of bst.h, like print_bst.h.
+//
+// Unordered jobs split adaptively: a task walks its subtree in pre-order
+// and hands each right subtree it passes, down to a few levels below
+// log2(threads), to the pool as a new task. Work stealing then evens out
+// lopsided subtrees.
+//
+// Ordered jobs first cut the tree at a fixed depth into chunks, each a
+// subtree followed by the ancestor that comes right after it in key order,
+// so every chunk is a contiguous key range. Each chunk is walked in order
+// and reduce results are merged in chunk order.
+//
+// Visitors give each task its own state:
+//   Visitor fork(size_t chunk) const   fresh visitor for a task
+//                                      (chunk is 0 for unordered jobs)
+//   void visit(std::pair<const Key, Value>& item)
+//   void finish()                      called once the task is done
+
+// levels of extra splitting below log2(threads) for unordered jobs
+#define BST_PARALLEL_EXTRA_SPLIT_DEPTH 4
+
+template<class Function>
+struct ParallelForEachVisitor
+{
+    ParallelForEachVisitor(Function f) : fn(f)
+    {
+
+    }
+
+    ParallelForEachVisitor fork(size_t) const
+    {
+        return *this;
+    }
+
+    template<class Item>
+    void visit(Item& item)
+    {
+        fn(item);
+    }
+
+    void finish()
+    {
+
+    }
+
+    Function fn;
+};
+
+template<class Function>
+struct ParallelTransformVisitor
+{
+    ParallelTransformVisitor(Function f) : fn(f)
+    {
+
+    }
+
+    ParallelTransformVisitor fork(size_t) const
+    {
+        return *this;
+    }
+
+    template<class Item>
+    void visit(Item& item)
+    {
+        item.second = fn(item.first, item.second);
+    }
+
+    void finish()
+    {
+
+    }
+
+    Function fn;
+};
+
+// Folds its items into acc, then files (chunk, acc) in the shared results
+template<class T, class Fold>
+struct ParallelReduceVisitor
+{
+    ParallelReduceVisitor(const T& identity, Fold f, std::vector<std::pair<size_t, T> >* out, std::mutex* lock) :
+        acc(identity), initial(identity), fold(f), chunk(0), results(out), resultsLock(lock)
+    {
+
+    }
+
+    ParallelReduceVisitor fork(size_t chunkIndex) const
+    {
+        ParallelReduceVisitor child(*this);
+        child.acc = initial;
+        child.chunk = chunkIndex;
+        return child;
+    }
+
+    template<class Item>
+    void visit(Item& item)
+    {
+        acc = fold(acc, item);
+    }
+
+    void finish()
+    {
+        std::lock_guard<std::mutex> guard(*resultsLock);
+        results->push_back(std::make_pair(chunk, acc));
+    }
+
+    T acc;
+    T initial;
+    Fold fold;
+    size_t chunk;
+    std::vector<std::pair<size_t, T> >* results;
+    std::mutex* resultsLock;
+};
+
+// merge for parallelReduce calls that don't pass one
+template<class T>
+struct ParallelPlus
+{
+    T operator()(const T& a, const T& b) const
+    {
+        return a + b;
+    }
+};
+
+/**
+* Calls fn(item) on every item, from several threads at once.
+* Unordered (the default): items are visited in no particular order.
+* Ordered: each contiguous key range is visited in key order by one thread.
+*/
+template<class Key, class Value>
+template<class Function>
+void BinarySearchTree<Key, Value>::parallelForEach(Function fn, const ParallelOptions& options) const
+{
+    parallelVisit(ParallelForEachVisitor<Function>(fn), options);
+}
+
+/**
+* Replaces every value with fn(key, value), from several threads at once,
+* then lets the tree recompute anything it derives from the values.
+*/
+template<class Key, class Value>
+template<class Function>
+void BinarySearchTree<Key, Value>::parallelTransformValues(Function fn, const ParallelOptions& options)
+{
+    parallelVisit(ParallelTransformVisitor<Function>(fn), options);
+    valuesRewritten();
+}
+
+/**
+* Returns identity folded with every item by fold(T, item), computed as
+* partial results over subtrees that are then combined with +.
+*/
+template<class Key, class Value>
+template<class T, class Fold>
+T BinarySearchTree<Key, Value>::parallelReduce(T identity, Fold fold, const ParallelOptions& options) const
+{
+    return parallelReduce(identity, fold, ParallelPlus<T>(), options);
+}
+
+/**
+* Same, but partial results are combined with merge(T, T). identity must
+* be an identity for merge. For unordered jobs merge must be commutative
+* and associative; for ordered jobs (options.ordered) associativity is
+* enough, and the result matches a sequential in-order fold.
+*/
+template<class Key, class Value>
+template<class T, class Fold, class Merge>
+T BinarySearchTree<Key, Value>::parallelReduce(T identity, Fold fold, Merge merge, const ParallelOptions& options) const
+{
+    std::vector<std::pair<size_t, T> > partials;
+    std::mutex partialsLock;
+    parallelVisit(ParallelReduceVisitor<T, Fold>(identity, fold, &partials, &partialsLock), options);
+
+    // tasks finish in any order; put ordered chunks back in key order
+    std::stable_sort(partials.begin(), partials.end(),
+        [](const std::pair<size_t, T>& a, const std::pair<size_t, T>& b) { return a.first < b.first; });
+    T result = identity;
+    for (size_t i = 0; i < partials.size(); ++i) {
+        result = merge(result, partials[i].second);
+    }
+    return result;
+}
+
+/**
+* Copies this tree into copy like copy assignment does, but right
+* subtrees near the root are cloned as separate tasks, so big trees are
+* copied on all cores. copy's old contents are dropped once the copy is
+* complete, through replaceRoot, so a subclass recomputes whatever it keeps
+* about its nodes; if a clone throws, copy is left as it was.
+*/
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::parallelClone(BinarySearchTree<Key, Value>& copy, const ParallelOptions& options) const
+{
+    if (typeid(copy) != typeid(*this)) {
+        throw std::logic_error("parallelClone needs a tree of the same type");
+    }
+    if (&copy == this) {
+        return;
+    }
+    Node<Key, Value>* newRoot = NULL;
+    if (root_ != NULL) {
+        WorkStealingPool* localPool = NULL;
+        if (options.threads != 0) {
+            localPool = new WorkStealingPool(options.threads);
+        }
+        WorkStealingPool& pool = (localPool != NULL) ? *localPool : WorkStealingPool::shared();
+
+        int log2Threads = 0;
+        while ((1u << log2Threads) < pool.size()) {
+            ++log2Threads;
+        }
+        int splitDepth = log2Threads + BST_PARALLEL_EXTRA_SPLIT_DEPTH;
+
+        TaskGroup group;
+        const Node<Key, Value>* root = root_;
+        WorkStealingPool* poolPtr = &pool;
+        TaskGroup* groupPtr = &group;
+        try {
+            newRoot = root->clone(NULL);
+            pool.submit(group, [root, newRoot, splitDepth, poolPtr, groupPtr]() {
+                cloneChildren(root, newRoot, 0, splitDepth, poolPtr, groupPtr);
+            });
+            pool.wait(group);
+        }
+        catch (...) {
+            // wait() only rethrows once every task is done, and every clone
+            // is linked in when it's made, so this frees the partial copy
+            copy.clearHelper(newRoot);
+            delete localPool;
+            throw;
+        }
+        delete localPool;
+    }
+    copy.replaceRoot(newRoot, copy.deferredDestruction_);
+}
+
+template<class Key, class Value>
+template<class Visitor>
+void BinarySearchTree<Key, Value>::parallelVisit(const Visitor& visitor, const ParallelOptions& options) const
+{
+    if (root_ == NULL) {
+        return;
+    }
+    settleNodes();
+    WorkStealingPool* localPool = NULL;
+    if (options.threads != 0) {
+        localPool = new WorkStealingPool(options.threads);
+    }
+    WorkStealingPool& pool = (localPool != NULL) ? *localPool : WorkStealingPool::shared();
+
+    int log2Threads = 0;
+    while ((1u << log2Threads) < pool.size()) {
+        ++log2Threads;
+    }
+
+    TaskGroup group;
+    try {
+        if (options.ordered) {
+            int chunkDepth = log2Threads;
+            while ((1u << chunkDepth) < pool.size() * std::max(1u, options.chunksPerThread)) {
+                ++chunkDepth;
+            }
+            std::vector<std::pair<Node<Key, Value>*, Node<Key, Value>*> > chunks;
+            collectChunks(root_, 0, chunkDepth, chunks);
+            for (size_t i = 0; i < chunks.size(); ++i) {
+                Node<Key, Value>* subtree = chunks[i].first;
+                Node<Key, Value>* after = chunks[i].second;
+                Visitor chunkVisitor = visitor.fork(i);
+                pool.submit(group, [subtree, after, chunkVisitor]() {
+                    Visitor v(chunkVisitor);
+                    visitChunk(subtree, after, v);
+                    v.finish();
+                });
+            }
+        }
+        else {
+            Node<Key, Value>* root = root_;
+            int splitDepth = log2Threads + BST_PARALLEL_EXTRA_SPLIT_DEPTH;
+            Visitor rootVisitor = visitor.fork(0);
+            WorkStealingPool* poolPtr = &pool;
+            TaskGroup* groupPtr = &group;
+            pool.submit(group, [poolPtr, groupPtr, root, splitDepth, rootVisitor]() {
+                splitWalk(*poolPtr, *groupPtr, root, 0, splitDepth, rootVisitor);
+            });
+        }
+        pool.wait(group);
+    }
+    catch (...) {
+        delete localPool;
+        throw;
+    }
+    delete localPool;
+}
+
+// Pre-order walk of one task's subtree, spawning right subtrees near the root as new tasks
+template<class Key, class Value>
+template<class Visitor>
+void BinarySearchTree<Key, Value>::splitWalk(WorkStealingPool& pool, TaskGroup& group, Node<Key, Value>* node, int depth, int splitDepth, Visitor visitor)
+{
+    std::vector<std::pair<Node<Key, Value>*, int> > pending;
+    pending.push_back(std::make_pair(node, depth));
+    while (!pending.empty()) {
+        Node<Key, Value>* curr = pending.back().first;
+        int d = pending.back().second;
+        pending.pop_back();
+        while (curr != NULL) {
+            visitor.visit(curr->getItem());
+            Node<Key, Value>* right = curr->getRight();
+            if (right != NULL) {
+                if (d < splitDepth) {
+                    Visitor child = visitor.fork(0);
+                    WorkStealingPool* poolPtr = &pool;
+                    TaskGroup* groupPtr = &group;
+                    int childDepth = d + 1;
+                    pool.submit(group, [poolPtr, groupPtr, right, childDepth, splitDepth, child]() {
+                        splitWalk(*poolPtr, *groupPtr, right, childDepth, splitDepth, child);
+                    });
+                }
+                else {
+                    pending.push_back(std::make_pair(right, d + 1));
+                }
+            }
+            curr = curr->getLeft();
+            ++d;
+        }
+    }
+    visitor.finish();
+}
+
+// In-order walk of subtree (if any), then after (if any)
+template<class Key, class Value>
+template<class Visitor>
+void BinarySearchTree<Key, Value>::visitChunk(Node<Key, Value>* subtree, Node<Key, Value>* after, Visitor& visitor)
+{
+    std::vector<Node<Key, Value>*> pending;
+    Node<Key, Value>* curr = subtree;
+    while (curr != NULL || !pending.empty()) {
+        while (curr != NULL) {
+            pending.push_back(curr);
+            curr = curr->getLeft();
+        }
+        curr = pending.back();
+        pending.pop_back();
+        visitor.visit(curr->getItem());
+        curr = curr->getRight();
+    }
+    if (after != NULL) {
+        visitor.visit(after->getItem());
+    }
+}
+
+// Cuts the tree at chunkDepth into in-order chunks of (subtree, following ancestor)
+template<class Key, class Value>
+void BinarySearchTree<Key, Value>::collectChunks(Node<Key, Value>* node, int depth, int chunkDepth, std::vector<std::pair<Node<Key, Value>*, Node<Key, Value>*> >& chunks)
+{
+    if (node == NULL) {
+        return;
+    }
+    if (depth == chunkDepth) {
+        chunks.push_back(std::make_pair(node, static_cast<Node<Key, Value>*>(NULL)));
+        return;
+    }
+    collectChunks(node->getLeft(), depth + 1, chunkDepth, chunks);
+    if (!chunks.empty() && chunks.back().second == NULL) {
+        chunks.back().second = node;
+    }
+    else {
+        chunks.push_back(std::make_pair(static_cast<Node<Key, Value>*>(NULL), node));
+    }
+    collectChunks(node->getRight(), depth + 1, chunkDepth, chunks);
+}
+
+#endif
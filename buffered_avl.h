@@ -0,0 +1,413 @@
+#ifndef BUFFERED_AVL_H
+#define BUFFERED_AVL_H
+
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <cstdlib>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+
+// default number of buffered writes before they are applied to the tree
+#define BUFFERED_AVL_DEFAULT_BUFFER (1 << 16)
+// writes collected unsorted before they are sorted into a run
+#define BUFFERED_AVL_TAIL_SIZE 64
+
+/**
+* A write-optimized AVL tree. insert and remove don't touch the tree:
+* they append a message (upsert or delete) to a buffer. Once bufferSize
+* messages have piled up they are applied to the tree in key order, so
+* neighbouring writes reuse the path the previous one just brought into
+* cache instead of each paying a full random descent. The newest message
+* for a key wins.
+*
+* The buffer is a short unsorted tail that new messages are appended to,
+* plus sorted runs kept like a binary counter (the logarithmic method of
+* LSM trees): run i holds up to TAIL_SIZE * 2^i messages, and a full tail
+* is sorted and carried up, merging with each occupied run on the way. A
+* message is merged O(log bufferSize) times, always sequentially, and
+* lower runs are always newer than higher ones.
+*
+* Lookups check the buffer first: a scan of the tail, then a binary search
+* per run. A key with pending messages has the newest one applied to the
+* tree on the spot (so even the const lookups may change the tree), and
+* all of them are marked applied, so iterators always point into the tree.
+* begin() flushes everything.
+*/
+template <typename Key, typename Value>
+class BufferedAVLTree
+{
+public:
+    typedef typename AVLTree<Key, Value>::iterator iterator;
+
+    BufferedAVLTree(size_t bufferSize = BUFFERED_AVL_DEFAULT_BUFFER);
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool isBalanced() const;
+    bool empty() const;
+
+    // Applies every buffered write to the tree
+    void flush() const;
+    // Writes buffered before they're applied; 0 applies them right away
+    size_t bufferSize() const;
+    void setBufferSize(size_t bufferSize);
+    // Buffered writes not applied yet
+    size_t pending() const;
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    void findBatch(const std::vector<Key>& keys, std::vector<iterator>& out) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+protected:
+    // A buffered write. Deletes carry a default-constructed value.
+    struct Message
+    {
+        Message(const Key& k, const Value& v, bool isDelete) :
+            key(k), value(v), erase(isDelete), applied(false)
+        {
+
+        }
+
+        Key key;
+        Value value;
+        bool erase;
+        bool applied;  // already applied by a lookup; merges drop it
+    };
+
+    typedef std::vector<Message> Run;
+
+    static bool messageLess(const Message& a, const Message& b)
+    {
+        return a.key < b.key;
+    }
+
+    static void sortTail(Run& tail);
+    static size_t mergeRuns(const Run& older, const Run& newer, Run& out);
+    void push(const Message& message);
+    void carryTail() const;
+    void applyPending(const Key& key) const;
+    void apply(const Message& message) const;
+
+    // The buffer is logically part of the map, so const lookups may drain it
+    mutable AVLTree<Key, Value> tree_;
+    mutable Run tail_;
+    mutable std::vector<Run> runs_;
+    mutable Run scratch_;
+    mutable size_t pending_;
+    size_t bufferSize_;
+};
+
+/*
+--------------------------------------------------
+Begin implementations for the BufferedAVLTree class.
+--------------------------------------------------
+*/
+
+template <typename Key, typename Value>
+BufferedAVLTree<Key, Value>::BufferedAVLTree(size_t bufferSize) :
+    pending_(0),
+    bufferSize_(bufferSize)
+{
+    tail_.reserve(BUFFERED_AVL_TAIL_SIZE);
+}
+
+/**
+* Buffers an upsert: the value replaces any earlier one for the key.
+*/
+template <typename Key, typename Value>
+void BufferedAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    push(Message(keyValuePair.first, keyValuePair.second, false));
+}
+
+/**
+* Buffers a delete. Removing a key that isn't there is fine, as for AVLTree.
+*/
+template <typename Key, typename Value>
+void BufferedAVLTree<Key, Value>::remove(const Key& key)
+{
+    push(Message(key, Value(), true));
+}
+
+template <typename Key, typename Value>
+void BufferedAVLTree<Key, Value>::clear()
+{
+    tail_.clear();
+    runs_.clear();
+    pending_ = 0;
+    tree_.clear();
+}
+
+template <typename Key, typename Value>
+bool BufferedAVLTree<Key, Value>::isBalanced() const
+{
+    flush();
+    return tree_.isBalanced();
+}
+
+/**
+* Flushes first: pending deletes may or may not empty the tree.
+*/
+template <typename Key, typename Value>
+bool BufferedAVLTree<Key, Value>::empty() const
+{
+    flush();
+    return tree_.empty();
+}
+
+/**
+* Merges the tail and every run into one sorted batch, newest write per
+* key winning, and applies it to the tree in key order.
+*/
+template <typename Key, typename Value>
+void BufferedAVLTree<Key, Value>::flush() const
+{
+    if (pending_ == 0) {
+        return;
+    }
+    Run batch;
+    sortTail(tail_);
+    batch.swap(tail_);
+    for (size_t i = 0; i < runs_.size(); ++i) {
+        if (!runs_[i].empty()) {
+            mergeRuns(runs_[i], batch, scratch_);
+            batch.swap(scratch_);
+        }
+    }
+    for (size_t i = 0; i < batch.size(); ++i) {
+        apply(batch[i]);
+    }
+    runs_.clear();
+    pending_ = 0;
+}
+
+template <typename Key, typename Value>
+size_t BufferedAVLTree<Key, Value>::bufferSize() const
+{
+    return bufferSize_;
+}
+
+template <typename Key, typename Value>
+void BufferedAVLTree<Key, Value>::setBufferSize(size_t bufferSize)
+{
+    bufferSize_ = bufferSize;
+    if (pending_ > bufferSize_) {
+        flush();
+    }
+}
+
+template <typename Key, typename Value>
+size_t BufferedAVLTree<Key, Value>::pending() const
+{
+    return pending_;
+}
+
+/**
+* Applies all buffered writes, then starts at the smallest key.
+*/
+template <typename Key, typename Value>
+typename BufferedAVLTree<Key, Value>::iterator BufferedAVLTree<Key, Value>::begin() const
+{
+    flush();
+    return tree_.begin();
+}
+
+template <typename Key, typename Value>
+typename BufferedAVLTree<Key, Value>::iterator BufferedAVLTree<Key, Value>::end() const
+{
+    return tree_.end();
+}
+
+template <typename Key, typename Value>
+typename BufferedAVLTree<Key, Value>::iterator BufferedAVLTree<Key, Value>::find(const Key& key) const
+{
+    applyPending(key);
+    return tree_.find(key);
+}
+
+template <typename Key, typename Value>
+void BufferedAVLTree<Key, Value>::findBatch(const std::vector<Key>& keys, std::vector<iterator>& out) const
+{
+    if (pending_ != 0) {
+        for (size_t i = 0; i < keys.size(); ++i) {
+            applyPending(keys[i]);
+        }
+    }
+    tree_.findBatch(keys, out);
+}
+
+template <typename Key, typename Value>
+Value& BufferedAVLTree<Key, Value>::operator[](const Key& key)
+{
+    applyPending(key);
+    return tree_[key];
+}
+
+template <typename Key, typename Value>
+Value const & BufferedAVLTree<Key, Value>::operator[](const Key& key) const
+{
+    applyPending(key);
+    return static_cast<const AVLTree<Key, Value>&>(tree_)[key];
+}
+
+template <typename Key, typename Value>
+void BufferedAVLTree<Key, Value>::push(const Message& message)
+{
+    if (bufferSize_ == 0) {
+        apply(message);
+        return;
+    }
+    tail_.push_back(message);
+    ++pending_;
+    if (pending_ >= bufferSize_) {
+        flush();
+    }
+    else if (tail_.size() >= BUFFERED_AVL_TAIL_SIZE) {
+        carryTail();
+    }
+}
+
+// Sorts a tail by key, keeping only the newest message for each key
+template <typename Key, typename Value>
+void BufferedAVLTree<Key, Value>::sortTail(Run& tail)
+{
+    // stable, so the last of several writes to a key stays last
+    std::stable_sort(tail.begin(), tail.end(), messageLess);
+    size_t kept = 0;
+    for (size_t i = 0; i < tail.size(); ++i) {
+        if (i + 1 < tail.size() && tail[i + 1].key == tail[i].key) {
+            continue;
+        }
+        tail[kept++] = tail[i];
+    }
+    tail.erase(tail.begin() + kept, tail.end());
+}
+
+// Merges two sorted runs; on equal keys newer wins. Messages already
+// applied by a lookup are dropped (a lookup marks a key in every run).
+// Returns how many unapplied older messages newer ones replaced.
+template <typename Key, typename Value>
+size_t BufferedAVLTree<Key, Value>::mergeRuns(const Run& older, const Run& newer, Run& out)
+{
+    size_t replaced = 0;
+    out.clear();
+    out.reserve(older.size() + newer.size());
+    size_t o = 0;
+    size_t n = 0;
+    while (o < older.size() || n < newer.size()) {
+        const Message* next;
+        if (n == newer.size() || (o < older.size() && older[o].key < newer[n].key)) {
+            next = &older[o++];
+        }
+        else {
+            if (o < older.size() && older[o].key == newer[n].key) {
+                replaced += !older[o].applied;
+                ++o;
+            }
+            next = &newer[n++];
+        }
+        if (!next->applied) {
+            out.push_back(*next);
+        }
+    }
+    return replaced;
+}
+
+// Sorts the tail into a run and carries it up, merging with occupied runs
+template <typename Key, typename Value>
+void BufferedAVLTree<Key, Value>::carryTail() const
+{
+    Run carry;
+    size_t tailSize = tail_.size();
+    sortTail(tail_);
+    // pending_ already excludes applied messages, so only the writes that
+    // were replaced by newer ones for the same key come off it
+    pending_ -= tailSize - tail_.size();
+    carry.swap(tail_);
+    tail_.reserve(BUFFERED_AVL_TAIL_SIZE);
+    for (size_t i = 0; ; ++i) {
+        if (i == runs_.size()) {
+            runs_.push_back(Run());
+        }
+        if (runs_[i].empty()) {
+            runs_[i].swap(carry);
+            break;
+        }
+        pending_ -= mergeRuns(runs_[i], carry, scratch_);
+        carry.swap(scratch_);
+        runs_[i].clear();
+    }
+}
+
+// Applies the newest buffered write to key, if any, and marks all of them applied
+template <typename Key, typename Value>
+void BufferedAVLTree<Key, Value>::applyPending(const Key& key) const
+{
+    if (pending_ == 0) {
+        return;
+    }
+    bool done = false;
+
+    // the tail is newest; take its last write and drop all of them
+    size_t kept = 0;
+    for (size_t i = tail_.size(); i > 0; --i) {
+        if (tail_[i - 1].key == key) {
+            apply(tail_[i - 1]);
+            done = true;
+            break;
+        }
+    }
+    if (done) {
+        for (size_t i = 0; i < tail_.size(); ++i) {
+            if (!(tail_[i].key == key)) {
+                tail_[kept++] = tail_[i];
+            }
+        }
+        pending_ -= tail_.size() - kept;
+        tail_.erase(tail_.begin() + kept, tail_.end());
+    }
+
+    // then the runs, newest first
+    Message probe(key, Value(), true);
+    for (size_t i = 0; i < runs_.size(); ++i) {
+        typename Run::iterator it = std::lower_bound(runs_[i].begin(), runs_[i].end(), probe, messageLess);
+        if (it == runs_[i].end() || !(it->key == key) || it->applied) {
+            continue;
+        }
+        if (!done) {
+            apply(*it);
+            done = true;
+        }
+        it->applied = true;
+        --pending_;
+    }
+}
+
+template <typename Key, typename Value>
+void BufferedAVLTree<Key, Value>::apply(const Message& message) const
+{
+    if (message.applied) {
+        return;
+    }
+    if (message.erase) {
+        tree_.remove(message.key);
+    }
+    else {
+        tree_.insert(std::make_pair(message.key, message.value));
+    }
+}
+
+/*
+------------------------------------------------
+End implementations for the BufferedAVLTree class.
+------------------------------------------------
+*/
+
+#endif
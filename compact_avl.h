@@ -0,0 +1,1036 @@
+#ifndef COMPACT_AVL_H
+#define COMPACT_AVL_H
+
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Most nodes a CompactVectorStorage holds. The links allow 2^31 - 1; it
+// can be defined smaller (before including this file) to test the limit.
+#ifndef COMPACT_AVL_MAX_NODES
+#define COMPACT_AVL_MAX_NODES 0x7FFFFFFFu
+#endif
+
+/**
+* A node for the compact AVL tree. Instead of a vtable and three 8-byte
+* pointers, the links are 32-bit indices into the storage backend that owns
+* the node. The balance factor needs no field of its own: the top bit of
+* left_ is set when the left subtree is taller, and the top bit of right_
+* is set when the right subtree is taller. This leaves 31 bits per link,
+* so a tree can hold up to 2^31 - 1 nodes.
+*/
+template <typename Key, typename Value>
+struct CompactAVLNode
+{
+    static const uint32_t NIL = 0x7FFFFFFFu;
+    static const uint32_t LINK_MASK = 0x7FFFFFFFu;
+    static const uint32_t HEAVY_BIT = 0x80000000u;
+
+    CompactAVLNode(const Key& key, const Value& value, uint32_t parent);
+
+    std::pair<const Key, Value> item_;
+    uint32_t left_;
+    uint32_t right_;
+    uint32_t parent_;
+};
+
+template <typename Key, typename Value>
+const uint32_t CompactAVLNode<Key, Value>::NIL;
+template <typename Key, typename Value>
+const uint32_t CompactAVLNode<Key, Value>::LINK_MASK;
+template <typename Key, typename Value>
+const uint32_t CompactAVLNode<Key, Value>::HEAVY_BIT;
+
+/**
+* Explicit constructor for a compact node. New nodes are leaves, so they
+* start balanced with no children.
+*/
+template <typename Key, typename Value>
+CompactAVLNode<Key, Value>::CompactAVLNode(const Key& key, const Value& value, uint32_t parent) :
+    item_(key, value),
+    left_(NIL),
+    right_(NIL),
+    parent_(parent)
+{
+
+}
+
+/**
+* The default storage backend for CompactAVLTree. Nodes live in one
+* contiguous array, and removed slots are chained into a free list so they
+* can be reused by later inserts.
+*
+* A removed node is destroyed right away, and its slot is kept as raw
+* storage holding the index of the next free slot; live_ records which
+* slots hold a node. A node is only marked live once its constructor has
+* returned, so a Key or Value copy that throws leaves the slot free and
+* the storage as it was.
+*
+* A storage backend must provide node(), allocate(), release(), root(),
+* setRoot(), size(), clear(), reserve() and memoryUsage().
+*/
+template <typename Key, typename Value>
+class CompactVectorStorage
+{
+public:
+    typedef CompactAVLNode<Key, Value> NodeType;
+
+    CompactVectorStorage();
+    CompactVectorStorage(const CompactVectorStorage& other);
+    CompactVectorStorage& operator=(const CompactVectorStorage& other);
+    ~CompactVectorStorage();
+
+    NodeType& node(uint32_t index);
+    const NodeType& node(uint32_t index) const;
+
+    uint32_t allocate(const Key& key, const Value& value, uint32_t parent);
+    void release(uint32_t index);
+
+    uint32_t root() const;
+    void setRoot(uint32_t root);
+    size_t size() const;
+    void clear();
+    void reserve(size_t count);
+    size_t memoryUsage() const;
+
+private:
+    // the next free slot after a free slot, kept in its raw storage
+    uint32_t freeLink(uint32_t index) const;
+    void setFreeLink(uint32_t index, uint32_t next);
+    // Moves every live node to a new array of the given capacity
+    void grow(size_t capacity);
+    void destroyAll();
+
+    NodeType* nodes_;
+    size_t used_;       // slots handed out so far, live or free
+    size_t capacity_;
+    std::vector<bool> live_;
+    uint32_t root_;
+    uint32_t freeHead_;
+    size_t size_;
+};
+
+template <typename Key, typename Value>
+CompactVectorStorage<Key, Value>::CompactVectorStorage() :
+    nodes_(NULL),
+    used_(0),
+    capacity_(0),
+    root_(NodeType::NIL),
+    freeHead_(NodeType::NIL),
+    size_(0)
+{
+
+}
+
+/**
+* Copies slot for slot, so indices (and the free list) stay the same.
+*/
+template <typename Key, typename Value>
+CompactVectorStorage<Key, Value>::CompactVectorStorage(const CompactVectorStorage& other) :
+    nodes_(NULL),
+    used_(0),
+    capacity_(0),
+    live_(other.live_),
+    root_(other.root_),
+    freeHead_(other.freeHead_),
+    size_(other.size_)
+{
+    if (other.used_ == 0) {
+        return;
+    }
+    nodes_ = static_cast<NodeType*>(::operator new(other.used_ * sizeof(NodeType)));
+    capacity_ = other.used_;
+    size_t i = 0;
+    try {
+        for (; i < other.used_; ++i) {
+            if (live_[i]) {
+                new (&nodes_[i]) NodeType(other.nodes_[i]);
+            }
+            else {
+                setFreeLink(static_cast<uint32_t>(i), other.freeLink(static_cast<uint32_t>(i)));
+            }
+        }
+    }
+    catch (...) {
+        while (i > 0) {
+            --i;
+            if (live_[i]) {
+                nodes_[i].~NodeType();
+            }
+        }
+        ::operator delete(nodes_);
+        throw;
+    }
+    used_ = other.used_;
+}
+
+template <typename Key, typename Value>
+CompactVectorStorage<Key, Value>& CompactVectorStorage<Key, Value>::operator=(const CompactVectorStorage& other)
+{
+    if (this != &other) {
+        CompactVectorStorage copy(other);
+        std::swap(nodes_, copy.nodes_);
+        std::swap(used_, copy.used_);
+        std::swap(capacity_, copy.capacity_);
+        live_.swap(copy.live_);
+        std::swap(root_, copy.root_);
+        std::swap(freeHead_, copy.freeHead_);
+        std::swap(size_, copy.size_);
+    }
+    return *this;
+}
+
+template <typename Key, typename Value>
+CompactVectorStorage<Key, Value>::~CompactVectorStorage()
+{
+    destroyAll();
+}
+
+template <typename Key, typename Value>
+typename CompactVectorStorage<Key, Value>::NodeType&
+CompactVectorStorage<Key, Value>::node(uint32_t index)
+{
+    return nodes_[index];
+}
+
+template <typename Key, typename Value>
+const typename CompactVectorStorage<Key, Value>::NodeType&
+CompactVectorStorage<Key, Value>::node(uint32_t index) const
+{
+    return nodes_[index];
+}
+
+template <typename Key, typename Value>
+uint32_t CompactVectorStorage<Key, Value>::freeLink(uint32_t index) const
+{
+    uint32_t next;
+    memcpy(&next, reinterpret_cast<const char*>(&nodes_[index]), sizeof(next));
+    return next;
+}
+
+template <typename Key, typename Value>
+void CompactVectorStorage<Key, Value>::setFreeLink(uint32_t index, uint32_t next)
+{
+    memcpy(reinterpret_cast<char*>(&nodes_[index]), &next, sizeof(next));
+}
+
+/**
+* Creates a node and returns its index. Free slots are reused before the
+* array grows. If the node's constructor throws, nothing changes.
+*/
+template <typename Key, typename Value>
+uint32_t CompactVectorStorage<Key, Value>::allocate(const Key& key, const Value& value, uint32_t parent)
+{
+    uint32_t index;
+    if (freeHead_ != NodeType::NIL) {
+        index = freeHead_;
+        uint32_t next = freeLink(index);
+        try {
+            new (&nodes_[index]) NodeType(key, value, parent);
+        }
+        catch (...) {
+            // the constructor may have written over the link before throwing
+            setFreeLink(index, next);
+            throw;
+        }
+        freeHead_ = next;
+        live_[index] = true;
+    }
+    else {
+        if (used_ >= COMPACT_AVL_MAX_NODES) {
+            throw std::length_error("CompactAVLTree is full");
+        }
+        if (used_ == capacity_) {
+            grow(std::min<size_t>(std::max<size_t>(capacity_ * 2, 16), COMPACT_AVL_MAX_NODES));
+        }
+        live_.push_back(false);
+        try {
+            new (&nodes_[used_]) NodeType(key, value, parent);
+        }
+        catch (...) {
+            live_.pop_back();
+            throw;
+        }
+        index = static_cast<uint32_t>(used_++);
+        live_[index] = true;
+    }
+    ++size_;
+    return index;
+}
+
+template <typename Key, typename Value>
+void CompactVectorStorage<Key, Value>::release(uint32_t index)
+{
+    nodes_[index].~NodeType();
+    live_[index] = false;
+    setFreeLink(index, freeHead_);
+    freeHead_ = index;
+    --size_;
+}
+
+template <typename Key, typename Value>
+uint32_t CompactVectorStorage<Key, Value>::root() const
+{
+    return root_;
+}
+
+template <typename Key, typename Value>
+void CompactVectorStorage<Key, Value>::setRoot(uint32_t root)
+{
+    root_ = root;
+}
+
+template <typename Key, typename Value>
+size_t CompactVectorStorage<Key, Value>::size() const
+{
+    return size_;
+}
+
+template <typename Key, typename Value>
+void CompactVectorStorage<Key, Value>::clear()
+{
+    destroyAll();
+    nodes_ = NULL;
+    used_ = 0;
+    capacity_ = 0;
+    live_.clear();
+    root_ = NodeType::NIL;
+    freeHead_ = NodeType::NIL;
+    size_ = 0;
+}
+
+template <typename Key, typename Value>
+void CompactVectorStorage<Key, Value>::reserve(size_t count)
+{
+    if (count > capacity_) {
+        grow(std::min<size_t>(count, COMPACT_AVL_MAX_NODES));
+    }
+    live_.reserve(count);
+}
+
+template <typename Key, typename Value>
+size_t CompactVectorStorage<Key, Value>::memoryUsage() const
+{
+    return sizeof(*this) + capacity_ * sizeof(NodeType) + live_.capacity() / 8;
+}
+
+/**
+* Nodes are moved if that can't throw and copied otherwise, so a failure
+* leaves them all in the old array.
+*/
+template <typename Key, typename Value>
+void CompactVectorStorage<Key, Value>::grow(size_t capacity)
+{
+    NodeType* grown = static_cast<NodeType*>(::operator new(capacity * sizeof(NodeType)));
+    size_t i = 0;
+    try {
+        for (; i < used_; ++i) {
+            if (live_[i]) {
+                new (&grown[i]) NodeType(std::move_if_noexcept(nodes_[i]));
+            }
+            else {
+                memcpy(reinterpret_cast<char*>(&grown[i]), reinterpret_cast<const char*>(&nodes_[i]), sizeof(uint32_t));
+            }
+        }
+    }
+    catch (...) {
+        while (i > 0) {
+            --i;
+            if (live_[i]) {
+                grown[i].~NodeType();
+            }
+        }
+        ::operator delete(grown);
+        throw;
+    }
+    destroyAll();
+    nodes_ = grown;
+    capacity_ = capacity;
+}
+
+// Destroys the live nodes and frees the array, without resetting anything
+template <typename Key, typename Value>
+void CompactVectorStorage<Key, Value>::destroyAll()
+{
+    for (size_t i = 0; i < used_; ++i) {
+        if (live_[i]) {
+            nodes_[i].~NodeType();
+        }
+    }
+    ::operator delete(nodes_);
+}
+
+/**
+* An AVL tree with the same interface as BinarySearchTree/AVLTree, but whose
+* nodes are stored compactly by a storage backend (see CompactVectorStorage)
+* and linked by 32-bit indices.
+*
+* Unlike Node pointers, iterators hold an index, so they stay valid when the
+* backing array grows. They are invalidated only when their node is removed.
+*
+* It is a separate class, not a BinarySearchTree: its nodes are not Node
+* objects, so it can't be passed where a BinarySearchTree or AVLTree is
+* expected, and prettyPrintBST doesn't take it. Only the interface above
+* is shared. It has no print(), node handles (extract and node-handle
+* insert), findBatch, parallel operations, metrics, exportTree, snapshots,
+* clearAsync or deferred destruction, and it adds lower_bound(), reserve()
+* and memoryUsage(), which BinarySearchTree lacks.
+*/
+template <typename Key, typename Value, typename Storage = CompactVectorStorage<Key, Value> >
+class CompactAVLTree
+{
+public:
+    typedef CompactAVLNode<Key, Value> NodeType;
+    static const uint32_t NIL = NodeType::NIL;
+
+    CompactAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool isBalanced() const;
+    bool empty() const;
+    size_t size() const;
+    void reserve(size_t count);
+    size_t memoryUsage() const;
+
+    /**
+    * An iterator for traversing the tree in order. It has the same
+    * interface as BinarySearchTree::iterator.
+    */
+    class iterator
+    {
+    public:
+        iterator();
+
+        std::pair<const Key, Value>& operator*() const;
+        std::pair<const Key, Value>* operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+
+    protected:
+        friend class CompactAVLTree<Key, Value, Storage>;
+        iterator(Storage* storage, uint32_t index);
+        Storage* storage_;
+        uint32_t current_;
+    };
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+protected:
+    // Link accessors. These hide the heavy bits packed into left_/right_.
+    uint32_t left(uint32_t n) const;
+    uint32_t right(uint32_t n) const;
+    uint32_t parent(uint32_t n) const;
+    void setLeft(uint32_t n, uint32_t child);
+    void setRight(uint32_t n, uint32_t child);
+    void setParent(uint32_t n, uint32_t parent);
+    int getBalance(uint32_t n) const;
+    void setBalance(uint32_t n, int balance);
+
+    uint32_t internalFind(const Key& key) const;
+    uint32_t getSmallestNode() const;
+    void replaceChild(uint32_t parent, uint32_t oldChild, uint32_t newChild);
+    void rotateLeft(uint32_t n);
+    void rotateRight(uint32_t n);
+    uint32_t rebalance(uint32_t n, int balance, bool& shrank);
+    void insertFix(uint32_t n);
+    void removeFix(uint32_t n, int diff);
+    int checkHeight(uint32_t n) const;
+
+protected:
+    mutable Storage storage_;
+};
+
+template <typename Key, typename Value, typename Storage>
+const uint32_t CompactAVLTree<Key, Value, Storage>::NIL;
+
+/*
+--------------------------------------------------------------
+Begin implementations for the CompactAVLTree::iterator class.
+--------------------------------------------------------------
+*/
+
+template <typename Key, typename Value, typename Storage>
+CompactAVLTree<Key, Value, Storage>::iterator::iterator(Storage* storage, uint32_t index) :
+    storage_(storage),
+    current_(index)
+{
+
+}
+
+template <typename Key, typename Value, typename Storage>
+CompactAVLTree<Key, Value, Storage>::iterator::iterator() :
+    storage_(NULL),
+    current_(NIL)
+{
+
+}
+
+template <typename Key, typename Value, typename Storage>
+std::pair<const Key, Value>&
+CompactAVLTree<Key, Value, Storage>::iterator::operator*() const
+{
+    return storage_->node(current_).item_;
+}
+
+template <typename Key, typename Value, typename Storage>
+std::pair<const Key, Value>*
+CompactAVLTree<Key, Value, Storage>::iterator::operator->() const
+{
+    return &(storage_->node(current_).item_);
+}
+
+template <typename Key, typename Value, typename Storage>
+bool CompactAVLTree<Key, Value, Storage>::iterator::operator==(const iterator& rhs) const
+{
+    return current_ == rhs.current_;
+}
+
+template <typename Key, typename Value, typename Storage>
+bool CompactAVLTree<Key, Value, Storage>::iterator::operator!=(const iterator& rhs) const
+{
+    return current_ != rhs.current_;
+}
+
+/**
+* Advances the iterator in order, exactly like BinarySearchTree::iterator
+* but following indices instead of pointers.
+*/
+template <typename Key, typename Value, typename Storage>
+typename CompactAVLTree<Key, Value, Storage>::iterator&
+CompactAVLTree<Key, Value, Storage>::iterator::operator++()
+{
+    if (current_ == NIL) {
+        return *this;
+    }
+
+    uint32_t next = storage_->node(current_).right_ & NodeType::LINK_MASK;
+    if (next != NIL) {
+        // go right, then left as far as possible
+        while ((storage_->node(next).left_ & NodeType::LINK_MASK) != NIL) {
+            next = storage_->node(next).left_ & NodeType::LINK_MASK;
+        }
+        current_ = next;
+    }
+    else {
+        // go up until we come from a left child
+        uint32_t parent = storage_->node(current_).parent_;
+        while (parent != NIL && current_ == (storage_->node(parent).right_ & NodeType::LINK_MASK)) {
+            current_ = parent;
+            parent = storage_->node(parent).parent_;
+        }
+        current_ = parent;
+    }
+    return *this;
+}
+
+/*
+------------------------------------------------------------
+End implementations for the CompactAVLTree::iterator class.
+------------------------------------------------------------
+*/
+
+template <typename Key, typename Value, typename Storage>
+CompactAVLTree<Key, Value, Storage>::CompactAVLTree()
+{
+
+}
+
+template <typename Key, typename Value, typename Storage>
+bool CompactAVLTree<Key, Value, Storage>::empty() const
+{
+    return storage_.root() == NIL;
+}
+
+template <typename Key, typename Value, typename Storage>
+size_t CompactAVLTree<Key, Value, Storage>::size() const
+{
+    return storage_.size();
+}
+
+/**
+* Pre-sizes the storage so that count nodes can be inserted without
+* growing the backing array.
+*/
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::reserve(size_t count)
+{
+    storage_.reserve(count);
+}
+
+/**
+* Returns the number of bytes used by the tree and its node storage.
+*/
+template <typename Key, typename Value, typename Storage>
+size_t CompactAVLTree<Key, Value, Storage>::memoryUsage() const
+{
+    return storage_.memoryUsage();
+}
+
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::clear()
+{
+    storage_.clear();
+}
+
+template <typename Key, typename Value, typename Storage>
+typename CompactAVLTree<Key, Value, Storage>::iterator
+CompactAVLTree<Key, Value, Storage>::begin() const
+{
+    return iterator(&storage_, getSmallestNode());
+}
+
+template <typename Key, typename Value, typename Storage>
+typename CompactAVLTree<Key, Value, Storage>::iterator
+CompactAVLTree<Key, Value, Storage>::end() const
+{
+    return iterator(&storage_, NIL);
+}
+
+template <typename Key, typename Value, typename Storage>
+typename CompactAVLTree<Key, Value, Storage>::iterator
+CompactAVLTree<Key, Value, Storage>::find(const Key& key) const
+{
+    return iterator(&storage_, internalFind(key));
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or end() if there is none.
+*/
+template <typename Key, typename Value, typename Storage>
+typename CompactAVLTree<Key, Value, Storage>::iterator
+CompactAVLTree<Key, Value, Storage>::lower_bound(const Key& key) const
+{
+    uint32_t curr = storage_.root();
+    uint32_t candidate = NIL;
+    while (curr != NIL) {
+        if (storage_.node(curr).item_.first < key) {
+            curr = right(curr);
+        }
+        else {
+            candidate = curr;
+            curr = left(curr);
+        }
+    }
+    return iterator(&storage_, candidate);
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template <typename Key, typename Value, typename Storage>
+Value& CompactAVLTree<Key, Value, Storage>::operator[](const Key& key)
+{
+    uint32_t curr = internalFind(key);
+    if(curr == NIL) throw std::out_of_range("Invalid key");
+    return storage_.node(curr).item_.second;
+}
+template <typename Key, typename Value, typename Storage>
+Value const & CompactAVLTree<Key, Value, Storage>::operator[](const Key& key) const
+{
+    uint32_t curr = internalFind(key);
+    if(curr == NIL) throw std::out_of_range("Invalid key");
+    return storage_.node(curr).item_.second;
+}
+
+/**
+* Inserts a key/value pair, overwriting the value if the key already exists.
+*/
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    uint32_t curr = storage_.root();
+    if (curr == NIL) {
+        storage_.setRoot(storage_.allocate(keyValuePair.first, keyValuePair.second, NIL));
+        return;
+    }
+
+    // walk down to the insertion point
+    while (true) {
+        NodeType& node = storage_.node(curr);
+        if (keyValuePair.first == node.item_.first) {
+            node.item_.second = keyValuePair.second;
+            return;
+        }
+        uint32_t next = (keyValuePair.first < node.item_.first) ? left(curr) : right(curr);
+        if (next == NIL) {
+            break;
+        }
+        curr = next;
+    }
+
+    // allocate() may grow the storage, so don't hold node references across it
+    uint32_t newNode = storage_.allocate(keyValuePair.first, keyValuePair.second, curr);
+    if (keyValuePair.first < storage_.node(curr).item_.first) {
+        setLeft(curr, newNode);
+    }
+    else {
+        setRight(curr, newNode);
+    }
+    insertFix(newNode);
+}
+
+/**
+* Removes the key if it exists. A node with two children is replaced by its
+* predecessor, which is spliced into its position.
+*/
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::remove(const Key& key)
+{
+    uint32_t toDelete = internalFind(key);
+    if (toDelete == NIL) {
+        return;
+    }
+
+    uint32_t p = parent(toDelete);
+    uint32_t fixFrom = NIL;
+    int diff = 0;
+
+    if (left(toDelete) != NIL && right(toDelete) != NIL) {
+        // find the predecessor (rightmost node of the left subtree)
+        uint32_t pred = left(toDelete);
+        while (right(pred) != NIL) {
+            pred = right(pred);
+        }
+
+        if (pred == left(toDelete)) {
+            // pred keeps its own left subtree, which is one shorter than before
+            fixFrom = pred;
+            diff = 1;
+        }
+        else {
+            // unhook pred from its parent, then give it toDelete's left subtree
+            uint32_t predParent = parent(pred);
+            uint32_t predLeft = left(pred);
+            setRight(predParent, predLeft);
+            if (predLeft != NIL) {
+                setParent(predLeft, predParent);
+            }
+            setLeft(pred, left(toDelete));
+            setParent(left(toDelete), pred);
+            fixFrom = predParent;
+            diff = -1;
+        }
+
+        setRight(pred, right(toDelete));
+        setParent(right(toDelete), pred);
+        setBalance(pred, getBalance(toDelete));
+        setParent(pred, p);
+        replaceChild(p, toDelete, pred);
+    }
+    else {
+        uint32_t child = (left(toDelete) != NIL) ? left(toDelete) : right(toDelete);
+        if (child != NIL) {
+            setParent(child, p);
+        }
+        if (p != NIL) {
+            diff = (toDelete == left(p)) ? 1 : -1;
+            fixFrom = p;
+        }
+        replaceChild(p, toDelete, child);
+    }
+
+    storage_.release(toDelete);
+    if (fixFrom != NIL) {
+        removeFix(fixFrom, diff);
+    }
+}
+
+/**
+ * Return true iff the tree is balanced.
+ */
+template <typename Key, typename Value, typename Storage>
+bool CompactAVLTree<Key, Value, Storage>::isBalanced() const
+{
+    return checkHeight(storage_.root()) != -1;
+}
+
+// Returns the height of the subtree, or -1 if any node in it is unbalanced
+template <typename Key, typename Value, typename Storage>
+int CompactAVLTree<Key, Value, Storage>::checkHeight(uint32_t n) const
+{
+    if (n == NIL) {
+        return 0;
+    }
+    int leftH = checkHeight(left(n));
+    int rightH = checkHeight(right(n));
+    if (leftH == -1 || rightH == -1 || abs(leftH - rightH) > 1) {
+        return -1;
+    }
+    return 1 + std::max(leftH, rightH);
+}
+
+template <typename Key, typename Value, typename Storage>
+uint32_t CompactAVLTree<Key, Value, Storage>::left(uint32_t n) const
+{
+    return storage_.node(n).left_ & NodeType::LINK_MASK;
+}
+
+template <typename Key, typename Value, typename Storage>
+uint32_t CompactAVLTree<Key, Value, Storage>::right(uint32_t n) const
+{
+    return storage_.node(n).right_ & NodeType::LINK_MASK;
+}
+
+template <typename Key, typename Value, typename Storage>
+uint32_t CompactAVLTree<Key, Value, Storage>::parent(uint32_t n) const
+{
+    return storage_.node(n).parent_;
+}
+
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::setLeft(uint32_t n, uint32_t child)
+{
+    uint32_t& link = storage_.node(n).left_;
+    link = (link & NodeType::HEAVY_BIT) | child;
+}
+
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::setRight(uint32_t n, uint32_t child)
+{
+    uint32_t& link = storage_.node(n).right_;
+    link = (link & NodeType::HEAVY_BIT) | child;
+}
+
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::setParent(uint32_t n, uint32_t parent)
+{
+    storage_.node(n).parent_ = parent;
+}
+
+// Balance is right height minus left height, the same convention as AVLNode
+template <typename Key, typename Value, typename Storage>
+int CompactAVLTree<Key, Value, Storage>::getBalance(uint32_t n) const
+{
+    const NodeType& node = storage_.node(n);
+    return static_cast<int>(node.right_ >> 31) - static_cast<int>(node.left_ >> 31);
+}
+
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::setBalance(uint32_t n, int balance)
+{
+    NodeType& node = storage_.node(n);
+    node.left_ = (node.left_ & NodeType::LINK_MASK) | (balance < 0 ? NodeType::HEAVY_BIT : 0);
+    node.right_ = (node.right_ & NodeType::LINK_MASK) | (balance > 0 ? NodeType::HEAVY_BIT : 0);
+}
+
+template <typename Key, typename Value, typename Storage>
+uint32_t CompactAVLTree<Key, Value, Storage>::internalFind(const Key& key) const
+{
+    uint32_t curr = storage_.root();
+    while (curr != NIL) {
+        const Key& currKey = storage_.node(curr).item_.first;
+        if (key == currKey) {
+            return curr;
+        }
+        curr = (key < currKey) ? left(curr) : right(curr);
+    }
+    return NIL;
+}
+
+template <typename Key, typename Value, typename Storage>
+uint32_t CompactAVLTree<Key, Value, Storage>::getSmallestNode() const
+{
+    uint32_t curr = storage_.root();
+    if (curr == NIL) {
+        return NIL;
+    }
+    while (left(curr) != NIL) {
+        curr = left(curr);
+    }
+    return curr;
+}
+
+// Points parent (or the root, if parent is NIL) at newChild instead of oldChild
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::replaceChild(uint32_t parent, uint32_t oldChild, uint32_t newChild)
+{
+    if (parent == NIL) {
+        storage_.setRoot(newChild);
+    }
+    else if (left(parent) == oldChild) {
+        setLeft(parent, newChild);
+    }
+    else {
+        setRight(parent, newChild);
+    }
+}
+
+// rotate left. node goes down, right child goes up
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::rotateLeft(uint32_t n)
+{
+    uint32_t rightKid = right(n);
+    uint32_t middle = left(rightKid);
+    uint32_t p = parent(n);
+
+    setRight(n, middle);
+    if (middle != NIL) {
+        setParent(middle, n);
+    }
+    setParent(rightKid, p);
+    replaceChild(p, n, rightKid);
+    setLeft(rightKid, n);
+    setParent(n, rightKid);
+}
+
+// rotate right. node goes down, left child goes up
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::rotateRight(uint32_t n)
+{
+    uint32_t leftKid = left(n);
+    uint32_t middle = right(leftKid);
+    uint32_t p = parent(n);
+
+    setLeft(n, middle);
+    if (middle != NIL) {
+        setParent(middle, n);
+    }
+    setParent(leftKid, p);
+    replaceChild(p, n, leftKid);
+    setRight(leftKid, n);
+    setParent(n, leftKid);
+}
+
+/**
+* Restores the AVL property at n, whose balance has reached +/-2 (passed in
+* as balance since only -1..1 fits in the packed bits). Returns the new
+* root of the subtree, and sets shrank if the subtree got shorter.
+*/
+template <typename Key, typename Value, typename Storage>
+uint32_t CompactAVLTree<Key, Value, Storage>::rebalance(uint32_t n, int balance, bool& shrank)
+{
+    if (balance < 0) {
+        uint32_t child = left(n);
+        int childBalance = getBalance(child);
+        if (childBalance <= 0) {
+            // left left case
+            rotateRight(n);
+            if (childBalance == 0) {
+                // only happens on removal
+                setBalance(n, -1);
+                setBalance(child, 1);
+                shrank = false;
+            }
+            else {
+                setBalance(n, 0);
+                setBalance(child, 0);
+                shrank = true;
+            }
+            return child;
+        }
+        // left right case
+        uint32_t grandchild = right(child);
+        int grandBalance = getBalance(grandchild);
+        rotateLeft(child);
+        rotateRight(n);
+        setBalance(n, grandBalance == -1 ? 1 : 0);
+        setBalance(child, grandBalance == 1 ? -1 : 0);
+        setBalance(grandchild, 0);
+        shrank = true;
+        return grandchild;
+    }
+
+    uint32_t child = right(n);
+    int childBalance = getBalance(child);
+    if (childBalance >= 0) {
+        // right right case
+        rotateLeft(n);
+        if (childBalance == 0) {
+            // only happens on removal
+            setBalance(n, 1);
+            setBalance(child, -1);
+            shrank = false;
+        }
+        else {
+            setBalance(n, 0);
+            setBalance(child, 0);
+            shrank = true;
+        }
+        return child;
+    }
+    // right left case
+    uint32_t grandchild = left(child);
+    int grandBalance = getBalance(grandchild);
+    rotateRight(child);
+    rotateLeft(n);
+    setBalance(n, grandBalance == 1 ? -1 : 0);
+    setBalance(child, grandBalance == -1 ? 1 : 0);
+    setBalance(grandchild, 0);
+    shrank = true;
+    return grandchild;
+}
+
+// Walks up from a newly inserted leaf, updating balances until the height stops changing
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::insertFix(uint32_t n)
+{
+    uint32_t p = parent(n);
+    while (p != NIL) {
+        int balance = getBalance(p) + ((n == left(p)) ? -1 : 1);
+        if (balance == 0) {
+            setBalance(p, 0);
+            return;
+        }
+        if (balance == 1 || balance == -1) {
+            setBalance(p, balance);
+            n = p;
+            p = parent(p);
+            continue;
+        }
+        bool shrank;
+        rebalance(p, balance, shrank);
+        return;
+    }
+}
+
+// Walks up from n after one of its subtrees got shorter (diff is +1 for left, -1 for right)
+template <typename Key, typename Value, typename Storage>
+void CompactAVLTree<Key, Value, Storage>::removeFix(uint32_t n, int diff)
+{
+    while (n != NIL) {
+        uint32_t p = parent(n);
+        int nextDiff = 0;
+        if (p != NIL) {
+            nextDiff = (n == left(p)) ? 1 : -1;
+        }
+
+        int balance = getBalance(n) + diff;
+        if (balance == 1 || balance == -1) {
+            setBalance(n, balance);
+            return; // height didn't change
+        }
+        if (balance != 0) {
+            bool shrank;
+            rebalance(n, balance, shrank);
+            if (!shrank) {
+                return;
+            }
+        }
+        else {
+            setBalance(n, 0);
+        }
+        n = p;
+        diff = nextDiff;
+    }
+}
+
+#endif
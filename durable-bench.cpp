@@ -0,0 +1,46 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "durable_avl.h"
+
+using namespace std;
+
+// Measures durable insert throughput of DurableAVLTree for a range of
+// group-commit batch sizes. Run it on a local disk; network filesystems
+// make fsync latency meaningless.
+//
+// usage: durable-bench [directory] [operations per batch size]
+
+int main(int argc, char *argv[])
+{
+    string directory = (argc > 1) ? argv[1] : "durable-bench.tmp";
+    long ops = (argc > 2) ? atol(argv[2]) : 20000;
+    const size_t batchSizes[] = { 1, 4, 16, 64, 256, 1024, 4096 };
+
+    cout << "batch_size,operations,seconds,ops_per_sec" << endl;
+    for (size_t b = 0; b < sizeof(batchSizes) / sizeof(batchSizes[0]); ++b) {
+        remove((directory + "/wal.log").c_str());
+        remove((directory + "/checkpoint.snap").c_str());
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        {
+            // no automatic checkpoints, so only the log is measured
+            DurableAVLTree<uint64_t, uint64_t> tree(directory, DurabilityOptions(batchSizes[b], 0));
+            uint64_t key = 88172645463325252ULL;
+            for (long i = 0; i < ops; ++i) {
+                key ^= key << 13; key ^= key >> 7; key ^= key << 17;
+                tree.insert(make_pair(key, (uint64_t)i));
+            }
+            tree.sync();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << batchSizes[b] << "," << ops << "," << seconds << "," << (ops / seconds) << endl;
+    }
+
+    remove((directory + "/wal.log").c_str());
+    remove((directory + "/checkpoint.snap").c_str());
+    rmdir(directory.c_str());
+    return 0;
+}
@@ -0,0 +1,553 @@
+#ifndef DURABLE_AVL_H
+#define DURABLE_AVL_H
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "avlbst.h"
+
+// Write-ahead log layout:
+//   header: "DAVLWAL\0", uint32 generation of the checkpoint it follows
+//   then one record per operation:
+//     uint32 body length, body, uint64 checksum of the body
+//   where body is:
+//     uint8 op (DURABLE_AVL_INSERT or DURABLE_AVL_REMOVE), key, value (inserts only)
+#define DURABLE_AVL_LOG_MAGIC "DAVLWAL"
+#define DURABLE_AVL_LOG_HEADER_SIZE (sizeof(DURABLE_AVL_LOG_MAGIC) + 4)
+#define DURABLE_AVL_INSERT 1
+#define DURABLE_AVL_REMOVE 2
+
+/**
+* Tuning knobs for DurableAVLTree.
+*
+* syncBatch: how many records are group-committed per write()+fdatasync().
+*   1 makes every operation durable before it returns; larger batches trade
+*   the last few operations on a crash for much higher throughput.
+* checkpointInterval: after this many logged operations a checkpoint is
+*   written and the log is truncated. 0 disables automatic checkpoints.
+*/
+struct DurabilityOptions
+{
+    DurabilityOptions(size_t batch = 64, size_t interval = 1000000) :
+        syncBatch(batch),
+        checkpointInterval(interval)
+    {
+
+    }
+
+    size_t syncBatch;
+    size_t checkpointInterval;
+};
+
+/**
+* An AVLTree whose insert and remove are made durable through an
+* append-only write-ahead log in a directory. The directory holds:
+*   checkpoint.snap - the last checkpoint, in saveSnapshot() format
+*   wal.log         - every operation logged since that checkpoint
+*
+* Every other way of changing the tree either goes to disk too or is
+* hidden:
+*   - insert, remove and node handle moves append a record. Removing a
+*     key that isn't there appends nothing.
+*   - Changes that replace the whole tree (clear, clearAsync,
+*     loadSnapshot, assigning or cloning into it) and
+*     parallelTransformValues write a checkpoint before they return.
+*   - operator[] and the iterators are read-only here; change values
+*     with insert.
+*   - swap is disabled and the tree can't be moved.
+* Calls made through an AVLTree or BinarySearchTree reference still reach
+* the base class's non-virtual members, so a swap or move done that way,
+* or a write through a base class iterator, is not logged and is lost on
+* recovery. parallelForEach hands out writable items too; don't write
+* through them.
+*
+* On construction the tree recovers by loading the checkpoint and replaying
+* the log tail. A torn record at the end of the log (from a crash mid-write)
+* ends the replay and is cut off. An intact record with an unknown op is
+* corruption, and the constructor throws.
+*
+* Every checkpoint gets the next generation number, stored in its snapshot
+* tag, and the log's header names the generation it follows. A crash after
+* a checkpoint is renamed into place but before the log is truncated
+* leaves a log from the generation before, which recovery throws away
+* instead of replaying: its records are already in the checkpoint, and
+* replaying them would undo whatever whole-tree change (clear,
+* parallelTransformValues, ...) the checkpoint was written for.
+*/
+template<class Key, class Value, class KeySerializer = SnapshotSerializer<Key>, class ValueSerializer = SnapshotSerializer<Value> >
+class DurableAVLTree : public AVLTree<Key, Value>
+{
+public:
+    DurableAVLTree(const std::string& directory, const DurabilityOptions& options = DurabilityOptions());
+    virtual ~DurableAVLTree();
+
+    /**
+    * The usual in-order iterator, but read-only: a write through it
+    * couldn't be logged.
+    */
+    class iterator : public AVLTree<Key, Value>::iterator
+    {
+    public:
+        iterator();
+        iterator(const typename AVLTree<Key, Value>::iterator& it);
+
+        const std::pair<const Key, Value>& operator*() const;
+        const std::pair<const Key, Value>* operator->() const;
+        iterator& operator++();
+    };
+
+    virtual void insert(const std::pair<const Key, Value>& new_item);
+    virtual void remove(const Key& key);
+
+    // Node handle moves (bst.h), logged like remove and insert
+    typedef typename AVLTree<Key, Value>::node_type node_type;
+    struct insert_return_type
+    {
+        iterator position;
+        bool inserted;
+        node_type node;
+    };
+    node_type extract(const Key& key);
+    node_type extract(iterator position);
+    insert_return_type insert(node_type&& handle);
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    void findBatch(const std::vector<Key>& keys, std::vector<iterator>& out) const;
+    const Value& operator[](const Key& key) const;
+
+    // Writes and fsyncs any records still waiting for their group commit
+    void sync();
+    // Writes a checkpoint of the whole tree and truncates the log
+    void checkpoint();
+
+protected:
+    // Whole-tree changes can't be logged record by record, so both of
+    // these write a checkpoint instead (except while recovering)
+    virtual void rootReplaced() override;
+    virtual void valuesRewritten() override;
+
+    void recover();
+    void appendRecord(uint8_t op, const Key& key, const Value* value);
+    // Opens the log for appending. Truncating starts a new log for the
+    // current generation, header and all.
+    void openLog(bool truncate);
+    void fail(const std::string& what, const std::string& path);
+
+    std::string directory_;
+    std::string logPath_;
+    std::string checkpointPath_;
+    DurabilityOptions options_;
+
+    int logFd_;
+    std::string pending_;      // encoded records not yet written
+    size_t pendingRecords_;
+    size_t opsSinceCheckpoint_;
+    uint32_t generation_;      // of the checkpoint the log follows, 0 before the first
+    bool recovering_;
+
+private:
+    // Not copyable: owns the log file. Declaring these also keeps the
+    // tree from being moved, and swap is hidden for the same reason: the
+    // contents would change without a record.
+    DurableAVLTree(const DurableAVLTree& other);
+    DurableAVLTree& operator=(const DurableAVLTree& other);
+    void swap(DurableAVLTree& other);
+};
+
+// Would otherwise pick the BinarySearchTree overload, which isn't logged
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void swap(DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>& a,
+          DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>& b) = delete;
+
+/*
+-----------------------------------------------------
+Begin implementations for the DurableAVLTree::iterator class.
+-----------------------------------------------------
+*/
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::iterator::iterator()
+{
+
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::iterator::iterator(const typename AVLTree<Key, Value>::iterator& it) :
+    AVLTree<Key, Value>::iterator(it)
+{
+
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+const std::pair<const Key, Value>& DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::iterator::operator*() const
+{
+    return AVLTree<Key, Value>::iterator::operator*();
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+const std::pair<const Key, Value>* DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::iterator::operator->() const
+{
+    return AVLTree<Key, Value>::iterator::operator->();
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+typename DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::iterator&
+DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::iterator::operator++()
+{
+    AVLTree<Key, Value>::iterator::operator++();
+    return *this;
+}
+
+/*
+---------------------------------------------------
+End implementations for the DurableAVLTree::iterator class.
+---------------------------------------------------
+*/
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::DurableAVLTree(const std::string& directory, const DurabilityOptions& options) :
+    directory_(directory),
+    logPath_(directory + "/wal.log"),
+    checkpointPath_(directory + "/checkpoint.snap"),
+    options_(options),
+    logFd_(-1),
+    pendingRecords_(0),
+    opsSinceCheckpoint_(0),
+    generation_(0),
+    recovering_(false)
+{
+    if (options_.syncBatch == 0) {
+        options_.syncBatch = 1;
+    }
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        fail("Could not create", directory);
+    }
+    recover();
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::~DurableAVLTree()
+{
+    try {
+        sync();
+    }
+    catch (...) {
+        // nothing sensible to do with an I/O error in a destructor
+    }
+    if (logFd_ >= 0) {
+        close(logFd_);
+    }
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::fail(const std::string& what, const std::string& path)
+{
+    throw std::runtime_error(what + " " + path + ": " + strerror(errno));
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::openLog(bool truncate)
+{
+    if (logFd_ >= 0) {
+        close(logFd_);
+    }
+    int flags = O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0);
+    logFd_ = open(logPath_.c_str(), flags, 0644);
+    if (logFd_ < 0) {
+        fail("Could not open", logPath_);
+    }
+    if (truncate) {
+        std::string header(DURABLE_AVL_LOG_MAGIC, sizeof(DURABLE_AVL_LOG_MAGIC));
+        SnapshotSerializer<uint32_t>::write(header, generation_);
+        if (write(logFd_, header.data(), header.size()) != static_cast<ssize_t>(header.size()) ||
+            fdatasync(logFd_) != 0) {
+            fail("Could not write", logPath_);
+        }
+    }
+}
+
+/**
+* Loads the checkpoint (if any), then replays every intact log record on
+* top of it through the plain AVLTree operations so nothing is re-logged.
+* A log left over from an older checkpoint (or with a torn header) is
+* started over instead.
+*/
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::recover()
+{
+    if (access(checkpointPath_.c_str(), F_OK) == 0) {
+        recovering_ = true;
+        try {
+            this->template loadSnapshot<KeySerializer, ValueSerializer>(checkpointPath_, &generation_);
+        }
+        catch (...) {
+            recovering_ = false;
+            throw;
+        }
+        recovering_ = false;
+    }
+
+    std::vector<char> log;
+    FILE* in = fopen(logPath_.c_str(), "rb");
+    if (in != NULL) {
+        char chunk[1 << 16];
+        size_t got;
+        while ((got = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+            log.insert(log.end(), chunk, chunk + got);
+        }
+        fclose(in);
+    }
+
+    if (log.size() < DURABLE_AVL_LOG_HEADER_SIZE) {
+        openLog(true);
+        return;
+    }
+    if (memcmp(&log[0], DURABLE_AVL_LOG_MAGIC, sizeof(DURABLE_AVL_LOG_MAGIC)) != 0) {
+        throw std::runtime_error("Not a DurableAVLTree log: " + logPath_);
+    }
+    const char* headerPos = &log[sizeof(DURABLE_AVL_LOG_MAGIC)];
+    if (SnapshotSerializer<uint32_t>::read(headerPos, &log[0] + log.size()) != generation_) {
+        openLog(true);
+        return;
+    }
+
+    size_t valid = DURABLE_AVL_LOG_HEADER_SIZE;
+    while (log.size() - valid >= 4) {
+        const char* pos = &log[valid];
+        const char* end = &log[0] + log.size();
+        uint32_t length = SnapshotSerializer<uint32_t>::read(pos, end);
+        if (static_cast<size_t>(end - pos) < static_cast<size_t>(length) + 8) {
+            break; // torn record
+        }
+        const char* body = pos;
+        const char* bodyEnd = body + length;
+        const char* trailer = bodyEnd;
+        SnapshotChecksum checksum;
+        checksum.update(body, length);
+        if (SnapshotSerializer<uint64_t>::read(trailer, end) != checksum.value() || length == 0) {
+            break; // torn or corrupt record
+        }
+
+        uint8_t op = static_cast<uint8_t>(*body++);
+        if (op != DURABLE_AVL_INSERT && op != DURABLE_AVL_REMOVE) {
+            throw std::runtime_error("Corrupt record in " + logPath_);
+        }
+        Key key = KeySerializer::read(body, bodyEnd);
+        if (op == DURABLE_AVL_INSERT) {
+            Value value = ValueSerializer::read(body, bodyEnd);
+            AVLTree<Key, Value>::insert(std::make_pair(key, value));
+        }
+        else {
+            AVLTree<Key, Value>::remove(key);
+        }
+        ++opsSinceCheckpoint_;
+        valid = static_cast<size_t>(trailer - &log[0]);
+    }
+
+    openLog(false);
+    if (valid != log.size() && ftruncate(logFd_, valid) != 0) {
+        fail("Could not truncate", logPath_);
+    }
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::appendRecord(uint8_t op, const Key& key, const Value* value)
+{
+    size_t start = pending_.size();
+    SnapshotSerializer<uint32_t>::write(pending_, 0); // length, patched below
+    pending_.push_back(static_cast<char>(op));
+    KeySerializer::write(pending_, key);
+    if (value != NULL) {
+        ValueSerializer::write(pending_, *value);
+    }
+    uint32_t length = static_cast<uint32_t>(pending_.size() - start - 4);
+    memcpy(&pending_[start], &length, 4);
+
+    SnapshotChecksum checksum;
+    checksum.update(pending_.data() + start + 4, length);
+    SnapshotSerializer<uint64_t>::write(pending_, checksum.value());
+
+    ++opsSinceCheckpoint_;
+    if (++pendingRecords_ >= options_.syncBatch) {
+        sync();
+    }
+    if (options_.checkpointInterval != 0 && opsSinceCheckpoint_ >= options_.checkpointInterval) {
+        checkpoint();
+    }
+}
+
+/**
+* Applies the insert and logs it. The operation is durable once its
+* group commit has been synced (immediately when syncBatch is 1).
+*/
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::insert(const std::pair<const Key, Value>& new_item)
+{
+    AVLTree<Key, Value>::insert(new_item);
+    appendRecord(DURABLE_AVL_INSERT, new_item.first, &new_item.second);
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::remove(const Key& key)
+{
+    if (this->internalFind(key) == NULL) {
+        return;
+    }
+    AVLTree<Key, Value>::remove(key);
+    appendRecord(DURABLE_AVL_REMOVE, key, NULL);
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+typename DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::node_type
+DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::extract(const Key& key)
+{
+    node_type handle = AVLTree<Key, Value>::extract(key);
+    if (!handle.empty()) {
+        appendRecord(DURABLE_AVL_REMOVE, handle.key(), NULL);
+    }
+    return handle;
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+typename DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::node_type
+DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::extract(iterator position)
+{
+    node_type handle = AVLTree<Key, Value>::extract(position);
+    if (!handle.empty()) {
+        appendRecord(DURABLE_AVL_REMOVE, handle.key(), NULL);
+    }
+    return handle;
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+typename DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::insert_return_type
+DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::insert(node_type&& handle)
+{
+    typename AVLTree<Key, Value>::insert_return_type inserted = AVLTree<Key, Value>::insert(std::move(handle));
+    insert_return_type result = { inserted.position, inserted.inserted, std::move(inserted.node) };
+    if (result.inserted) {
+        appendRecord(DURABLE_AVL_INSERT, result.position->first, &result.position->second);
+    }
+    return result;
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+typename DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::iterator
+DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::begin() const
+{
+    return AVLTree<Key, Value>::begin();
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+typename DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::iterator
+DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::end() const
+{
+    return AVLTree<Key, Value>::end();
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+typename DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::iterator
+DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::find(const Key& key) const
+{
+    return AVLTree<Key, Value>::find(key);
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::findBatch(const std::vector<Key>& keys, std::vector<iterator>& out) const
+{
+    std::vector<typename AVLTree<Key, Value>::iterator> found;
+    AVLTree<Key, Value>::findBatch(keys, found);
+    out.assign(found.begin(), found.end());
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+const Value& DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::operator[](const Key& key) const
+{
+    return AVLTree<Key, Value>::operator[](key);
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::rootReplaced()
+{
+    AVLTree<Key, Value>::rootReplaced();
+    if (!recovering_) {
+        checkpoint();
+    }
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::valuesRewritten()
+{
+    AVLTree<Key, Value>::valuesRewritten();
+    checkpoint();
+}
+
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::sync()
+{
+    if (pending_.empty()) {
+        return;
+    }
+    const char* data = pending_.data();
+    size_t left = pending_.size();
+    while (left > 0) {
+        ssize_t written = write(logFd_, data, left);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail("Could not write", logPath_);
+        }
+        data += written;
+        left -= static_cast<size_t>(written);
+    }
+    if (fdatasync(logFd_) != 0) {
+        fail("Could not sync", logPath_);
+    }
+    pending_.clear();
+    pendingRecords_ = 0;
+}
+
+/**
+* Writes the tree to a temporary file as the next generation, fsyncs it,
+* atomically renames it over the old checkpoint, and only then starts a
+* new log for that generation.
+*/
+template<class Key, class Value, class KeySerializer, class ValueSerializer>
+void DurableAVLTree<Key, Value, KeySerializer, ValueSerializer>::checkpoint()
+{
+    sync();
+
+    std::string tempPath = checkpointPath_ + ".tmp";
+    this->template saveSnapshot<KeySerializer, ValueSerializer>(tempPath, generation_ + 1);
+    int fd = open(tempPath.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        if (fd >= 0) close(fd);
+        fail("Could not sync", tempPath);
+    }
+    close(fd);
+    if (rename(tempPath.c_str(), checkpointPath_.c_str()) != 0) {
+        fail("Could not rename", tempPath);
+    }
+    int dirFd = open(directory_.c_str(), O_RDONLY);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+
+    ++generation_;
+    openLog(true);
+    opsSinceCheckpoint_ = 0;
+}
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef RECCHECK
 //if you want to add any #includes like <iostream> you must do them here (before the next endif)
-
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include "work_pool.h"
 #endif
 
 #include "equal-paths.h"
@@ -9,7 +12,13 @@ using namespace std;
 
 // You may add any prototypes of helper functions here
 
-// Helper function is needed. The helper would return height if subtree has equal paths, -1 otherwise
+#ifdef RECCHECK
+
+// The recursion check builds without the #includes above, so it gets the
+// plain recursive version. It returns the same answers, but recursion as
+// deep as the tree means it can overflow the stack on long skinny trees.
+
+// Returns the height if the subtree has equal paths, -1 otherwise
 int checkEqualPaths(Node* root);
 
 bool equalPaths(Node * root)
@@ -18,54 +27,174 @@ bool equalPaths(Node * root)
     if (root == nullptr) {
         return true;
     }
-    //if helper function returns -1, paths are NOT equal
     return checkEqualPaths(root) != -1;
 }
 
 int checkEqualPaths(Node* root)
 {
-    // Base case 1: empty tree - return -1 to indicate "no tree exists here"
-    if (root == nullptr) {
-        return -1;
-    }
-    
-    // Base case 2: leaf node - has height 0 and valid equal paths (trivially)
     if (root->left == nullptr && root->right == nullptr) {
         return 0;
     }
-    
-    // case 3 (recursive case) get heights from left and right subtrees
-    int leftHeight = checkEqualPaths(root->left);
-    int rightHeight = checkEqualPaths(root->right);
-    
-    // We check if either subtree has invalid paths (not from being empty)
-    // We need to differentiate between "empty" (-1) and "invalid due to unequal paths"
-    bool leftExists = (root->left != nullptr);
-    bool rightExists = (root->right != nullptr);
-    
-    // If a subtree exists but returned -1, it has unequal paths... so invalid!
-    if (leftExists && leftHeight == -1) return -1;
-    if (rightExists && rightHeight == -1) return -1;
-    
-    // Now, part two, handle the cases different cases of the subtrees
-    if (!leftExists && !rightExists) {
-        // Both children are null. this is a leaf
-        return 0;
+    int leftHeight = (root->left != nullptr) ? checkEqualPaths(root->left) : -2;
+    int rightHeight = (root->right != nullptr) ? checkEqualPaths(root->right) : -2;
+    if (leftHeight == -1 || rightHeight == -1) {
+        return -1;
     }
-    else if (!leftExists) {
-        // Only right subtree exists
+    if (leftHeight == -2) {
         return 1 + rightHeight;
     }
-    else if (!rightExists) {
-        // Only left subtree exists  
+    if (rightHeight == -2 || leftHeight == rightHeight) {
         return 1 + leftHeight;
     }
-    else {
-        // Both subtrees exist so they must have equal heights
-        if (leftHeight != rightHeight) {
-            return -1; // Unequal paths
+    return -1;
+}
+
+#else
+
+// Nodes the sequential walk visits before the rest is split across threads
+#define EQUAL_PATHS_SEQUENTIAL_BUDGET (1 << 16)
+// Pieces of work per thread for the parallel walk, for load balancing
+#define EQUAL_PATHS_TASKS_PER_THREAD 8
+// How often (in nodes) a parallel worker checks whether another one found a mismatch
+#define EQUAL_PATHS_CANCEL_CHECK 1024
+
+// A node still to be checked, and its distance from the root
+struct PathFrame {
+    Node* node;
+    int depth;
+    PathFrame(Node* n, int d) : node(n), depth(d) {}
+};
+
+bool walkPaths(vector<PathFrame>& stack, int& leafDepth, size_t budget);
+bool checkFrame(const PathFrame& frame, int& leafDepth, vector<PathFrame>& children);
+bool equalPathsParallel(vector<PathFrame>& frames, int leafDepth, WorkStealingPool& pool);
+
+bool equalPaths(Node * root)
+{
+    // Empty tree has equal paths (trivially true)
+    if (root == nullptr) {
+        return true;
+    }
+
+    // Most trees are settled by a short sequential walk
+    vector<PathFrame> stack;
+    stack.push_back(PathFrame(root, 0));
+    int leafDepth = -1;
+    if (!walkPaths(stack, leafDepth, EQUAL_PATHS_SEQUENTIAL_BUDGET)) {
+        return false;
+    }
+    if (stack.empty()) {
+        return true;
+    }
+
+    // Big tree: finish on the shared pool, or keep going here if it only
+    // has one thread
+    WorkStealingPool& pool = WorkStealingPool::shared();
+    if (pool.size() <= 1) {
+        return walkPaths(stack, leafDepth, static_cast<size_t>(-1));
+    }
+    return equalPathsParallel(stack, leafDepth, pool);
+}
+
+// Checks one node against the leaf depth seen so far (-1 if none yet) and
+// appends its children. Returns false as soon as the paths can't be equal:
+// at a leaf of another depth, or at an inner node already at the leaf depth.
+bool checkFrame(const PathFrame& frame, int& leafDepth, vector<PathFrame>& children)
+{
+    Node* node = frame.node;
+    if (node->left == nullptr && node->right == nullptr) {
+        if (leafDepth == -1) {
+            leafDepth = frame.depth;
+        }
+        return leafDepth == frame.depth;
+    }
+    if (leafDepth != -1 && frame.depth >= leafDepth) {
+        return false; // its leaves would all be deeper
+    }
+    if (node->right != nullptr) {
+        children.push_back(PathFrame(node->right, frame.depth + 1));
+    }
+    if (node->left != nullptr) {
+        children.push_back(PathFrame(node->left, frame.depth + 1));
+    }
+    return true;
+}
+
+// Depth-first walk with an explicit stack, so skinny trees can't overflow
+// the call stack. Stops after budget nodes, leaving the rest on the stack.
+bool walkPaths(vector<PathFrame>& stack, int& leafDepth, size_t budget)
+{
+    for (size_t visited = 0; visited < budget && !stack.empty(); ++visited) {
+        PathFrame frame = stack.back();
+        stack.pop_back();
+        if (!checkFrame(frame, leafDepth, stack)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Finishes the walk from the given frames as tasks on pool. They share
+// the leaf depth (the first leaf found sets it) and a cancellation flag
+// that stops everyone once one task finds a mismatch.
+bool equalPathsParallel(vector<PathFrame>& frames, int leafDepth, WorkStealingPool& pool)
+{
+    // Break the shallowest (likely largest) frames up until there's enough
+    // work to go around
+    size_t target = static_cast<size_t>(pool.size()) * EQUAL_PATHS_TASKS_PER_THREAD;
+    vector<PathFrame> tasks;
+    while (!frames.empty() && frames.size() < target) {
+        vector<PathFrame>::iterator shallowest = min_element(frames.begin(), frames.end(),
+            [](const PathFrame& a, const PathFrame& b) { return a.depth < b.depth; });
+        PathFrame frame = *shallowest;
+        frames.erase(shallowest);
+        if (!checkFrame(frame, leafDepth, frames)) {
+            return false;
         }
-        return 1 + leftHeight; // (same as 1 + rightHeight since they're equal)
     }
+    tasks.swap(frames);
+    if (tasks.empty()) {
+        return true;
+    }
+
+    atomic<int> sharedLeafDepth(leafDepth);
+    atomic<bool> mismatch(false);
+    atomic<int>* sharedLeafDepthPtr = &sharedLeafDepth;
+    atomic<bool>* mismatchPtr = &mismatch;
+
+    TaskGroup group;
+    for (size_t t = 0; t < tasks.size(); ++t) {
+        PathFrame start = tasks[t];
+        pool.submit(group, [start, sharedLeafDepthPtr, mismatchPtr]() {
+            if (mismatchPtr->load(memory_order_relaxed)) {
+                return;
+            }
+            vector<PathFrame> stack(1, start);
+            int localDepth = sharedLeafDepthPtr->load(memory_order_relaxed);
+            while (!stack.empty()) {
+                if (!walkPaths(stack, localDepth, EQUAL_PATHS_CANCEL_CHECK)) {
+                    mismatchPtr->store(true, memory_order_relaxed);
+                    return;
+                }
+                // publish the first leaf depth, or adopt one found elsewhere
+                int expected = -1;
+                if (localDepth != -1 &&
+                    !sharedLeafDepthPtr->compare_exchange_strong(expected, localDepth) &&
+                    expected != localDepth) {
+                    mismatchPtr->store(true, memory_order_relaxed);
+                    return;
+                }
+                if (localDepth == -1) {
+                    localDepth = sharedLeafDepthPtr->load(memory_order_relaxed);
+                }
+                if (mismatchPtr->load(memory_order_relaxed)) {
+                    return;
+                }
+            }
+        });
+    }
+    pool.wait(group);
+    return !mismatch.load();
 }
 
+#endif
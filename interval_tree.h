@@ -0,0 +1,366 @@
+#ifndef INTERVAL_TREE_H
+#define INTERVAL_TREE_H
+
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+
+/**
+* A closed interval [start, end], the key of an IntervalTree. Ordered by
+* start, then end, so intervals sharing a start can coexist.
+*/
+template <typename T>
+struct Interval
+{
+    Interval(const T& s, const T& e) : start(s), end(e) {}
+
+    bool operator<(const Interval<T>& rhs) const
+    {
+        return start < rhs.start || (!(rhs.start < start) && end < rhs.end);
+    }
+    bool operator>(const Interval<T>& rhs) const
+    {
+        return rhs < *this;
+    }
+    bool operator==(const Interval<T>& rhs) const
+    {
+        return start == rhs.start && end == rhs.end;
+    }
+
+    T start;
+    T end;
+};
+
+// Prints [start, end], for printBST
+template <typename T>
+std::ostream& operator<<(std::ostream& out, const Interval<T>& interval)
+{
+    return out << '[' << interval.start << ", " << interval.end << ']';
+}
+
+/**
+* An AVLNode keyed on an interval that also tracks the largest interval
+* end anywhere in its subtree.
+*/
+template <typename T, typename Value>
+class IntervalNode : public AVLNode<Interval<T>, Value>
+{
+public:
+    IntervalNode(const Interval<T>& key, const Value& value, AVLNode<Interval<T>, Value>* parent);
+
+    const T& getMaxEnd() const;
+    // Recomputes the max end from the node's own end and its children's
+    // max ends, which must already be up to date.
+    void updateMaxEnd();
+
+    virtual IntervalNode<T, Value>* clone(Node<Interval<T>, Value>* parent) const override;
+
+protected:
+    T maxEnd_;
+};
+
+/*
+  ---------------------------------------------
+  Begin implementations for the IntervalNode class.
+  ---------------------------------------------
+*/
+
+template<class T, class Value>
+IntervalNode<T, Value>::IntervalNode(const Interval<T>& key, const Value& value, AVLNode<Interval<T>, Value>* parent) :
+    AVLNode<Interval<T>, Value>(key, value, parent), maxEnd_(key.end)
+{
+
+}
+
+template<class T, class Value>
+const T& IntervalNode<T, Value>::getMaxEnd() const
+{
+    return maxEnd_;
+}
+
+template<class T, class Value>
+void IntervalNode<T, Value>::updateMaxEnd()
+{
+    maxEnd_ = this->item_.first.end;
+    if (this->left_ != NULL) {
+        maxEnd_ = std::max(maxEnd_, static_cast<IntervalNode<T, Value>*>(this->left_)->maxEnd_);
+    }
+    if (this->right_ != NULL) {
+        maxEnd_ = std::max(maxEnd_, static_cast<IntervalNode<T, Value>*>(this->right_)->maxEnd_);
+    }
+}
+
+/**
+* Copies the item, balance, leaf depths and max end into a new childless node.
+*/
+template<class T, class Value>
+IntervalNode<T, Value>* IntervalNode<T, Value>::clone(Node<Interval<T>, Value>* parent) const
+{
+    IntervalNode<T, Value>* copy = new IntervalNode<T, Value>(this->item_.first, this->item_.second, static_cast<AVLNode<Interval<T>, Value>*>(parent));
+    copy->setBalance(this->getBalance());
+    copy->setLeafDepths(this->getMinLeafDepth(), this->getMaxLeafDepth());
+    copy->maxEnd_ = maxEnd_;
+    return copy;
+}
+
+/*
+  -------------------------------------------
+  End implementations for the IntervalNode class.
+  -------------------------------------------
+*/
+
+/**
+* An interval tree: an AVLTree keyed on closed intervals [start, end],
+* ordered by start (then end, so intervals sharing a start can coexist),
+* where every node also keeps the largest end in its subtree. AVLTree's
+* pullUp hook keeps that up to date through rotations, inserts and
+* removes.
+*
+* The max end lets queries skip every subtree that ends before the range
+* of interest, and the start order lets them stop at the first interval
+* starting after it. That is not the O(log n + k) of a centered or
+* augmented-endpoint interval tree: an interval that ends early can sit
+* between two reported ones, so the walk may still have to descend to
+* rule it out, and an overlap or stabbing query costs
+* O(min(n, k log(n / k))) for k results (O(log n) when k is 0 or 1).
+* Getting O(log n + k) would need a second structure keyed on end
+* points; this keeps the single AVLTree. Results come back in start
+* order.
+*/
+template <class T, class Value>
+class IntervalTree : public AVLTree<Interval<T>, Value>
+{
+public:
+    typedef IntervalNode<T, Value> NodeType;
+
+    /**
+    * The usual in-order iterator, which queries can also create.
+    */
+    class iterator : public AVLTree<Interval<T>, Value>::iterator
+    {
+    public:
+        iterator();
+        iterator(const typename AVLTree<Interval<T>, Value>::iterator& it);
+
+    protected:
+        friend class IntervalTree<T, Value>;
+        iterator(Node<Interval<T>, Value>* ptr);
+    };
+
+    // Throws std::invalid_argument if the interval ends before it starts
+    virtual void insert(const std::pair<const Interval<T>, Value>& new_item);
+    void insert(const T& start, const T& end, const Value& value);
+    using AVLTree<Interval<T>, Value>::insert;
+
+    // Every interval that shares a point with [lo, hi]
+    void overlapping(const T& lo, const T& hi, std::vector<iterator>& out) const;
+    // Every interval containing point
+    void stabbing(const T& point, std::vector<iterator>& out) const;
+    // out[i] is every interval containing points[i]. The points are sorted
+    // and then answered in a single walk that shares each node visit among
+    // all the points that reach it.
+    void stabbingBatch(const std::vector<T>& points, std::vector<std::vector<iterator> >& out) const;
+
+protected:
+    virtual NodeType* createNode(const Interval<T>& key, const Value& value, Node<Interval<T>, Value>* parent) const override;
+    virtual void linkNode(Node<Interval<T>, Value>* node, Node<Interval<T>, Value>* parent) override;
+    virtual bool canLink(const Node<Interval<T>, Value>* node) const override;
+    virtual void pullUp(AVLNode<Interval<T>, Value>* node) override;
+
+    static void stabSubtree(Node<Interval<T>, Value>* node, const std::vector<std::pair<T, size_t> >& points,
+                            size_t lo, size_t hi, std::vector<std::vector<iterator> >& out);
+    static const T& maxEnd(const Node<Interval<T>, Value>* node);
+    static bool pointBefore(const std::pair<T, size_t>& point, const T& value) { return point.first < value; }
+    static bool pointAfter(const T& value, const std::pair<T, size_t>& point) { return value < point.first; }
+};
+
+/*
+-----------------------------------------------------
+Begin implementations for the IntervalTree::iterator class.
+-----------------------------------------------------
+*/
+
+template<class T, class Value>
+IntervalTree<T, Value>::iterator::iterator()
+{
+
+}
+
+template<class T, class Value>
+IntervalTree<T, Value>::iterator::iterator(const typename AVLTree<Interval<T>, Value>::iterator& it) :
+    AVLTree<Interval<T>, Value>::iterator(it)
+{
+
+}
+
+template<class T, class Value>
+IntervalTree<T, Value>::iterator::iterator(Node<Interval<T>, Value>* ptr)
+{
+    this->current_ = ptr;
+}
+
+/*
+---------------------------------------------------
+End implementations for the IntervalTree::iterator class.
+---------------------------------------------------
+*/
+
+/*
+--------------------------------------------
+Begin implementations for the IntervalTree class.
+--------------------------------------------
+*/
+
+/**
+* Inserts the interval, or overwrites its value if it is already there.
+*/
+template<class T, class Value>
+void IntervalTree<T, Value>::insert(const std::pair<const Interval<T>, Value>& new_item)
+{
+    if (new_item.first.end < new_item.first.start) {
+        throw std::invalid_argument("Invalid interval");
+    }
+    BST_METRIC_OP(this, METRIC_INSERT);
+    Node<Interval<T>, Value>* existing = NULL;
+    Node<Interval<T>, Value>* parent = this->findLinkParent(new_item.first, existing);
+    if (existing != NULL) {
+        // same interval, so no max end changes
+        existing->setValue(new_item.second);
+        return;
+    }
+    BST_METRIC_ADD(this, METRIC_ALLOCATIONS, 1);
+    linkNode(createNode(new_item.first, new_item.second, NULL), parent);
+}
+
+template<class T, class Value>
+void IntervalTree<T, Value>::insert(const T& start, const T& end, const Value& value)
+{
+    insert(std::make_pair(Interval<T>(start, end), value));
+}
+
+template<class T, class Value>
+typename IntervalTree<T, Value>::NodeType* IntervalTree<T, Value>::createNode(const Interval<T>& key, const Value& value, Node<Interval<T>, Value>* parent) const
+{
+    return new NodeType(key, value, static_cast<AVLNode<Interval<T>, Value>*>(parent));
+}
+
+/**
+* In-order walk that never enters a subtree whose max end is below lo, and
+* stops at the first interval starting after hi.
+*/
+template<class T, class Value>
+void IntervalTree<T, Value>::overlapping(const T& lo, const T& hi, std::vector<iterator>& out) const
+{
+    BST_METRIC_OP(this, METRIC_FIND);
+    out.clear();
+    std::vector<Node<Interval<T>, Value>*> stack;
+    Node<Interval<T>, Value>* node = this->root_;
+    while (true) {
+        while (node != NULL && !(maxEnd(node) < lo)) {
+            stack.push_back(node);
+            node = node->getLeft();
+        }
+        if (stack.empty()) {
+            break;
+        }
+        node = stack.back();
+        stack.pop_back();
+        const Interval<T>& interval = node->getKey();
+        if (hi < interval.start) {
+            break; // everything after starts later still
+        }
+        if (!(interval.end < lo)) {
+            out.push_back(iterator(node));
+        }
+        node = node->getRight();
+    }
+}
+
+template<class T, class Value>
+void IntervalTree<T, Value>::stabbing(const T& point, std::vector<iterator>& out) const
+{
+    overlapping(point, point, out);
+}
+
+template<class T, class Value>
+void IntervalTree<T, Value>::stabbingBatch(const std::vector<T>& points, std::vector<std::vector<iterator> >& out) const
+{
+    BST_METRIC_OP(this, METRIC_FIND);
+    out.assign(points.size(), std::vector<iterator>());
+    std::vector<std::pair<T, size_t> > sorted;
+    sorted.reserve(points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+        sorted.push_back(std::make_pair(points[i], i));
+    }
+    std::sort(sorted.begin(), sorted.end());
+    stabSubtree(this->root_, sorted, 0, sorted.size(), out);
+}
+
+template<class T, class Value>
+bool IntervalTree<T, Value>::canLink(const Node<Interval<T>, Value>* node) const
+{
+    return dynamic_cast<const NodeType*>(node) != NULL;
+}
+
+template<class T, class Value>
+void IntervalTree<T, Value>::linkNode(Node<Interval<T>, Value>* node, Node<Interval<T>, Value>* parent)
+{
+    if (canLink(node)) {
+        // it goes in as a leaf
+        static_cast<NodeType*>(node)->updateMaxEnd();
+    }
+    AVLTree<Interval<T>, Value>::linkNode(node, parent);
+}
+
+template<class T, class Value>
+void IntervalTree<T, Value>::pullUp(AVLNode<Interval<T>, Value>* node)
+{
+    AVLTree<Interval<T>, Value>::pullUp(node);
+    static_cast<NodeType*>(node)->updateMaxEnd();
+}
+
+// Answers the sorted points [lo, hi) against node's subtree. Points past
+// the subtree's max end are dropped; the right subtree only starts at or
+// after node's start, so it only gets the points from there on. Recursion
+// depth is the tree height.
+template<class T, class Value>
+void IntervalTree<T, Value>::stabSubtree(Node<Interval<T>, Value>* node, const std::vector<std::pair<T, size_t> >& points,
+                                         size_t lo, size_t hi, std::vector<std::vector<iterator> >& out)
+{
+    while (node != NULL && lo < hi) {
+        hi = std::upper_bound(points.begin() + lo, points.begin() + hi, maxEnd(node), pointAfter) - points.begin();
+        if (lo == hi) {
+            return;
+        }
+        stabSubtree(node->getLeft(), points, lo, hi, out);
+
+        const Interval<T>& interval = node->getKey();
+        size_t first = std::lower_bound(points.begin() + lo, points.begin() + hi, interval.start, pointBefore) - points.begin();
+        for (size_t i = first; i < hi && !(interval.end < points[i].first); ++i) {
+            out[points[i].second].push_back(iterator(node));
+        }
+        // the right subtree is a tail call
+        node = node->getRight();
+        lo = first;
+    }
+}
+
+template<class T, class Value>
+const T& IntervalTree<T, Value>::maxEnd(const Node<Interval<T>, Value>* node)
+{
+    return static_cast<const NodeType*>(node)->getMaxEnd();
+}
+
+/*
+------------------------------------------
+End implementations for the IntervalTree class.
+------------------------------------------
+*/
+
+#endif
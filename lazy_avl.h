@@ -0,0 +1,469 @@
+#ifndef LAZY_AVL_H
+#define LAZY_AVL_H
+
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+
+/**
+* Update policies for LazyAVLTree. A policy describes an update that can
+* be applied to many values at once: a tag type, an identity tag, apply()
+* to change one value, and compose(older, newer), the single tag that has
+* the effect of older followed by newer.
+*/
+template <typename Value>
+struct AddUpdate
+{
+    typedef Value type;
+    static type identity() { return Value(); }
+    static Value apply(const Value& value, const type& tag) { return value + tag; }
+    static type compose(const type& older, const type& newer) { return older + newer; }
+};
+
+/**
+* An AVLNode with an update tag pending for its descendants. The node's
+* own value already has the tag applied; its children's don't yet.
+*/
+template <typename Key, typename Value, typename Update>
+class LazyAVLNode : public AVLNode<Key, Value>
+{
+public:
+    typedef typename Update::type TagType;
+
+    LazyAVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
+
+    // Applies tag to this node and everything below it, lazily
+    void tag(const TagType& tag);
+    // Hands the pending tag to the children, leaving the identity behind
+    void pushDown();
+    void clearTag();
+
+    virtual LazyAVLNode<Key, Value, Update>* clone(Node<Key, Value>* parent) const override;
+
+protected:
+    TagType pending_;
+    bool hasPending_;   // skips pushing identity tags down every path
+};
+
+/*
+  -------------------------------------------------
+  Begin implementations for the LazyAVLNode class.
+  -------------------------------------------------
+*/
+
+template<class Key, class Value, class Update>
+LazyAVLNode<Key, Value, Update>::LazyAVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent) :
+    AVLNode<Key, Value>(key, value, parent), pending_(Update::identity()), hasPending_(false)
+{
+
+}
+
+template<class Key, class Value, class Update>
+void LazyAVLNode<Key, Value, Update>::tag(const TagType& tag)
+{
+    this->setValue(Update::apply(this->item_.second, tag));
+    if (this->left_ != NULL || this->right_ != NULL) {
+        pending_ = hasPending_ ? Update::compose(pending_, tag) : tag;
+        hasPending_ = true;
+    }
+}
+
+template<class Key, class Value, class Update>
+void LazyAVLNode<Key, Value, Update>::pushDown()
+{
+    if (!hasPending_) {
+        return;
+    }
+    if (this->left_ != NULL) {
+        static_cast<LazyAVLNode<Key, Value, Update>*>(this->left_)->tag(pending_);
+    }
+    if (this->right_ != NULL) {
+        static_cast<LazyAVLNode<Key, Value, Update>*>(this->right_)->tag(pending_);
+    }
+    clearTag();
+}
+
+template<class Key, class Value, class Update>
+void LazyAVLNode<Key, Value, Update>::clearTag()
+{
+    pending_ = Update::identity();
+    hasPending_ = false;
+}
+
+/**
+* Copies the item, balance, leaf depths and pending tag into a new childless node.
+*/
+template<class Key, class Value, class Update>
+LazyAVLNode<Key, Value, Update>* LazyAVLNode<Key, Value, Update>::clone(Node<Key, Value>* parent) const
+{
+    LazyAVLNode<Key, Value, Update>* copy = new LazyAVLNode<Key, Value, Update>(this->item_.first, this->item_.second, static_cast<AVLNode<Key, Value>*>(parent));
+    copy->setBalance(this->getBalance());
+    copy->setLeafDepths(this->getMinLeafDepth(), this->getMaxLeafDepth());
+    copy->pending_ = pending_;
+    copy->hasPending_ = hasPending_;
+    return copy;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the LazyAVLNode class.
+  -----------------------------------------------
+*/
+
+/**
+* An AVL tree with lazy range updates (see AddUpdate). applyRange(lo, hi,
+* update) changes every value with a key in [lo, hi] in O(log n): it
+* updates the O(log n) nodes on the two boundary paths and tags the
+* subtrees in between. Tags move down a level whenever something needs to
+* look below a tagged node: the descents of find, operator[], insert and
+* remove, iterator steps, and, through AVLTree's pushDown hook, rotations.
+* Every value read through this class has all its updates applied.
+*
+* applyRange invalidates iterators, like insert and remove. Snapshots
+* push tags down as they write, and print(), exportTree() and the
+* parallel traversals flush them all first, which is O(n) like they are.
+*/
+template <class Key, class Value, class Update = AddUpdate<Value> >
+class LazyAVLTree : public AVLTree<Key, Value>
+{
+public:
+    typedef typename Update::type TagType;
+    typedef LazyAVLNode<Key, Value, Update> NodeType;
+
+    /**
+    * An in-order iterator that pushes tags down as it descends.
+    */
+    class iterator : public AVLTree<Key, Value>::iterator
+    {
+    public:
+        iterator();
+
+        iterator& operator++();
+
+    protected:
+        friend class LazyAVLTree<Key, Value, Update>;
+        iterator(Node<Key, Value>* ptr);
+    };
+
+    virtual void insert(const std::pair<const Key, Value>& new_item);
+    using AVLTree<Key, Value>::insert;
+
+    // Applies update to every value with lo <= key <= hi, O(log n)
+    void applyRange(const Key& lo, const Key& hi, const TagType& update);
+    // Pushes every pending tag all the way down, O(n)
+    void flushUpdates();
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    void findBatch(const std::vector<Key>& keys, std::vector<typename AVLTree<Key, Value>::iterator>& out) const;
+
+protected:
+    virtual NodeType* createNode(const Key& key, const Value& value, Node<Key, Value>* parent) const override;
+    virtual void linkNode(Node<Key, Value>* node, Node<Key, Value>* parent) override;
+    virtual Node<Key, Value>* unlinkNode(Node<Key, Value>* node) override;
+    virtual bool canLink(const Node<Key, Value>* node) const override;
+    virtual void pushDown(AVLNode<Key, Value>* node) override;
+    virtual void settleNodes() const override;
+
+    // Pushes tags down on the way, so the node's value is current
+    virtual Node<Key, Value>* internalFind(const Key& key) const override;
+    // Pushes the tags of node's ancestors down, root first, so node's value is current
+    static void pushAncestors(Node<Key, Value>* node);
+    static void push(Node<Key, Value>* node);
+};
+
+/*
+----------------------------------------------------
+Begin implementations for the LazyAVLTree::iterator class.
+----------------------------------------------------
+*/
+
+template<class Key, class Value, class Update>
+LazyAVLTree<Key, Value, Update>::iterator::iterator()
+{
+
+}
+
+template<class Key, class Value, class Update>
+LazyAVLTree<Key, Value, Update>::iterator::iterator(Node<Key, Value>* ptr)
+{
+    this->current_ = ptr;
+}
+
+/**
+* Same walk as BinarySearchTree's iterator. Ancestors of the current node
+* have already been pushed, so only the way down needs it.
+*/
+template<class Key, class Value, class Update>
+typename LazyAVLTree<Key, Value, Update>::iterator&
+LazyAVLTree<Key, Value, Update>::iterator::operator++()
+{
+    if (this->current_ != NULL && this->current_->getRight() != NULL) {
+        push(this->current_);
+        Node<Key, Value>* node = this->current_->getRight();
+        while (node->getLeft() != NULL) {
+            push(node);
+            node = node->getLeft();
+        }
+        this->current_ = node;
+        return *this;
+    }
+    AVLTree<Key, Value>::iterator::operator++();
+    return *this;
+}
+
+/*
+--------------------------------------------------
+End implementations for the LazyAVLTree::iterator class.
+--------------------------------------------------
+*/
+
+/*
+-------------------------------------------
+Begin implementations for the LazyAVLTree class.
+-------------------------------------------
+*/
+
+/**
+* Inserts or overwrites like AVLTree. The descent pushes tags down, so a
+* new node never lands under a tag meant for the nodes already there, and
+* an overwritten value isn't updated again later.
+*/
+template<class Key, class Value, class Update>
+void LazyAVLTree<Key, Value, Update>::insert(const std::pair<const Key, Value>& new_item)
+{
+    BST_METRIC_OP(this, METRIC_INSERT);
+    Node<Key, Value>* parent = NULL;
+    Node<Key, Value>* node = this->root_;
+    while (node != NULL) {
+        if (new_item.first == node->getKey()) {
+            node->setValue(new_item.second);
+            return;
+        }
+        push(node);
+        parent = node;
+        node = (new_item.first < node->getKey()) ? node->getLeft() : node->getRight();
+    }
+    BST_METRIC_ADD(this, METRIC_ALLOCATIONS, 1);
+    linkNode(createNode(new_item.first, new_item.second, NULL), parent);
+}
+
+template<class Key, class Value, class Update>
+typename LazyAVLTree<Key, Value, Update>::NodeType* LazyAVLTree<Key, Value, Update>::createNode(const Key& key, const Value& value, Node<Key, Value>* parent) const
+{
+    return new NodeType(key, value, static_cast<AVLNode<Key, Value>*>(parent));
+}
+
+/**
+* Walks down to the highest node inside [lo, hi], then along the left and
+* right boundary paths below it. A node on the left path at or above lo is
+* updated along with its whole right subtree, which just gets tagged; the
+* right path mirrors that. Every node on the paths is pushed before
+* anything below it is tagged, so tags compose in the order applied.
+*/
+template<class Key, class Value, class Update>
+void LazyAVLTree<Key, Value, Update>::applyRange(const Key& lo, const Key& hi, const TagType& update)
+{
+    Node<Key, Value>* split = this->root_;
+    while (split != NULL) {
+        push(split);
+        if (split->getKey() < lo) {
+            split = split->getRight();
+        }
+        else if (hi < split->getKey()) {
+            split = split->getLeft();
+        }
+        else {
+            break;
+        }
+    }
+    if (split == NULL) {
+        return;
+    }
+    split->setValue(Update::apply(split->getValue(), update));
+
+    for (Node<Key, Value>* node = split->getLeft(); node != NULL; ) {
+        push(node);
+        if (node->getKey() < lo) {
+            node = node->getRight();
+        }
+        else {
+            node->setValue(Update::apply(node->getValue(), update));
+            if (node->getRight() != NULL) {
+                static_cast<NodeType*>(node->getRight())->tag(update);
+            }
+            node = node->getLeft();
+        }
+    }
+
+    for (Node<Key, Value>* node = split->getRight(); node != NULL; ) {
+        push(node);
+        if (hi < node->getKey()) {
+            node = node->getLeft();
+        }
+        else {
+            node->setValue(Update::apply(node->getValue(), update));
+            if (node->getLeft() != NULL) {
+                static_cast<NodeType*>(node->getLeft())->tag(update);
+            }
+            node = node->getRight();
+        }
+    }
+}
+
+template<class Key, class Value, class Update>
+void LazyAVLTree<Key, Value, Update>::flushUpdates()
+{
+    settleNodes();
+}
+
+template<class Key, class Value, class Update>
+void LazyAVLTree<Key, Value, Update>::settleNodes() const
+{
+    std::vector<Node<Key, Value>*> stack;
+    if (this->root_ != NULL) {
+        stack.push_back(this->root_);
+    }
+    while (!stack.empty()) {
+        Node<Key, Value>* node = stack.back();
+        stack.pop_back();
+        push(node);
+        if (node->getLeft() != NULL) {
+            stack.push_back(node->getLeft());
+        }
+        if (node->getRight() != NULL) {
+            stack.push_back(node->getRight());
+        }
+    }
+}
+
+template<class Key, class Value, class Update>
+typename LazyAVLTree<Key, Value, Update>::iterator LazyAVLTree<Key, Value, Update>::begin() const
+{
+    Node<Key, Value>* node = this->root_;
+    if (node != NULL) {
+        while (node->getLeft() != NULL) {
+            push(node);
+            node = node->getLeft();
+        }
+    }
+    return iterator(node);
+}
+
+template<class Key, class Value, class Update>
+typename LazyAVLTree<Key, Value, Update>::iterator LazyAVLTree<Key, Value, Update>::end() const
+{
+    return iterator(NULL);
+}
+
+template<class Key, class Value, class Update>
+typename LazyAVLTree<Key, Value, Update>::iterator LazyAVLTree<Key, Value, Update>::find(const Key& key) const
+{
+    BST_METRIC_OP(this, METRIC_FIND);
+    return iterator(internalFind(key));
+}
+
+template<class Key, class Value, class Update>
+void LazyAVLTree<Key, Value, Update>::findBatch(const std::vector<Key>& keys, std::vector<typename AVLTree<Key, Value>::iterator>& out) const
+{
+    BST_METRIC_OP(this, METRIC_FIND);
+    out.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        out[i] = iterator(internalFind(keys[i]));
+    }
+}
+
+template<class Key, class Value, class Update>
+bool LazyAVLTree<Key, Value, Update>::canLink(const Node<Key, Value>* node) const
+{
+    return dynamic_cast<const NodeType*>(node) != NULL;
+}
+
+/*
+ * Node handles can arrive from anywhere, so this pushes parent's ancestors
+ * too before hanging node under it.
+ */
+template<class Key, class Value, class Update>
+void LazyAVLTree<Key, Value, Update>::linkNode(Node<Key, Value>* node, Node<Key, Value>* parent)
+{
+    if (canLink(node)) {
+        static_cast<NodeType*>(node)->clearTag();
+    }
+    if (parent != NULL) {
+        pushAncestors(parent);
+        push(parent);
+    }
+    AVLTree<Key, Value>::linkNode(node, parent);
+}
+
+/*
+ * AVLTree::unlinkNode may swap node with its predecessor and hangs node's
+ * child on node's parent, so everything from the root to the predecessor
+ * is pushed first.
+ */
+template<class Key, class Value, class Update>
+Node<Key, Value>* LazyAVLTree<Key, Value, Update>::unlinkNode(Node<Key, Value>* node)
+{
+    pushAncestors(node);
+    push(node);
+    if (node->getLeft() != NULL && node->getRight() != NULL) {
+        for (Node<Key, Value>* pred = node->getLeft(); pred != NULL; pred = pred->getRight()) {
+            push(pred);
+        }
+    }
+    return AVLTree<Key, Value>::unlinkNode(node);
+}
+
+template<class Key, class Value, class Update>
+void LazyAVLTree<Key, Value, Update>::pushDown(AVLNode<Key, Value>* node)
+{
+    push(node);
+}
+
+template<class Key, class Value, class Update>
+Node<Key, Value>* LazyAVLTree<Key, Value, Update>::internalFind(const Key& key) const
+{
+    Node<Key, Value>* node = this->root_;
+    while (node != NULL && !(key == node->getKey())) {
+        push(node);
+        node = (key < node->getKey()) ? node->getLeft() : node->getRight();
+    }
+    return node;
+}
+
+template<class Key, class Value, class Update>
+void LazyAVLTree<Key, Value, Update>::pushAncestors(Node<Key, Value>* node)
+{
+    // a balanced tree is only ~1.45 log2(n) deep, but nothing here relies
+    // on the tree being balanced, so the path grows as far as it has to
+    std::vector<Node<Key, Value>*> path;
+    path.reserve(64);
+    for (Node<Key, Value>* up = node->getParent(); up != NULL; up = up->getParent()) {
+        path.push_back(up);
+    }
+    while (!path.empty()) {
+        push(path.back());
+        path.pop_back();
+    }
+}
+
+template<class Key, class Value, class Update>
+void LazyAVLTree<Key, Value, Update>::push(Node<Key, Value>* node)
+{
+    static_cast<NodeType*>(node)->pushDown();
+}
+
+/*
+-----------------------------------------
+End implementations for the LazyAVLTree class.
+-----------------------------------------
+*/
+
+#endif
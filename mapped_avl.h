@@ -0,0 +1,544 @@
+#ifndef MAPPED_AVL_H
+#define MAPPED_AVL_H
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compact_avl.h"
+
+#define MAPPED_AVL_MAGIC "AVLMMAP"
+#define MAPPED_AVL_VERSION 1
+#define MAPPED_AVL_INITIAL_CAPACITY 1024
+
+/**
+* The first 64 bytes of a mapped tree file. Everything the tree needs to
+* find its nodes lives here, so opening a file is O(1) no matter how big
+* the tree is. Nodes follow the header as a flat array, and links between
+* them are indices into that array, i.e. offsets relative to the mapping
+* rather than absolute pointers, so the file can be mapped at any address.
+*/
+struct MappedAVLHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeSize;
+    uint32_t keySize;
+    uint32_t valueSize;
+    uint32_t root;
+    uint32_t freeHead;
+    uint64_t size;       // live nodes
+    uint64_t used;       // slots ever handed out (the free list covers the rest)
+    uint64_t capacity;   // slots the file currently has room for
+    uint64_t reserved;
+};
+
+/**
+* A CompactAVLTree storage backend whose nodes live in a MAP_SHARED file
+* mapping, so the page cache is shared between every process that opens
+* the same file read-only. Keys and values must be trivially copyable,
+* since they are stored in the file byte for byte.
+*
+* There is no locking between processes. A file opened writable must not
+* be open anywhere else at the same time, not even read-only: a reader
+* would see half-done rebalances, and could fault if growing the file
+* moved or resized it under its mapping. Several read-only opens are fine.
+*
+* In read-only mode the file is mapped PROT_READ and nothing may be
+* modified. In writable mode the file is grown (doubling) when it runs
+* out of slots, which may move the mapping; CompactAVLTree never holds a
+* node reference across allocate() and its iterators hold indices, so they
+* survive a remap.
+*/
+template <typename Key, typename Value>
+class CompactMappedStorage
+{
+public:
+    typedef CompactAVLNode<Key, Value> NodeType;
+
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+        "Mapped trees can only hold trivially copyable keys and values");
+
+    CompactMappedStorage();
+    ~CompactMappedStorage();
+
+    void open(const std::string& path, bool writable);
+    void close();
+    void sync();
+    bool writable() const;
+
+    NodeType& node(uint32_t index);
+    const NodeType& node(uint32_t index) const;
+
+    uint32_t allocate(const Key& key, const Value& value, uint32_t parent);
+    void release(uint32_t index);
+
+    uint32_t root() const;
+    void setRoot(uint32_t root);
+    size_t size() const;
+    void clear();
+    void reserve(size_t count);
+    size_t memoryUsage() const;
+
+private:
+    // Not copyable: owns the file descriptor and the mapping
+    CompactMappedStorage(const CompactMappedStorage& other);
+    CompactMappedStorage& operator=(const CompactMappedStorage& other);
+
+    static size_t fileSizeFor(uint64_t capacity);
+    void map(size_t length);
+    void grow(uint64_t capacity);
+    void fail(const std::string& what);
+
+    MappedAVLHeader* header() const;
+    NodeType* nodes() const;
+
+    int fd_;
+    bool writable_;
+    char* base_;
+    size_t length_;
+    std::string path_;
+};
+
+template <typename Key, typename Value>
+CompactMappedStorage<Key, Value>::CompactMappedStorage() :
+    fd_(-1),
+    writable_(false),
+    base_(NULL),
+    length_(0)
+{
+
+}
+
+template <typename Key, typename Value>
+CompactMappedStorage<Key, Value>::~CompactMappedStorage()
+{
+    close();
+}
+
+template <typename Key, typename Value>
+size_t CompactMappedStorage<Key, Value>::fileSizeFor(uint64_t capacity)
+{
+    return sizeof(MappedAVLHeader) + static_cast<size_t>(capacity) * sizeof(NodeType);
+}
+
+template <typename Key, typename Value>
+void CompactMappedStorage<Key, Value>::fail(const std::string& what)
+{
+    std::string message = what + " " + path_ + ": " + strerror(errno);
+    close();
+    throw std::runtime_error(message);
+}
+
+template <typename Key, typename Value>
+void CompactMappedStorage<Key, Value>::map(size_t length)
+{
+    int prot = writable_ ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void* base = mmap(NULL, length, prot, MAP_SHARED, fd_, 0);
+    if (base == MAP_FAILED) {
+        fail("Could not map");
+    }
+    base_ = static_cast<char*>(base);
+    length_ = length;
+}
+
+/**
+* Opens (and in writable mode, creates if needed) a tree file. Only the
+* header is read and checked; the nodes are paged in on first access.
+*/
+template <typename Key, typename Value>
+void CompactMappedStorage<Key, Value>::open(const std::string& path, bool writable)
+{
+    close();
+    path_ = path;
+    writable_ = writable;
+
+    fd_ = ::open(path.c_str(), writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (fd_ < 0) {
+        fail("Could not open");
+    }
+    struct stat info;
+    if (fstat(fd_, &info) != 0) {
+        fail("Could not stat");
+    }
+
+    if (info.st_size == 0 && writable) {
+        // brand new file: lay down an empty header
+        if (ftruncate(fd_, fileSizeFor(MAPPED_AVL_INITIAL_CAPACITY)) != 0) {
+            fail("Could not size");
+        }
+        map(fileSizeFor(MAPPED_AVL_INITIAL_CAPACITY));
+        MappedAVLHeader* h = header();
+        memset(h, 0, sizeof(MappedAVLHeader));
+        memcpy(h->magic, MAPPED_AVL_MAGIC, sizeof(MAPPED_AVL_MAGIC));
+        h->version = MAPPED_AVL_VERSION;
+        h->nodeSize = sizeof(NodeType);
+        h->keySize = sizeof(Key);
+        h->valueSize = sizeof(Value);
+        h->root = NodeType::NIL;
+        h->freeHead = NodeType::NIL;
+        h->capacity = MAPPED_AVL_INITIAL_CAPACITY;
+        return;
+    }
+
+    if (static_cast<size_t>(info.st_size) < sizeof(MappedAVLHeader)) {
+        errno = EINVAL;
+        fail("Not a mapped AVL tree file:");
+    }
+    map(static_cast<size_t>(info.st_size));
+    const MappedAVLHeader* h = header();
+    if (memcmp(h->magic, MAPPED_AVL_MAGIC, sizeof(MAPPED_AVL_MAGIC)) != 0 ||
+        h->version != MAPPED_AVL_VERSION) {
+        errno = EINVAL;
+        fail("Not a mapped AVL tree file:");
+    }
+    if (h->nodeSize != sizeof(NodeType) || h->keySize != sizeof(Key) || h->valueSize != sizeof(Value)) {
+        errno = EINVAL;
+        fail("Key/value types don't match tree file");
+    }
+    // Every slot the header points at has to be inside the file, or node()
+    // would read past the mapping. The nodes' own links aren't walked, so
+    // opening stays O(1).
+    uint64_t fileSlots = (info.st_size - sizeof(MappedAVLHeader)) / sizeof(NodeType);
+    if (h->capacity > fileSlots || h->capacity > NodeType::NIL ||
+        h->used > h->capacity || h->size > h->used ||
+        (h->root == NodeType::NIL) != (h->size == 0) ||
+        (h->root != NodeType::NIL && h->root >= h->used) ||
+        (h->freeHead != NodeType::NIL && h->freeHead >= h->used)) {
+        errno = EINVAL;
+        fail("Corrupt header in tree file");
+    }
+}
+
+template <typename Key, typename Value>
+void CompactMappedStorage<Key, Value>::close()
+{
+    if (base_ != NULL) {
+        munmap(base_, length_);
+        base_ = NULL;
+        length_ = 0;
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+/**
+* Flushes dirty pages to disk. The kernel writes them back eventually
+* anyway; this is for callers that need it to happen now.
+*/
+template <typename Key, typename Value>
+void CompactMappedStorage<Key, Value>::sync()
+{
+    if (base_ != NULL && writable_ && msync(base_, length_, MS_SYNC) != 0) {
+        throw std::runtime_error("Could not sync " + path_ + ": " + strerror(errno));
+    }
+}
+
+template <typename Key, typename Value>
+bool CompactMappedStorage<Key, Value>::writable() const
+{
+    return writable_;
+}
+
+template <typename Key, typename Value>
+MappedAVLHeader* CompactMappedStorage<Key, Value>::header() const
+{
+    return reinterpret_cast<MappedAVLHeader*>(base_);
+}
+
+template <typename Key, typename Value>
+typename CompactMappedStorage<Key, Value>::NodeType*
+CompactMappedStorage<Key, Value>::nodes() const
+{
+    return reinterpret_cast<NodeType*>(base_ + sizeof(MappedAVLHeader));
+}
+
+template <typename Key, typename Value>
+typename CompactMappedStorage<Key, Value>::NodeType&
+CompactMappedStorage<Key, Value>::node(uint32_t index)
+{
+    return nodes()[index];
+}
+
+template <typename Key, typename Value>
+const typename CompactMappedStorage<Key, Value>::NodeType&
+CompactMappedStorage<Key, Value>::node(uint32_t index) const
+{
+    return nodes()[index];
+}
+
+// Extends the file and remaps it, possibly at a different address. The
+// new mapping is made before the old one goes, so if it fails the tree is
+// still usable at its old capacity (the file just keeps the extra room).
+template <typename Key, typename Value>
+void CompactMappedStorage<Key, Value>::grow(uint64_t capacity)
+{
+    size_t length = fileSizeFor(capacity);
+    if (ftruncate(fd_, length) != 0) {
+        throw std::runtime_error("Could not grow " + path_ + ": " + strerror(errno));
+    }
+    void* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (base == MAP_FAILED) {
+        throw std::runtime_error("Could not map " + path_ + ": " + strerror(errno));
+    }
+    munmap(base_, length_);
+    base_ = static_cast<char*>(base);
+    length_ = length;
+    header()->capacity = capacity;
+}
+
+template <typename Key, typename Value>
+uint32_t CompactMappedStorage<Key, Value>::allocate(const Key& key, const Value& value, uint32_t parent)
+{
+    MappedAVLHeader* h = header();
+    uint32_t index;
+    if (h->freeHead != NodeType::NIL) {
+        index = h->freeHead;
+        h->freeHead = node(index).left_ & NodeType::LINK_MASK;
+    }
+    else {
+        if (h->used >= NodeType::NIL) {
+            throw std::length_error("CompactAVLTree is full");
+        }
+        if (h->used == h->capacity) {
+            grow(std::min<uint64_t>(h->capacity * 2, NodeType::NIL));
+            h = header();
+        }
+        index = static_cast<uint32_t>(h->used++);
+    }
+    new (&node(index)) NodeType(key, value, parent);
+    ++h->size;
+    return index;
+}
+
+template <typename Key, typename Value>
+void CompactMappedStorage<Key, Value>::release(uint32_t index)
+{
+    MappedAVLHeader* h = header();
+    node(index).left_ = h->freeHead;
+    node(index).right_ = NodeType::NIL;
+    node(index).parent_ = NodeType::NIL;
+    h->freeHead = index;
+    --h->size;
+}
+
+template <typename Key, typename Value>
+uint32_t CompactMappedStorage<Key, Value>::root() const
+{
+    return header()->root;
+}
+
+template <typename Key, typename Value>
+void CompactMappedStorage<Key, Value>::setRoot(uint32_t root)
+{
+    header()->root = root;
+}
+
+template <typename Key, typename Value>
+size_t CompactMappedStorage<Key, Value>::size() const
+{
+    return static_cast<size_t>(header()->size);
+}
+
+// Forgets every node but keeps the file at its current size
+template <typename Key, typename Value>
+void CompactMappedStorage<Key, Value>::clear()
+{
+    MappedAVLHeader* h = header();
+    h->root = NodeType::NIL;
+    h->freeHead = NodeType::NIL;
+    h->size = 0;
+    h->used = 0;
+}
+
+template <typename Key, typename Value>
+void CompactMappedStorage<Key, Value>::reserve(size_t count)
+{
+    if (count > header()->capacity) {
+        grow(std::min<uint64_t>(count, NodeType::NIL));
+    }
+}
+
+template <typename Key, typename Value>
+size_t CompactMappedStorage<Key, Value>::memoryUsage() const
+{
+    return length_;
+}
+
+/**
+* A file-backed AVL tree. Opening is O(1): find(), lower_bound() and
+* iteration work directly on the mapped nodes with no deserialization.
+*
+* Trees opened read-only (the default) are mapped PROT_READ, so any write
+* would fault: insert, remove, clear and the non-const operator[] throw
+* logic_error instead, and iterators only give const access to the items
+* (in writable mode too, since a tree can't tell at compile time). Open
+* with writable = true and use insert or operator[] to modify the tree,
+* growing the file as needed.
+*/
+template <typename Key, typename Value>
+class MappedAVLTree : public CompactAVLTree<Key, Value, CompactMappedStorage<Key, Value> >
+{
+public:
+    typedef CompactAVLTree<Key, Value, CompactMappedStorage<Key, Value> > Base;
+
+    MappedAVLTree(const std::string& path, bool writable = false);
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    void sync();
+    bool writable() const;
+
+    /**
+    * CompactAVLTree's iterator with read-only access to the items.
+    */
+    class iterator : public Base::iterator
+    {
+    public:
+        iterator();
+        iterator(const typename Base::iterator& it);
+
+        const std::pair<const Key, Value>& operator*() const;
+        const std::pair<const Key, Value>* operator->() const;
+
+        iterator& operator++();
+    };
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+protected:
+    void requireWritable() const;
+};
+
+template <typename Key, typename Value>
+MappedAVLTree<Key, Value>::iterator::iterator()
+{
+
+}
+
+template <typename Key, typename Value>
+MappedAVLTree<Key, Value>::iterator::iterator(const typename Base::iterator& it) :
+    Base::iterator(it)
+{
+
+}
+
+template <typename Key, typename Value>
+const std::pair<const Key, Value>& MappedAVLTree<Key, Value>::iterator::operator*() const
+{
+    return Base::iterator::operator*();
+}
+
+template <typename Key, typename Value>
+const std::pair<const Key, Value>* MappedAVLTree<Key, Value>::iterator::operator->() const
+{
+    return Base::iterator::operator->();
+}
+
+template <typename Key, typename Value>
+typename MappedAVLTree<Key, Value>::iterator& MappedAVLTree<Key, Value>::iterator::operator++()
+{
+    Base::iterator::operator++();
+    return *this;
+}
+
+template <typename Key, typename Value>
+MappedAVLTree<Key, Value>::MappedAVLTree(const std::string& path, bool writable)
+{
+    this->storage_.open(path, writable);
+}
+
+template <typename Key, typename Value>
+void MappedAVLTree<Key, Value>::requireWritable() const
+{
+    if (!this->storage_.writable()) {
+        throw std::logic_error("MappedAVLTree was opened read-only");
+    }
+}
+
+template <typename Key, typename Value>
+typename MappedAVLTree<Key, Value>::iterator MappedAVLTree<Key, Value>::begin() const
+{
+    return iterator(Base::begin());
+}
+
+template <typename Key, typename Value>
+typename MappedAVLTree<Key, Value>::iterator MappedAVLTree<Key, Value>::end() const
+{
+    return iterator(Base::end());
+}
+
+template <typename Key, typename Value>
+typename MappedAVLTree<Key, Value>::iterator MappedAVLTree<Key, Value>::find(const Key& key) const
+{
+    return iterator(Base::find(key));
+}
+
+template <typename Key, typename Value>
+typename MappedAVLTree<Key, Value>::iterator MappedAVLTree<Key, Value>::lower_bound(const Key& key) const
+{
+    return iterator(Base::lower_bound(key));
+}
+
+template <typename Key, typename Value>
+Value& MappedAVLTree<Key, Value>::operator[](const Key& key)
+{
+    requireWritable();
+    return Base::operator[](key);
+}
+
+template <typename Key, typename Value>
+Value const & MappedAVLTree<Key, Value>::operator[](const Key& key) const
+{
+    return Base::operator[](key);
+}
+
+template <typename Key, typename Value>
+void MappedAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    requireWritable();
+    Base::insert(keyValuePair);
+}
+
+template <typename Key, typename Value>
+void MappedAVLTree<Key, Value>::remove(const Key& key)
+{
+    requireWritable();
+    Base::remove(key);
+}
+
+template <typename Key, typename Value>
+void MappedAVLTree<Key, Value>::clear()
+{
+    requireWritable();
+    Base::clear();
+}
+
+template <typename Key, typename Value>
+void MappedAVLTree<Key, Value>::sync()
+{
+    this->storage_.sync();
+}
+
+template <typename Key, typename Value>
+bool MappedAVLTree<Key, Value>::writable() const
+{
+    return this->storage_.writable();
+}
+
+#endif
@@ -0,0 +1,470 @@
+#ifndef SEPARATED_AVL_H
+#define SEPARATED_AVL_H
+
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+
+// values per arena chunk (a power of two)
+#define VALUE_ARENA_CHUNK_SHIFT 10
+#define VALUE_ARENA_CHUNK (1u << VALUE_ARENA_CHUNK_SHIFT)
+
+/**
+* Out-of-line storage for the values of a SeparatedAVLTree. A value is
+* addressed by the 32-bit index of its slot. Slots live in contiguous
+* chunks of VALUE_ARENA_CHUNK values, so growing never moves a stored
+* value and references stay valid until the value is released. Released
+* slots go on a free list and are reused by later allocations; they keep
+* their old value until then, so compact() is also how memory held by
+* removed values is given back.
+*/
+template <typename Value>
+class ValueArena
+{
+public:
+    static const uint32_t NIL = 0xFFFFFFFFu;
+
+    ValueArena();
+
+    Value& value(uint32_t index);
+    const Value& value(uint32_t index) const;
+
+    uint32_t allocate(const Value& value);
+    void release(uint32_t index);
+
+    // Live values, and slots including free ones
+    size_t size() const;
+    size_t slots() const;
+    void clear();
+    size_t memoryUsage() const;
+
+    // Moves the values at the given indices, in that order, to the front
+    // of a fresh arena and drops everything else. Afterwards order[i] lives
+    // in slot i. If it throws, the arena is left as it was.
+    void compact(const std::vector<uint32_t>& order);
+
+private:
+    void append(const Value& value);
+
+    // each chunk is reserved up front, so push_back never reallocates it
+    std::vector<std::vector<Value> > chunks_;
+    std::vector<uint32_t> free_;
+    size_t slots_;
+};
+
+template <typename Value>
+const uint32_t ValueArena<Value>::NIL;
+
+/*
+--------------------------------------------
+Begin implementations for the ValueArena class.
+--------------------------------------------
+*/
+
+template <typename Value>
+ValueArena<Value>::ValueArena() :
+    slots_(0)
+{
+
+}
+
+template <typename Value>
+Value& ValueArena<Value>::value(uint32_t index)
+{
+    return chunks_[index >> VALUE_ARENA_CHUNK_SHIFT][index & (VALUE_ARENA_CHUNK - 1)];
+}
+
+template <typename Value>
+const Value& ValueArena<Value>::value(uint32_t index) const
+{
+    return chunks_[index >> VALUE_ARENA_CHUNK_SHIFT][index & (VALUE_ARENA_CHUNK - 1)];
+}
+
+/**
+* Stores a copy of value and returns its slot, reusing a free one if any.
+*/
+template <typename Value>
+uint32_t ValueArena<Value>::allocate(const Value& value)
+{
+    if (!free_.empty()) {
+        uint32_t index = free_.back();
+        free_.pop_back();
+        this->value(index) = value;
+        return index;
+    }
+    if (slots_ >= NIL) {
+        throw std::length_error("ValueArena is full");
+    }
+    append(value);
+    return static_cast<uint32_t>(slots_ - 1);
+}
+
+template <typename Value>
+void ValueArena<Value>::release(uint32_t index)
+{
+    free_.push_back(index);
+}
+
+template <typename Value>
+size_t ValueArena<Value>::size() const
+{
+    return slots_ - free_.size();
+}
+
+template <typename Value>
+size_t ValueArena<Value>::slots() const
+{
+    return slots_;
+}
+
+template <typename Value>
+void ValueArena<Value>::clear()
+{
+    chunks_.clear();
+    free_.clear();
+    slots_ = 0;
+}
+
+template <typename Value>
+size_t ValueArena<Value>::memoryUsage() const
+{
+    return sizeof(*this) + chunks_.capacity() * sizeof(std::vector<Value>) +
+        chunks_.size() * VALUE_ARENA_CHUNK * sizeof(Value) + free_.capacity() * sizeof(uint32_t);
+}
+
+/**
+* Every chunk is allocated before the first value moves, so running out of
+* memory leaves the values where they were. Values are moved rather than
+* copied (unless their move could throw), so large values aren't held
+* twice.
+*/
+template <typename Value>
+void ValueArena<Value>::compact(const std::vector<uint32_t>& order)
+{
+    std::vector<std::vector<Value> > packed((order.size() + VALUE_ARENA_CHUNK - 1) >> VALUE_ARENA_CHUNK_SHIFT);
+    for (size_t i = 0; i < packed.size(); ++i) {
+        packed[i].reserve(VALUE_ARENA_CHUNK);
+    }
+    for (size_t i = 0; i < order.size(); ++i) {
+        packed[i >> VALUE_ARENA_CHUNK_SHIFT].push_back(std::move_if_noexcept(value(order[i])));
+    }
+    chunks_.swap(packed);
+    std::vector<uint32_t>().swap(free_);
+    slots_ = order.size();
+}
+
+// Adds a slot at the end, starting a new chunk when the last one is full
+template <typename Value>
+void ValueArena<Value>::append(const Value& value)
+{
+    if ((slots_ & (VALUE_ARENA_CHUNK - 1)) == 0) {
+        chunks_.push_back(std::vector<Value>());
+        chunks_.back().reserve(VALUE_ARENA_CHUNK);
+    }
+    chunks_.back().push_back(value);
+    ++slots_;
+}
+
+/*
+------------------------------------------
+End implementations for the ValueArena class.
+------------------------------------------
+*/
+
+/**
+* An AVL tree with key/value separation, for large values. The nodes hold
+* only the key and a 32-bit handle into a ValueArena, so descents,
+* rotations and nodeSwap only ever touch small nodes, and many more of them
+* fit in cache. Values are read through the handle once the right node has
+* been found.
+*
+* Iterators dereference to a pair of references, std::pair<const Key&,
+* Value&>, so it->first and it->second work as for the other trees.
+* References to values (from the iterators or operator[]) stay valid
+* until the key is removed or compactValues() repacks the arena.
+*/
+template <typename Key, typename Value>
+class SeparatedAVLTree
+{
+public:
+    typedef AVLTree<Key, uint32_t> HandleTree;
+
+    /**
+    * Iterates in key order, reading each value out of the arena.
+    */
+    class iterator
+    {
+    public:
+        typedef std::pair<const Key&, Value&> reference;
+
+        // Holds the pair operator-> points to, since it isn't stored anywhere
+        class pointer
+        {
+        public:
+            const reference* operator->() const { return &ref_; }
+        protected:
+            friend class iterator;
+            pointer(const reference& ref) : ref_(ref) {}
+            reference ref_;
+        };
+
+        iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+
+    protected:
+        friend class SeparatedAVLTree<Key, Value>;
+        iterator(const typename HandleTree::iterator& it, ValueArena<Value>* values);
+        typename HandleTree::iterator it_;
+        ValueArena<Value>* values_;
+    };
+
+    SeparatedAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool isBalanced() const;
+    bool empty() const;
+    size_t size() const;
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+    // Repacks the values in key order, dropping free slots, so that
+    // iteration reads the arena front to back. O(n).
+    void compactValues();
+    // Arena slots that are free for reuse
+    size_t freeValueSlots() const;
+    size_t memoryUsage() const;
+
+protected:
+    HandleTree tree_;
+    // iterators hand out Value& even from a const tree, as BinarySearchTree's do
+    mutable ValueArena<Value> values_;
+};
+
+/*
+----------------------------------------------------------
+Begin implementations for the SeparatedAVLTree::iterator class.
+----------------------------------------------------------
+*/
+
+template <typename Key, typename Value>
+SeparatedAVLTree<Key, Value>::iterator::iterator() :
+    values_(NULL)
+{
+
+}
+
+template <typename Key, typename Value>
+SeparatedAVLTree<Key, Value>::iterator::iterator(const typename HandleTree::iterator& it, ValueArena<Value>* values) :
+    it_(it),
+    values_(values)
+{
+
+}
+
+template <typename Key, typename Value>
+typename SeparatedAVLTree<Key, Value>::iterator::reference
+SeparatedAVLTree<Key, Value>::iterator::operator*() const
+{
+    return reference(it_->first, values_->value(it_->second));
+}
+
+template <typename Key, typename Value>
+typename SeparatedAVLTree<Key, Value>::iterator::pointer
+SeparatedAVLTree<Key, Value>::iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+template <typename Key, typename Value>
+bool SeparatedAVLTree<Key, Value>::iterator::operator==(const iterator& rhs) const
+{
+    return it_ == rhs.it_;
+}
+
+template <typename Key, typename Value>
+bool SeparatedAVLTree<Key, Value>::iterator::operator!=(const iterator& rhs) const
+{
+    return it_ != rhs.it_;
+}
+
+template <typename Key, typename Value>
+typename SeparatedAVLTree<Key, Value>::iterator&
+SeparatedAVLTree<Key, Value>::iterator::operator++()
+{
+    ++it_;
+    return *this;
+}
+
+/*
+--------------------------------------------------------
+End implementations for the SeparatedAVLTree::iterator class.
+--------------------------------------------------------
+*/
+
+/*
+-------------------------------------------------
+Begin implementations for the SeparatedAVLTree class.
+-------------------------------------------------
+*/
+
+template <typename Key, typename Value>
+SeparatedAVLTree<Key, Value>::SeparatedAVLTree()
+{
+
+}
+
+/**
+* Overwrites the value in its slot if the key is already there, so
+* updates don't touch the tree's shape or the free list.
+*/
+template <typename Key, typename Value>
+void SeparatedAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    typename HandleTree::iterator it = tree_.find(keyValuePair.first);
+    if (it != tree_.end()) {
+        values_.value(it->second) = keyValuePair.second;
+        return;
+    }
+    uint32_t handle = values_.allocate(keyValuePair.second);
+    try {
+        tree_.insert(std::make_pair(keyValuePair.first, handle));
+    }
+    catch (...) {
+        values_.release(handle);
+        throw;
+    }
+}
+
+/**
+* Unlinks the node found by one descent (via extract, rather than find
+* then remove) and frees its value slot.
+*/
+template <typename Key, typename Value>
+void SeparatedAVLTree<Key, Value>::remove(const Key& key)
+{
+    typename HandleTree::iterator it = tree_.find(key);
+    if (it == tree_.end()) {
+        return;
+    }
+    typename HandleTree::node_type node = tree_.extract(it);
+    values_.release(node.mapped());
+}
+
+template <typename Key, typename Value>
+void SeparatedAVLTree<Key, Value>::clear()
+{
+    tree_.clear();
+    values_.clear();
+}
+
+template <typename Key, typename Value>
+bool SeparatedAVLTree<Key, Value>::isBalanced() const
+{
+    return tree_.isBalanced();
+}
+
+template <typename Key, typename Value>
+bool SeparatedAVLTree<Key, Value>::empty() const
+{
+    return tree_.empty();
+}
+
+template <typename Key, typename Value>
+size_t SeparatedAVLTree<Key, Value>::size() const
+{
+    return values_.size();
+}
+
+template <typename Key, typename Value>
+typename SeparatedAVLTree<Key, Value>::iterator SeparatedAVLTree<Key, Value>::begin() const
+{
+    return iterator(tree_.begin(), &values_);
+}
+
+template <typename Key, typename Value>
+typename SeparatedAVLTree<Key, Value>::iterator SeparatedAVLTree<Key, Value>::end() const
+{
+    return iterator(tree_.end(), &values_);
+}
+
+template <typename Key, typename Value>
+typename SeparatedAVLTree<Key, Value>::iterator SeparatedAVLTree<Key, Value>::find(const Key& key) const
+{
+    return iterator(tree_.find(key), &values_);
+}
+
+/**
+* Throws std::out_of_range if key isn't in the tree, like AVLTree.
+*/
+template <typename Key, typename Value>
+Value& SeparatedAVLTree<Key, Value>::operator[](const Key& key)
+{
+    return values_.value(tree_[key]);
+}
+
+template <typename Key, typename Value>
+Value const & SeparatedAVLTree<Key, Value>::operator[](const Key& key) const
+{
+    return values_.value(static_cast<const HandleTree&>(tree_)[key]);
+}
+
+/**
+* The handles are only rewritten once the arena has been repacked, so if
+* that throws every key still points at its value.
+*/
+template <typename Key, typename Value>
+void SeparatedAVLTree<Key, Value>::compactValues()
+{
+    std::vector<uint32_t> order;
+    order.reserve(values_.size());
+    for (typename HandleTree::iterator it = tree_.begin(); it != tree_.end(); ++it) {
+        order.push_back(it->second);
+    }
+    values_.compact(order);
+    uint32_t slot = 0;
+    for (typename HandleTree::iterator it = tree_.begin(); it != tree_.end(); ++it) {
+        it->second = slot++;
+    }
+}
+
+template <typename Key, typename Value>
+size_t SeparatedAVLTree<Key, Value>::freeValueSlots() const
+{
+    return values_.slots() - values_.size();
+}
+
+/**
+* The arena plus an estimate for the tree nodes.
+*/
+template <typename Key, typename Value>
+size_t SeparatedAVLTree<Key, Value>::memoryUsage() const
+{
+    return sizeof(*this) + values_.memoryUsage() - sizeof(values_) + values_.size() * sizeof(AVLNode<Key, uint32_t>);
+}
+
+/*
+-----------------------------------------------
+End implementations for the SeparatedAVLTree class.
+-----------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,66 @@
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#ifndef SNAPSHOT_SERIALIZER_H
+#define SNAPSHOT_SERIALIZER_H
+
+// Key and value serializers shared by the binary tree formats
+// (avl_snapshot.h and bst_export.h).
+
+/**
+* Serializer used by saveSnapshot/loadSnapshot (and binary exportTree)
+* for keys and values.
+* The default copies the raw bytes, so it only accepts trivially copyable
+* types. Other types need a specialization (see std::string below) or a
+* custom serializer passed as a template argument.
+*/
+template <typename T>
+struct SnapshotSerializer
+{
+    static void write(std::string& out, const T& item)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+            "SnapshotSerializer<T> must be specialized for types that are not trivially copyable");
+        out.append(reinterpret_cast<const char*>(&item), sizeof(T));
+    }
+
+    static T read(const char*& in, const char* end)
+    {
+        if (static_cast<size_t>(end - in) < sizeof(T)) {
+            throw std::runtime_error("Snapshot is truncated");
+        }
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type raw;
+        memcpy(&raw, in, sizeof(T));
+        in += sizeof(T);
+        return *reinterpret_cast<T*>(&raw);
+    }
+};
+
+/**
+* Strings are stored as a uint64 length followed by the characters.
+*/
+template <>
+struct SnapshotSerializer<std::string>
+{
+    static void write(std::string& out, const std::string& item)
+    {
+        SnapshotSerializer<uint64_t>::write(out, item.size());
+        out.append(item);
+    }
+
+    static std::string read(const char*& in, const char* end)
+    {
+        uint64_t length = SnapshotSerializer<uint64_t>::read(in, end);
+        if (static_cast<uint64_t>(end - in) < length) {
+            throw std::runtime_error("Snapshot is truncated");
+        }
+        std::string item(in, length);
+        in += length;
+        return item;
+    }
+};
+
+#endif
@@ -0,0 +1,557 @@
+#ifndef STACK_AVL_H
+#define STACK_AVL_H
+
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+
+/**
+* A node for the parent-pointer-free AVL tree. It has no parent_ and no
+* vtable, so it is 16 bytes smaller than an AVLNode with the same item.
+*/
+template <typename Key, typename Value>
+struct StackAVLNode
+{
+    StackAVLNode(const Key& key, const Value& value);
+
+    std::pair<const Key, Value> item_;
+    StackAVLNode<Key, Value>* left_;
+    StackAVLNode<Key, Value>* right_;
+    int8_t balance_;
+};
+
+template <typename Key, typename Value>
+StackAVLNode<Key, Value>::StackAVLNode(const Key& key, const Value& value) :
+    item_(key, value),
+    left_(NULL),
+    right_(NULL),
+    balance_(0)
+{
+
+}
+
+/**
+* An AVL tree whose nodes don't store a parent pointer. Insert and remove
+* remember the path they took on an explicit stack and rebalance by walking
+* back up it, and iterators carry a fixed-size stack of the ancestors they
+* still have to visit.
+*
+* An AVL tree of height h has at least fib(h + 2) - 1 nodes. A node is at
+* least 24 bytes, so a tree of height MAX_HEIGHT needs over 2^49 bytes of
+* nodes: more than a 48-bit address space holds, but not more than a
+* 57-bit one (5-level paging), where a tree could in principle get taller.
+* Rather than rely on that, insert throws std::length_error once the path
+* down would put a node below MAX_HEIGHT levels, so the fixed-size stacks
+* here and in the iterator can never overflow. Remove only walks paths
+* insert already built.
+*/
+template <typename Key, typename Value>
+class StackAVLTree
+{
+public:
+    typedef StackAVLNode<Key, Value> NodeType;
+    static const int MAX_HEIGHT = 64;
+
+    StackAVLTree();
+    ~StackAVLTree();
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool isBalanced() const;
+    bool empty() const;
+
+    /**
+    * An in-order iterator. Instead of following parent pointers, it keeps
+    * the ancestors that come after the current node on a small stack, with
+    * the current node on top.
+    */
+    class iterator
+    {
+    public:
+        iterator();
+
+        std::pair<const Key, Value>& operator*() const;
+        std::pair<const Key, Value>* operator->() const;
+
+        bool operator==(const iterator& rhs) const;
+        bool operator!=(const iterator& rhs) const;
+
+        iterator& operator++();
+
+    protected:
+        friend class StackAVLTree<Key, Value>;
+        void pushLeftSpine(NodeType* node);
+        NodeType* current() const;
+
+        NodeType* stack_[MAX_HEIGHT];
+        int depth_;
+    };
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+private:
+    // Not copyable: the tree owns its nodes through root_
+    StackAVLTree(const StackAVLTree& other);
+    StackAVLTree& operator=(const StackAVLTree& other);
+
+protected:
+    NodeType* internalFind(const Key& key) const;
+    void clearHelper(NodeType* node);
+    int checkHeight(NodeType* node) const;
+    void setChild(NodeType** path, int8_t* dirs, int index, NodeType* child);
+
+    static NodeType* rotateLeft(NodeType* node);
+    static NodeType* rotateRight(NodeType* node);
+    static NodeType* rebalance(NodeType* node, int balance, bool& shrank);
+
+protected:
+    NodeType* root_;
+};
+
+template <typename Key, typename Value>
+const int StackAVLTree<Key, Value>::MAX_HEIGHT;
+
+/*
+----------------------------------------------------------
+Begin implementations for the StackAVLTree::iterator class.
+----------------------------------------------------------
+*/
+
+template <typename Key, typename Value>
+StackAVLTree<Key, Value>::iterator::iterator() :
+    depth_(0)
+{
+
+}
+
+template <typename Key, typename Value>
+typename StackAVLTree<Key, Value>::NodeType*
+StackAVLTree<Key, Value>::iterator::current() const
+{
+    return depth_ == 0 ? NULL : stack_[depth_ - 1];
+}
+
+// Pushes node and its chain of left children, leaving the smallest on top
+template <typename Key, typename Value>
+void StackAVLTree<Key, Value>::iterator::pushLeftSpine(NodeType* node)
+{
+    while (node != NULL) {
+        stack_[depth_++] = node;
+        node = node->left_;
+    }
+}
+
+template <typename Key, typename Value>
+std::pair<const Key, Value>&
+StackAVLTree<Key, Value>::iterator::operator*() const
+{
+    return current()->item_;
+}
+
+template <typename Key, typename Value>
+std::pair<const Key, Value>*
+StackAVLTree<Key, Value>::iterator::operator->() const
+{
+    return &(current()->item_);
+}
+
+template <typename Key, typename Value>
+bool StackAVLTree<Key, Value>::iterator::operator==(const iterator& rhs) const
+{
+    return current() == rhs.current();
+}
+
+template <typename Key, typename Value>
+bool StackAVLTree<Key, Value>::iterator::operator!=(const iterator& rhs) const
+{
+    return current() != rhs.current();
+}
+
+/**
+* Advances in order: pop the current node, then if it has a right subtree,
+* descend to that subtree's smallest node. Otherwise the next node is the
+* ancestor already waiting on the stack.
+*/
+template <typename Key, typename Value>
+typename StackAVLTree<Key, Value>::iterator&
+StackAVLTree<Key, Value>::iterator::operator++()
+{
+    if (depth_ == 0) {
+        return *this;
+    }
+    NodeType* node = stack_[--depth_];
+    pushLeftSpine(node->right_);
+    return *this;
+}
+
+/*
+--------------------------------------------------------
+End implementations for the StackAVLTree::iterator class.
+--------------------------------------------------------
+*/
+
+template <typename Key, typename Value>
+StackAVLTree<Key, Value>::StackAVLTree() :
+    root_(NULL)
+{
+
+}
+
+template <typename Key, typename Value>
+StackAVLTree<Key, Value>::~StackAVLTree()
+{
+    clear();
+}
+
+template <typename Key, typename Value>
+bool StackAVLTree<Key, Value>::empty() const
+{
+    return root_ == NULL;
+}
+
+template <typename Key, typename Value>
+void StackAVLTree<Key, Value>::clear()
+{
+    clearHelper(root_);
+    root_ = NULL;
+}
+
+// Helper function to recursively delete nodes (recursion depth is the tree height)
+template <typename Key, typename Value>
+void StackAVLTree<Key, Value>::clearHelper(NodeType* node)
+{
+    if (node == NULL) {
+        return;
+    }
+    clearHelper(node->left_);
+    clearHelper(node->right_);
+    delete node;
+}
+
+template <typename Key, typename Value>
+typename StackAVLTree<Key, Value>::iterator
+StackAVLTree<Key, Value>::begin() const
+{
+    iterator it;
+    it.pushLeftSpine(root_);
+    return it;
+}
+
+template <typename Key, typename Value>
+typename StackAVLTree<Key, Value>::iterator
+StackAVLTree<Key, Value>::end() const
+{
+    return iterator();
+}
+
+/**
+* Returns an iterator to the key, or end() if it isn't in the tree. The
+* ancestors we turned left at are the ones still to be visited, so they
+* are exactly what goes on the iterator's stack.
+*/
+template <typename Key, typename Value>
+typename StackAVLTree<Key, Value>::iterator
+StackAVLTree<Key, Value>::find(const Key& key) const
+{
+    iterator it;
+    NodeType* curr = root_;
+    while (curr != NULL) {
+        if (key == curr->item_.first) {
+            it.stack_[it.depth_++] = curr;
+            return it;
+        }
+        if (key < curr->item_.first) {
+            it.stack_[it.depth_++] = curr;
+            curr = curr->left_;
+        }
+        else {
+            curr = curr->right_;
+        }
+    }
+    return end();
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template <typename Key, typename Value>
+Value& StackAVLTree<Key, Value>::operator[](const Key& key)
+{
+    NodeType* curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->item_.second;
+}
+template <typename Key, typename Value>
+Value const & StackAVLTree<Key, Value>::operator[](const Key& key) const
+{
+    NodeType* curr = internalFind(key);
+    if(curr == NULL) throw std::out_of_range("Invalid key");
+    return curr->item_.second;
+}
+
+template <typename Key, typename Value>
+typename StackAVLTree<Key, Value>::NodeType*
+StackAVLTree<Key, Value>::internalFind(const Key& key) const
+{
+    NodeType* curr = root_;
+    while (curr != NULL && !(key == curr->item_.first)) {
+        curr = (key < curr->item_.first) ? curr->left_ : curr->right_;
+    }
+    return curr;
+}
+
+/**
+* Inserts a key/value pair, overwriting the value if the key already exists.
+* path[i] is the i-th node on the way down and dirs[i] is the side we took
+* from it (-1 left, 1 right).
+*/
+template <typename Key, typename Value>
+void StackAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    NodeType* path[MAX_HEIGHT];
+    int8_t dirs[MAX_HEIGHT];
+    int depth = 0;
+
+    NodeType* curr = root_;
+    while (curr != NULL) {
+        if (keyValuePair.first == curr->item_.first) {
+            curr->item_.second = keyValuePair.second;
+            return;
+        }
+        if (depth == MAX_HEIGHT - 1) {
+            throw std::length_error("StackAVLTree is too tall");
+        }
+        path[depth] = curr;
+        dirs[depth] = (keyValuePair.first < curr->item_.first) ? -1 : 1;
+        curr = (dirs[depth] < 0) ? curr->left_ : curr->right_;
+        ++depth;
+    }
+
+    NodeType* newNode = new NodeType(keyValuePair.first, keyValuePair.second);
+    setChild(path, dirs, depth, newNode);
+
+    // walk back up until the subtree height stops changing
+    for (int i = depth - 1; i >= 0; --i) {
+        NodeType* node = path[i];
+        int balance = node->balance_ + dirs[i];
+        if (balance == 0) {
+            node->balance_ = 0;
+            return;
+        }
+        if (balance == 1 || balance == -1) {
+            node->balance_ = static_cast<int8_t>(balance);
+            continue;
+        }
+        bool shrank;
+        setChild(path, dirs, i, rebalance(node, balance, shrank));
+        return;
+    }
+}
+
+/**
+* Removes the key if it exists. A node with two children is replaced by its
+* predecessor, which takes its place on the path as well as in the tree.
+*/
+template <typename Key, typename Value>
+void StackAVLTree<Key, Value>::remove(const Key& key)
+{
+    NodeType* path[MAX_HEIGHT];
+    int8_t dirs[MAX_HEIGHT];
+    int depth = 0;
+
+    NodeType* toDelete = root_;
+    while (toDelete != NULL && !(key == toDelete->item_.first)) {
+        path[depth] = toDelete;
+        dirs[depth] = (key < toDelete->item_.first) ? -1 : 1;
+        toDelete = (dirs[depth] < 0) ? toDelete->left_ : toDelete->right_;
+        ++depth;
+    }
+    if (toDelete == NULL) {
+        return;
+    }
+
+    if (toDelete->left_ != NULL && toDelete->right_ != NULL) {
+        int deleteIndex = depth;
+        path[depth] = toDelete;
+        dirs[depth] = -1;
+        ++depth;
+
+        NodeType* pred = toDelete->left_;
+        while (pred->right_ != NULL) {
+            path[depth] = pred;
+            dirs[depth] = 1;
+            ++depth;
+            pred = pred->right_;
+        }
+
+        // unhook pred, then move it into toDelete's spot
+        setChild(path, dirs, depth, pred->left_);
+        pred->left_ = toDelete->left_;
+        pred->right_ = toDelete->right_;
+        pred->balance_ = toDelete->balance_;
+        setChild(path, dirs, deleteIndex, pred);
+        path[deleteIndex] = pred;
+    }
+    else {
+        NodeType* child = (toDelete->left_ != NULL) ? toDelete->left_ : toDelete->right_;
+        setChild(path, dirs, depth, child);
+    }
+    delete toDelete;
+
+    // the side we came from got shorter; walk up until the height holds
+    for (int i = depth - 1; i >= 0; --i) {
+        NodeType* node = path[i];
+        int balance = node->balance_ - dirs[i];
+        if (balance == 1 || balance == -1) {
+            node->balance_ = static_cast<int8_t>(balance);
+            return;
+        }
+        if (balance == 0) {
+            node->balance_ = 0;
+            continue;
+        }
+        bool shrank;
+        setChild(path, dirs, i, rebalance(node, balance, shrank));
+        if (!shrank) {
+            return;
+        }
+    }
+}
+
+// Links child where path[index] used to hang: under path[index - 1], or as the root
+template <typename Key, typename Value>
+void StackAVLTree<Key, Value>::setChild(NodeType** path, int8_t* dirs, int index, NodeType* child)
+{
+    if (index == 0) {
+        root_ = child;
+    }
+    else if (dirs[index - 1] < 0) {
+        path[index - 1]->left_ = child;
+    }
+    else {
+        path[index - 1]->right_ = child;
+    }
+}
+
+/**
+ * Return true iff the tree is balanced.
+ */
+template <typename Key, typename Value>
+bool StackAVLTree<Key, Value>::isBalanced() const
+{
+    return checkHeight(root_) != -1;
+}
+
+// Returns the height of the subtree, or -1 if any node in it is unbalanced
+template <typename Key, typename Value>
+int StackAVLTree<Key, Value>::checkHeight(NodeType* node) const
+{
+    if (node == NULL) {
+        return 0;
+    }
+    int leftH = checkHeight(node->left_);
+    int rightH = checkHeight(node->right_);
+    if (leftH == -1 || rightH == -1 || abs(leftH - rightH) > 1) {
+        return -1;
+    }
+    return 1 + std::max(leftH, rightH);
+}
+
+// rotate left and return the new subtree root; the caller relinks it
+template <typename Key, typename Value>
+typename StackAVLTree<Key, Value>::NodeType*
+StackAVLTree<Key, Value>::rotateLeft(NodeType* node)
+{
+    NodeType* rightKid = node->right_;
+    node->right_ = rightKid->left_;
+    rightKid->left_ = node;
+    return rightKid;
+}
+
+// rotate right and return the new subtree root; the caller relinks it
+template <typename Key, typename Value>
+typename StackAVLTree<Key, Value>::NodeType*
+StackAVLTree<Key, Value>::rotateRight(NodeType* node)
+{
+    NodeType* leftKid = node->left_;
+    node->left_ = leftKid->right_;
+    leftKid->right_ = node;
+    return leftKid;
+}
+
+/**
+* Restores the AVL property at a node whose balance has reached +/-2.
+* Returns the new subtree root, and sets shrank if the subtree got shorter.
+*/
+template <typename Key, typename Value>
+typename StackAVLTree<Key, Value>::NodeType*
+StackAVLTree<Key, Value>::rebalance(NodeType* node, int balance, bool& shrank)
+{
+    if (balance < 0) {
+        NodeType* child = node->left_;
+        if (child->balance_ <= 0) {
+            // left left case
+            rotateRight(node);
+            if (child->balance_ == 0) {
+                // only happens on removal
+                node->balance_ = -1;
+                child->balance_ = 1;
+                shrank = false;
+            }
+            else {
+                node->balance_ = 0;
+                child->balance_ = 0;
+                shrank = true;
+            }
+            return child;
+        }
+        // left right case
+        NodeType* grandchild = child->right_;
+        node->left_ = rotateLeft(child);
+        rotateRight(node);
+        node->balance_ = (grandchild->balance_ == -1) ? 1 : 0;
+        child->balance_ = (grandchild->balance_ == 1) ? -1 : 0;
+        grandchild->balance_ = 0;
+        shrank = true;
+        return grandchild;
+    }
+
+    NodeType* child = node->right_;
+    if (child->balance_ >= 0) {
+        // right right case
+        rotateLeft(node);
+        if (child->balance_ == 0) {
+            // only happens on removal
+            node->balance_ = 1;
+            child->balance_ = -1;
+            shrank = false;
+        }
+        else {
+            node->balance_ = 0;
+            child->balance_ = 0;
+            shrank = true;
+        }
+        return child;
+    }
+    // right left case
+    NodeType* grandchild = child->left_;
+    node->right_ = rotateRight(child);
+    rotateLeft(node);
+    node->balance_ = (grandchild->balance_ == 1) ? -1 : 0;
+    child->balance_ = (grandchild->balance_ == -1) ? 1 : 0;
+    grandchild->balance_ = 0;
+    shrank = true;
+    return grandchild;
+}
+
+#endif
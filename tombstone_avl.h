@@ -0,0 +1,611 @@
+#ifndef TOMBSTONE_AVL_H
+#define TOMBSTONE_AVL_H
+
+#include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "avlbst.h"
+
+// default share of dead nodes that triggers a full compaction on remove
+#define TOMBSTONE_AVL_COMPACT_RATIO 0.5
+
+/**
+* An AVLNode that can be marked dead instead of being unlinked.
+*/
+template <typename Key, typename Value>
+class TombstoneAVLNode : public AVLNode<Key, Value>
+{
+public:
+    TombstoneAVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
+
+    bool isDead() const;
+    void setDead(bool dead);
+
+    virtual TombstoneAVLNode<Key, Value>* clone(Node<Key, Value>* parent) const override;
+
+protected:
+    bool dead_;
+};
+
+/*
+  -------------------------------------------------
+  Begin implementations for the TombstoneAVLNode class.
+  -------------------------------------------------
+*/
+
+template<class Key, class Value>
+TombstoneAVLNode<Key, Value>::TombstoneAVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent) :
+    AVLNode<Key, Value>(key, value, parent), dead_(false)
+{
+
+}
+
+template<class Key, class Value>
+bool TombstoneAVLNode<Key, Value>::isDead() const
+{
+    return dead_;
+}
+
+template<class Key, class Value>
+void TombstoneAVLNode<Key, Value>::setDead(bool dead)
+{
+    dead_ = dead;
+}
+
+/**
+* Copies the item, balance, leaf depths and the dead mark into a new childless node.
+*/
+template<class Key, class Value>
+TombstoneAVLNode<Key, Value>* TombstoneAVLNode<Key, Value>::clone(Node<Key, Value>* parent) const
+{
+    TombstoneAVLNode<Key, Value>* copy = new TombstoneAVLNode<Key, Value>(this->item_.first, this->item_.second, static_cast<AVLNode<Key, Value>*>(parent));
+    copy->setBalance(this->getBalance());
+    copy->setLeafDepths(this->getMinLeafDepth(), this->getMaxLeafDepth());
+    copy->dead_ = dead_;
+    return copy;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the TombstoneAVLNode class.
+  -----------------------------------------------
+*/
+
+/**
+* An AVL tree with lazy deletion. remove only finds the node and marks it
+* dead: no nodeSwap, no rebalancing, no free. find, operator[], findBatch
+* and iteration skip dead nodes, and inserting a dead key revives its node.
+*
+* Dead nodes are cleared out in bulk. Once they make up more than the
+* compaction ratio of the tree, remove calls compact(), which drops them
+* all and rebuilds a perfectly balanced tree from the survivors in O(n).
+* A ratio of 0 turns that off; compactStep() then clears them
+* incrementally, visiting at most a given number of nodes per call, for
+* callers that can't afford a full rebuild.
+*
+* Dead nodes keep their place in the tree's shape, so print(), exportTree()
+* and the parallel traversals still reach them; snapshots and copies keep
+* them marked dead.
+*/
+template <class Key, class Value>
+class TombstoneAVLTree : public AVLTree<Key, Value>
+{
+public:
+    TombstoneAVLTree(double compactRatio = TOMBSTONE_AVL_COMPACT_RATIO);
+    TombstoneAVLTree(const TombstoneAVLTree<Key, Value>& other);
+    TombstoneAVLTree<Key, Value>& operator=(const TombstoneAVLTree<Key, Value>& other);
+    TombstoneAVLTree(TombstoneAVLTree<Key, Value>&& other) noexcept;
+    TombstoneAVLTree<Key, Value>& operator=(TombstoneAVLTree<Key, Value>&& other) noexcept;
+    void swap(TombstoneAVLTree<Key, Value>& other) noexcept;
+
+    virtual void insert(const std::pair<const Key, Value>& new_item);
+    virtual void remove(const Key& key);
+
+    /**
+    * An iterator that steps over dead nodes.
+    */
+    class iterator : public AVLTree<Key, Value>::iterator
+    {
+    public:
+        iterator();
+        iterator(const typename AVLTree<Key, Value>::iterator& it);
+
+        iterator& operator++();
+
+    protected:
+        void skipDead();
+    };
+
+    typedef typename AVLTree<Key, Value>::node_type node_type;
+    typedef typename AVLTree<Key, Value>::insert_return_type insert_return_type;
+    insert_return_type insert(node_type&& handle);
+
+    iterator begin() const;
+    iterator end() const;
+    iterator find(const Key& key) const;
+    void findBatch(const std::vector<Key>& keys, std::vector<typename AVLTree<Key, Value>::iterator>& out) const;
+
+    // Live entries and tombstones currently in the tree
+    size_t size() const;
+    size_t deadCount() const;
+
+    // Share of dead nodes (0 to 1) past which remove compacts; 0 never does
+    double compactRatio() const;
+    void setCompactRatio(double ratio);
+
+    // Drops every dead node and rebuilds the tree perfectly balanced, O(n)
+    void compact();
+    // Unlinks dead nodes while visiting at most maxNodes nodes in key order,
+    // picking up where the last call stopped. Returns true once none are left.
+    bool compactStep(size_t maxNodes);
+
+protected:
+    virtual TombstoneAVLNode<Key, Value>* createNode(const Key& key, const Value& value, Node<Key, Value>* parent) const override;
+    virtual Node<Key, Value>* internalFind(const Key& key) const override;
+    virtual void linkNode(Node<Key, Value>* node, Node<Key, Value>* parent) override;
+    virtual Node<Key, Value>* unlinkNode(Node<Key, Value>* node) override;
+    virtual bool canLink(const Node<Key, Value>* node) const override;
+    virtual void rootReplaced() override;
+    // Snapshots keep the dead mark in flag bit 0
+    virtual uint8_t snapshotFlags(const AVLNode<Key, Value>* node) const override;
+    virtual void restoreSnapshotFlags(AVLNode<Key, Value>* node, uint8_t flags) override;
+
+    static bool isDead(const Node<Key, Value>* node);
+    static Node<Key, Value>* successor(Node<Key, Value>* node);
+    static TombstoneAVLNode<Key, Value>* buildBalanced(std::vector<TombstoneAVLNode<Key, Value>*>& nodes, size_t lo, size_t hi, TombstoneAVLNode<Key, Value>* parent, int& height);
+
+    size_t nodes_;                  // linked nodes, dead or alive
+    size_t dead_;
+    double compactRatio_;
+    Node<Key, Value>* cursor_;      // where the next compactStep starts, NULL for the smallest
+};
+
+/*
+---------------------------------------------------------
+Begin implementations for the TombstoneAVLTree::iterator class.
+---------------------------------------------------------
+*/
+
+template<class Key, class Value>
+TombstoneAVLTree<Key, Value>::iterator::iterator()
+{
+
+}
+
+/**
+* Starts at it, or at the first live node after it.
+*/
+template<class Key, class Value>
+TombstoneAVLTree<Key, Value>::iterator::iterator(const typename AVLTree<Key, Value>::iterator& it) :
+    AVLTree<Key, Value>::iterator(it)
+{
+    skipDead();
+}
+
+template<class Key, class Value>
+typename TombstoneAVLTree<Key, Value>::iterator&
+TombstoneAVLTree<Key, Value>::iterator::operator++()
+{
+    AVLTree<Key, Value>::iterator::operator++();
+    skipDead();
+    return *this;
+}
+
+template<class Key, class Value>
+void TombstoneAVLTree<Key, Value>::iterator::skipDead()
+{
+    while (this->current_ != NULL && TombstoneAVLTree<Key, Value>::isDead(this->current_)) {
+        AVLTree<Key, Value>::iterator::operator++();
+    }
+}
+
+/*
+-------------------------------------------------------
+End implementations for the TombstoneAVLTree::iterator class.
+-------------------------------------------------------
+*/
+
+/*
+------------------------------------------------
+Begin implementations for the TombstoneAVLTree class.
+------------------------------------------------
+*/
+
+template<class Key, class Value>
+TombstoneAVLTree<Key, Value>::TombstoneAVLTree(double compactRatio) :
+    nodes_(0),
+    dead_(0),
+    compactRatio_(compactRatio),
+    cursor_(NULL)
+{
+
+}
+
+/**
+* Copies the tree as is, tombstones included. The compactStep cursor
+* points into other's nodes, so the copy starts a fresh pass.
+*/
+template<class Key, class Value>
+TombstoneAVLTree<Key, Value>::TombstoneAVLTree(const TombstoneAVLTree<Key, Value>& other) :
+    AVLTree<Key, Value>(other),
+    nodes_(other.nodes_),
+    dead_(other.dead_),
+    compactRatio_(other.compactRatio_),
+    cursor_(NULL)
+{
+
+}
+
+template<class Key, class Value>
+TombstoneAVLTree<Key, Value>& TombstoneAVLTree<Key, Value>::operator=(const TombstoneAVLTree<Key, Value>& other)
+{
+    if (this != &other) {
+        // rootReplaced recounts the copy and resets the cursor
+        AVLTree<Key, Value>::operator=(other);
+        compactRatio_ = other.compactRatio_;
+    }
+    return *this;
+}
+
+template<class Key, class Value>
+TombstoneAVLTree<Key, Value>::TombstoneAVLTree(TombstoneAVLTree<Key, Value>&& other) noexcept :
+    AVLTree<Key, Value>(std::move(other)),
+    nodes_(other.nodes_),
+    dead_(other.dead_),
+    compactRatio_(other.compactRatio_),
+    cursor_(other.cursor_)
+{
+    other.nodes_ = 0;
+    other.dead_ = 0;
+    other.cursor_ = NULL;
+}
+
+template<class Key, class Value>
+TombstoneAVLTree<Key, Value>& TombstoneAVLTree<Key, Value>::operator=(TombstoneAVLTree<Key, Value>&& other) noexcept
+{
+    if (this != &other) {
+        AVLTree<Key, Value>::operator=(std::move(other));
+        nodes_ = other.nodes_;
+        dead_ = other.dead_;
+        compactRatio_ = other.compactRatio_;
+        cursor_ = other.cursor_;
+        other.nodes_ = 0;
+        other.dead_ = 0;
+        other.cursor_ = NULL;
+    }
+    return *this;
+}
+
+/**
+* Swaps contents and counts; each tree keeps its own compaction ratio.
+*/
+template<class Key, class Value>
+void TombstoneAVLTree<Key, Value>::swap(TombstoneAVLTree<Key, Value>& other) noexcept
+{
+    AVLTree<Key, Value>::swap(other);
+    std::swap(nodes_, other.nodes_);
+    std::swap(dead_, other.dead_);
+    std::swap(cursor_, other.cursor_);
+}
+
+// Non-member swap, so the counts travel with the nodes
+template<class Key, class Value>
+void swap(TombstoneAVLTree<Key, Value>& a, TombstoneAVLTree<Key, Value>& b) noexcept
+{
+    a.swap(b);
+}
+
+/**
+* Inserts or overwrites like AVLTree. A dead key gets its node back with
+* the new value, without touching the shape of the tree.
+*/
+template<class Key, class Value>
+void TombstoneAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& new_item)
+{
+    BST_METRIC_OP(this, METRIC_INSERT);
+    Node<Key, Value>* existing = NULL;
+    Node<Key, Value>* parent = this->findLinkParent(new_item.first, existing);
+    if (existing != NULL) {
+        existing->setValue(new_item.second);
+        TombstoneAVLNode<Key, Value>* node = static_cast<TombstoneAVLNode<Key, Value>*>(existing);
+        if (node->isDead()) {
+            node->setDead(false);
+            --dead_;
+        }
+        return;
+    }
+    BST_METRIC_ADD(this, METRIC_ALLOCATIONS, 1);
+    linkNode(createNode(new_item.first, new_item.second, NULL), parent);
+}
+
+/**
+* Marks key's node dead, compacting if that takes the dead share past the ratio.
+*/
+template<class Key, class Value>
+void TombstoneAVLTree<Key, Value>::remove(const Key& key)
+{
+    BST_METRIC_OP(this, METRIC_REMOVE);
+    Node<Key, Value>* node = internalFind(key);
+    if (node == NULL) {
+        return;
+    }
+    static_cast<TombstoneAVLNode<Key, Value>*>(node)->setDead(true);
+    ++dead_;
+    if (compactRatio_ > 0 && dead_ > compactRatio_ * nodes_) {
+        compact();
+    }
+}
+
+/**
+* A dead node holding the same key doesn't count as a clash: it is
+* unlinked and freed first.
+*/
+template<class Key, class Value>
+typename TombstoneAVLTree<Key, Value>::insert_return_type TombstoneAVLTree<Key, Value>::insert(node_type&& handle)
+{
+    if (!handle.empty()) {
+        Node<Key, Value>* node = this->internalFindHelper(this->root_, handle.key());
+        if (node != NULL && isDead(node)) {
+            delete unlinkNode(node);
+            BST_METRIC_ADD(this, METRIC_FREES, 1);
+        }
+    }
+    return AVLTree<Key, Value>::insert(std::move(handle));
+}
+
+template<class Key, class Value>
+typename TombstoneAVLTree<Key, Value>::iterator TombstoneAVLTree<Key, Value>::begin() const
+{
+    return iterator(AVLTree<Key, Value>::begin());
+}
+
+template<class Key, class Value>
+typename TombstoneAVLTree<Key, Value>::iterator TombstoneAVLTree<Key, Value>::end() const
+{
+    return iterator(AVLTree<Key, Value>::end());
+}
+
+template<class Key, class Value>
+typename TombstoneAVLTree<Key, Value>::iterator TombstoneAVLTree<Key, Value>::find(const Key& key) const
+{
+    return iterator(AVLTree<Key, Value>::find(key));
+}
+
+template<class Key, class Value>
+void TombstoneAVLTree<Key, Value>::findBatch(const std::vector<Key>& keys, std::vector<typename AVLTree<Key, Value>::iterator>& out) const
+{
+    AVLTree<Key, Value>::findBatch(keys, out);
+    for (size_t i = 0; i < out.size(); ++i) {
+        if (iterator(out[i]) != out[i]) {
+            out[i] = AVLTree<Key, Value>::end();
+        }
+    }
+}
+
+template<class Key, class Value>
+size_t TombstoneAVLTree<Key, Value>::size() const
+{
+    return nodes_ - dead_;
+}
+
+template<class Key, class Value>
+size_t TombstoneAVLTree<Key, Value>::deadCount() const
+{
+    return dead_;
+}
+
+template<class Key, class Value>
+double TombstoneAVLTree<Key, Value>::compactRatio() const
+{
+    return compactRatio_;
+}
+
+template<class Key, class Value>
+void TombstoneAVLTree<Key, Value>::setCompactRatio(double ratio)
+{
+    compactRatio_ = ratio;
+}
+
+/**
+* Frees every dead node and relinks the live ones, in key order, into a
+* perfectly balanced tree. No node is allocated or copied.
+*/
+template<class Key, class Value>
+void TombstoneAVLTree<Key, Value>::compact()
+{
+    cursor_ = NULL;
+    if (dead_ == 0) {
+        return;
+    }
+    // the walk climbs through parents, so nothing is freed until it's done
+    std::vector<TombstoneAVLNode<Key, Value>*> live;
+    live.reserve(nodes_);
+    for (Node<Key, Value>* node = this->getSmallestNode(); node != NULL; node = successor(node)) {
+        live.push_back(static_cast<TombstoneAVLNode<Key, Value>*>(node));
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < live.size(); ++i) {
+        if (live[i]->isDead()) {
+            delete live[i];
+        }
+        else {
+            live[kept++] = live[i];
+        }
+    }
+    live.resize(kept);
+    BST_METRIC_ADD(this, METRIC_FREES, dead_);
+    int height;
+    this->root_ = buildBalanced(live, 0, live.size(), NULL, height);
+    nodes_ = live.size();
+    dead_ = 0;
+}
+
+/**
+* Walks on from the cursor, unlinking each dead node it passes. Wraps
+* around to the smallest key once it falls off the end, so repeated calls
+* keep sweeping until no tombstones are left.
+*/
+template<class Key, class Value>
+bool TombstoneAVLTree<Key, Value>::compactStep(size_t maxNodes)
+{
+    for (size_t visited = 0; visited < maxNodes && dead_ != 0; ++visited) {
+        if (cursor_ == NULL) {
+            cursor_ = this->getSmallestNode();
+        }
+        Node<Key, Value>* node = cursor_;
+        if (isDead(node)) {
+            // unlinkNode moves the cursor past it
+            delete unlinkNode(node);
+            BST_METRIC_ADD(this, METRIC_FREES, 1);
+        }
+        else {
+            cursor_ = successor(node);
+        }
+    }
+    return dead_ == 0;
+}
+
+template<class Key, class Value>
+bool TombstoneAVLTree<Key, Value>::canLink(const Node<Key, Value>* node) const
+{
+    return dynamic_cast<const TombstoneAVLNode<Key, Value>*>(node) != NULL;
+}
+
+template<class Key, class Value>
+void TombstoneAVLTree<Key, Value>::linkNode(Node<Key, Value>* node, Node<Key, Value>* parent)
+{
+    if (canLink(node)) {
+        static_cast<TombstoneAVLNode<Key, Value>*>(node)->setDead(false);
+    }
+    AVLTree<Key, Value>::linkNode(node, parent);
+    ++nodes_;
+}
+
+/*
+ * Dead nodes are invisible to find, operator[], remove and extract.
+ */
+template<class Key, class Value>
+Node<Key, Value>* TombstoneAVLTree<Key, Value>::internalFind(const Key& key) const
+{
+    Node<Key, Value>* node = this->internalFindHelper(this->root_, key);
+    return (node == NULL || isDead(node)) ? NULL : node;
+}
+
+/*
+ * Keeps the counts and the compactStep cursor right for every node that
+ * leaves the tree, whether by compactStep or by extract.
+ */
+template<class Key, class Value>
+Node<Key, Value>* TombstoneAVLTree<Key, Value>::unlinkNode(Node<Key, Value>* node)
+{
+    if (node == cursor_) {
+        // nodes keep their keys through the unlink, so this stays valid
+        cursor_ = successor(node);
+    }
+    if (isDead(node)) {
+        --dead_;
+    }
+    --nodes_;
+    return AVLTree<Key, Value>::unlinkNode(node);
+}
+
+/*
+ * Recounts nodes and tombstones after clear, copy assignment,
+ * parallelClone or loadSnapshot replaced the whole tree, O(n).
+ */
+template<class Key, class Value>
+void TombstoneAVLTree<Key, Value>::rootReplaced()
+{
+    nodes_ = 0;
+    dead_ = 0;
+    cursor_ = NULL;
+    for (Node<Key, Value>* node = this->getSmallestNode(); node != NULL; node = successor(node)) {
+        ++nodes_;
+        if (isDead(node)) {
+            ++dead_;
+        }
+    }
+}
+
+template<class Key, class Value>
+TombstoneAVLNode<Key, Value>* TombstoneAVLTree<Key, Value>::createNode(const Key& key, const Value& value, Node<Key, Value>* parent) const
+{
+    return new TombstoneAVLNode<Key, Value>(key, value, static_cast<AVLNode<Key, Value>*>(parent));
+}
+
+template<class Key, class Value>
+uint8_t TombstoneAVLTree<Key, Value>::snapshotFlags(const AVLNode<Key, Value>* node) const
+{
+    return isDead(node) ? 1 : 0;
+}
+
+// The counts are redone by rootReplaced once the whole tree is in
+template<class Key, class Value>
+void TombstoneAVLTree<Key, Value>::restoreSnapshotFlags(AVLNode<Key, Value>* node, uint8_t flags)
+{
+    if ((flags & ~1) != 0) {
+        throw std::runtime_error("Snapshot has node flags this tree doesn't keep");
+    }
+    static_cast<TombstoneAVLNode<Key, Value>*>(node)->setDead(flags & 1);
+}
+
+template<class Key, class Value>
+bool TombstoneAVLTree<Key, Value>::isDead(const Node<Key, Value>* node)
+{
+    return static_cast<const TombstoneAVLNode<Key, Value>*>(node)->isDead();
+}
+
+// The next node in key order, or NULL after the largest
+template<class Key, class Value>
+Node<Key, Value>* TombstoneAVLTree<Key, Value>::successor(Node<Key, Value>* node)
+{
+    if (node->getRight() != NULL) {
+        node = node->getRight();
+        while (node->getLeft() != NULL) {
+            node = node->getLeft();
+        }
+        return node;
+    }
+    Node<Key, Value>* parent = node->getParent();
+    while (parent != NULL && node == parent->getRight()) {
+        node = parent;
+        parent = parent->getParent();
+    }
+    return parent;
+}
+
+// Links nodes[lo, hi) into a balanced subtree under parent, middle node on
+// top, and sets each node's balance and leaf depths on the way back up.
+// Recursion depth is log n.
+template<class Key, class Value>
+TombstoneAVLNode<Key, Value>* TombstoneAVLTree<Key, Value>::buildBalanced(std::vector<TombstoneAVLNode<Key, Value>*>& nodes, size_t lo, size_t hi, TombstoneAVLNode<Key, Value>* parent, int& height)
+{
+    if (lo >= hi) {
+        height = 0;
+        return NULL;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    TombstoneAVLNode<Key, Value>* node = nodes[mid];
+    int leftHeight;
+    int rightHeight;
+    node->setParent(parent);
+    node->setLeft(buildBalanced(nodes, lo, mid, node, leftHeight));
+    node->setRight(buildBalanced(nodes, mid + 1, hi, node, rightHeight));
+    node->setBalance(static_cast<int8_t>(rightHeight - leftHeight));
+    node->updateLeafDepths();
+    height = std::max(leftHeight, rightHeight) + 1;
+    return node;
+}
+
+/*
+----------------------------------------------
+End implementations for the TombstoneAVLTree class.
+----------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bst.h"
+#include "avlbst.h"
+#include "compact_avl.h"
+#include "stack_avl.h"
+#include "buffered_avl.h"
+#include "trace_recorder.h"
+
+using namespace std;
+
+// Replays a trace written by TracingTree (trace_recorder.h) against one
+// tree engine and reports throughput and latency per operation type.
+//
+// The whole trace is decoded before the clock starts, so file I/O and
+// decoding are not measured. With --pacing original each operation waits
+// until its recorded time (divided by --speed); with --pacing full they
+// run back to back.
+//
+// An iterate record replays as a walk over the same number of items it
+// visited when it was recorded (fewer if the replayed tree is smaller).
+//
+// usage: trace-replay TRACE [--engine bst|avl|compact|stack|buffered|map]
+//                     [--keys u64|string] [--values u64|string]
+//                     [--pacing full|original] [--speed X] [--format csv|json]
+//
+// --keys and --values must name the types the trace was recorded with. The
+// trace header only stores their sizes, so a mismatch in size is rejected
+// but two types of the same size are not told apart.
+
+typedef chrono::steady_clock Clock;
+
+struct Options
+{
+    string trace;
+    string engine;
+    string keyType;
+    string valueType;
+    string pacing;
+    double speed;
+    string format;
+};
+
+// Something read from each value as iteration visits it
+uint64_t touch(uint64_t value) { return value; }
+uint64_t touch(const string& value) { return value.size(); }
+
+template<typename Tree, typename Key, typename Value>
+struct TreeAdapter
+{
+    Tree tree;
+    void insert(const Key& k, const Value& v) { tree.insert(make_pair(k, v)); }
+    bool find(const Key& k) const { return tree.find(k) != tree.end(); }
+    void remove(const Key& k) { tree.remove(k); }
+    // visits the first count items in order
+    uint64_t iterate(uint64_t count) const
+    {
+        uint64_t sum = 0;
+        for (typename Tree::iterator it = tree.begin(); count > 0 && it != tree.end(); ++it, --count) sum += touch(it->second);
+        return sum;
+    }
+};
+
+template<typename Key, typename Value>
+struct TreeAdapter<map<Key, Value>, Key, Value>
+{
+    map<Key, Value> tree;
+    void insert(const Key& k, const Value& v) { tree[k] = v; }
+    bool find(const Key& k) const { return tree.find(k) != tree.end(); }
+    void remove(const Key& k) { tree.erase(k); }
+    uint64_t iterate(uint64_t count) const
+    {
+        uint64_t sum = 0;
+        for (typename map<Key, Value>::const_iterator it = tree.begin(); count > 0 && it != tree.end(); ++it, --count) sum += touch(it->second);
+        return sum;
+    }
+};
+
+// keeps results alive so the optimizer can't drop the work
+volatile uint64_t sink;
+
+double percentile(vector<double>& samples, double p)
+{
+    if (samples.empty()) return 0;
+    size_t index = min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+    nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+// Blocks until the given offset from start, sleeping while far away and spinning at the end
+void waitUntil(Clock::time_point start, double offsetNs)
+{
+    Clock::time_point target = start + chrono::duration_cast<Clock::duration>(chrono::duration<double, nano>(offsetNs));
+    Clock::time_point now = Clock::now();
+    if (target - now > chrono::microseconds(100)) {
+        this_thread::sleep_for(target - now - chrono::microseconds(50));
+    }
+    while (Clock::now() < target) {
+    }
+}
+
+template<typename Tree, typename Key, typename Value>
+void replay(const vector<TraceRecord<Key, Value> >& records, const Options& options)
+{
+    static const char* const names[] = { "", "insert", "find", "remove", "iterate" };
+    vector<double> samples[5];
+    TreeAdapter<Tree, Key, Value>* adapter = new TreeAdapter<Tree, Key, Value>();
+    TreeAdapter<Tree, Key, Value>& a = *adapter;
+    bool paced = (options.pacing == "original");
+    uint64_t found = 0;
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < records.size(); ++i) {
+        const TraceRecord<Key, Value>& r = records[i];
+        if (paced) {
+            waitUntil(start, r.timestamp / options.speed);
+        }
+        Clock::time_point before = Clock::now();
+        switch (r.op) {
+            case TRACE_INSERT: a.insert(r.key, r.value); break;
+            case TRACE_FIND: found += a.find(r.key); break;
+            case TRACE_REMOVE: a.remove(r.key); break;
+            case TRACE_ITERATE: found += a.iterate(r.count); break;
+        }
+        samples[r.op].push_back(chrono::duration<double, nano>(Clock::now() - before).count());
+    }
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
+    sink = found;
+    delete adapter;
+
+    bool first = true;
+    for (int op = TRACE_INSERT; op <= TRACE_ITERATE + 1; ++op) {
+        // the last row is every operation together
+        vector<double> all;
+        vector<double>& s = (op <= TRACE_ITERATE) ? samples[op] : all;
+        if (op > TRACE_ITERATE) {
+            for (int o = TRACE_INSERT; o <= TRACE_ITERATE; ++o) all.insert(all.end(), samples[o].begin(), samples[o].end());
+        }
+        if (s.empty()) continue;
+        double busy = 0;
+        for (size_t i = 0; i < s.size(); ++i) busy += s[i];
+        const char* name = (op <= TRACE_ITERATE) ? names[op] : "all";
+        // ops/sec over the time spent in the operations themselves, so pacing gaps don't count
+        double opsPerSec = busy > 0 ? s.size() / (busy / 1e9) : 0;
+        double p50 = percentile(s, 0.50), p90 = percentile(s, 0.90);
+        double p99 = percentile(s, 0.99), p999 = percentile(s, 0.999);
+
+        if (options.format == "json") {
+            cout << (first ? "[\n  " : ",\n  ")
+                 << "{\"engine\":\"" << options.engine << "\",\"pacing\":\"" << options.pacing
+                 << "\",\"operation\":\"" << name << "\",\"ops\":" << s.size()
+                 << ",\"wall_seconds\":" << seconds << ",\"ops_per_sec\":" << opsPerSec
+                 << ",\"ns_p50\":" << p50 << ",\"ns_p90\":" << p90 << ",\"ns_p99\":" << p99
+                 << ",\"ns_p999\":" << p999 << "}";
+        }
+        else {
+            if (first) {
+                cout << "engine,pacing,operation,ops,wall_seconds,ops_per_sec,ns_p50,ns_p90,ns_p99,ns_p999\n";
+            }
+            cout << options.engine << "," << options.pacing << "," << name << "," << s.size() << ","
+                 << seconds << "," << opsPerSec << "," << p50 << "," << p90 << "," << p99 << "," << p999 << "\n";
+        }
+        first = false;
+    }
+    if (options.format == "json") cout << (first ? "[]\n" : "\n]\n");
+}
+
+template<typename Key, typename Value>
+int run(const Options& options)
+{
+    vector<TraceRecord<Key, Value> > records;
+    try {
+        TraceReader<Key, Value> reader(options.trace);
+        TraceRecord<Key, Value> record;
+        while (reader.next(record)) records.push_back(record);
+    }
+    catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    if (options.engine == "bst") replay<BinarySearchTree<Key, Value>, Key, Value>(records, options);
+    else if (options.engine == "avl") replay<AVLTree<Key, Value>, Key, Value>(records, options);
+    else if (options.engine == "compact") replay<CompactAVLTree<Key, Value>, Key, Value>(records, options);
+    else if (options.engine == "stack") replay<StackAVLTree<Key, Value>, Key, Value>(records, options);
+    else if (options.engine == "buffered") replay<BufferedAVLTree<Key, Value>, Key, Value>(records, options);
+    else if (options.engine == "map") replay<map<Key, Value>, Key, Value>(records, options);
+    else {
+        cerr << "unknown engine " << options.engine << endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    options.engine = "avl";
+    options.keyType = "u64";
+    options.valueType = "u64";
+    options.pacing = "full";
+    options.speed = 1.0;
+    options.format = "csv";
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0 && options.trace.empty()) {
+            options.trace = arg;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            options.trace.clear();
+            break;
+        }
+        string value = argv[++i];
+        if (arg == "--engine") options.engine = value;
+        else if (arg == "--keys") options.keyType = value;
+        else if (arg == "--values") options.valueType = value;
+        else if (arg == "--pacing") options.pacing = value;
+        else if (arg == "--speed") options.speed = atof(value.c_str());
+        else if (arg == "--format") options.format = value;
+        else {
+            cerr << "unknown option " << arg << endl;
+            return 1;
+        }
+    }
+    if (options.trace.empty() || options.speed <= 0) {
+        cerr << "usage: " << argv[0] << " TRACE [--engine bst|avl|compact|stack|buffered|map] [--keys u64|string] "
+             << "[--values u64|string] [--pacing full|original] [--speed X] [--format csv|json]" << endl;
+        return 1;
+    }
+
+    if (options.valueType != "u64" && options.valueType != "string") {
+        cerr << "unknown value type " << options.valueType << endl;
+        return 1;
+    }
+    bool stringValues = (options.valueType == "string");
+    if (options.keyType == "u64") return stringValues ? run<uint64_t, string>(options) : run<uint64_t, uint64_t>(options);
+    if (options.keyType == "string") return stringValues ? run<string, string>(options) : run<string, uint64_t>(options);
+    cerr << "unknown key type " << options.keyType << endl;
+    return 1;
+}
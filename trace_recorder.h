@@ -0,0 +1,385 @@
+#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "snapshot_serializer.h"
+// for TracingTree's default tree type
+#include "bst.h"
+
+// Operation traces for replaying real workloads against any tree engine.
+//
+// File layout:
+//   header:  "BSTTRAC\0", uint32 version, uint32 flags (reserved, 0),
+//            uint32 sizeof(Key), uint32 sizeof(Value)
+//   records: uint8 op, varint nanoseconds since the previous record, then
+//              TRACE_INSERT:  serialized key, serialized value
+//              TRACE_FIND:    serialized key
+//              TRACE_REMOVE:  serialized key
+//              TRACE_ITERATE: varint number of items visited
+//
+// Keys and values go through the same serializers as AVLTree snapshots.
+// Timestamps are deltas in LEB128 varints, so a busy trace spends one or
+// two bytes per record on them.
+
+#define BST_TRACE_MAGIC "BSTTRAC"
+#define BST_TRACE_VERSION 1
+#define BST_TRACE_BUFFER_SIZE (1 << 20)
+
+enum TraceOp
+{
+    TRACE_INSERT = 1,
+    TRACE_FIND = 2,
+    TRACE_REMOVE = 3,
+    TRACE_ITERATE = 4
+};
+
+/**
+* One decoded trace record. timestamp is in nanoseconds since the trace
+* started; value is only meaningful for inserts and count for iterations.
+*/
+template <typename Key, typename Value>
+struct TraceRecord
+{
+    TraceRecord() : op(TRACE_FIND), timestamp(0), key(), value(), count(0)
+    {
+
+    }
+
+    TraceOp op;
+    uint64_t timestamp;
+    Key key;
+    Value value;
+    uint64_t count;
+};
+
+// LEB128 helpers shared by the writer and reader
+inline void traceWriteVarint(std::string& out, uint64_t n)
+{
+    while (n >= 0x80) {
+        out.push_back(static_cast<char>((n & 0x7F) | 0x80));
+        n >>= 7;
+    }
+    out.push_back(static_cast<char>(n));
+}
+
+inline uint64_t traceReadVarint(const char*& in, const char* end)
+{
+    uint64_t n = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (in == end) {
+            throw std::runtime_error("Trace is truncated");
+        }
+        uint8_t byte = static_cast<uint8_t>(*in++);
+        n |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return n;
+        }
+    }
+    throw std::runtime_error("Trace has a malformed varint");
+}
+
+/**
+* Appends trace records to a file through a large buffer.
+*/
+template <typename Key, typename Value, class KeySerializer = SnapshotSerializer<Key>, class ValueSerializer = SnapshotSerializer<Value> >
+class TraceWriter
+{
+public:
+    TraceWriter(const std::string& path);
+    ~TraceWriter();
+
+    void insert(const Key& key, const Value& value);
+    void find(const Key& key);
+    void remove(const Key& key);
+    void iterate(uint64_t count);
+
+    // Writes out buffered records
+    void flush();
+
+protected:
+    void beginRecord(TraceOp op);
+
+    FILE* out_;
+    std::string path_;
+    std::string buffer_;
+    std::chrono::steady_clock::time_point last_;
+
+private:
+    // Not copyable: owns the file
+    TraceWriter(const TraceWriter& other);
+    TraceWriter& operator=(const TraceWriter& other);
+};
+
+template <typename Key, typename Value, class KeySerializer, class ValueSerializer>
+TraceWriter<Key, Value, KeySerializer, ValueSerializer>::TraceWriter(const std::string& path) :
+    out_(fopen(path.c_str(), "wb")),
+    path_(path),
+    last_(std::chrono::steady_clock::now())
+{
+    if (out_ == NULL) {
+        throw std::runtime_error("Could not open " + path + " for writing");
+    }
+    buffer_.reserve(BST_TRACE_BUFFER_SIZE + 256);
+    buffer_.append(BST_TRACE_MAGIC, sizeof(BST_TRACE_MAGIC));
+    SnapshotSerializer<uint32_t>::write(buffer_, BST_TRACE_VERSION);
+    SnapshotSerializer<uint32_t>::write(buffer_, 0);
+    SnapshotSerializer<uint32_t>::write(buffer_, sizeof(Key));
+    SnapshotSerializer<uint32_t>::write(buffer_, sizeof(Value));
+}
+
+template <typename Key, typename Value, class KeySerializer, class ValueSerializer>
+TraceWriter<Key, Value, KeySerializer, ValueSerializer>::~TraceWriter()
+{
+    try {
+        flush();
+    }
+    catch (...) {
+        // nothing sensible to do with an I/O error in a destructor
+    }
+    fclose(out_);
+}
+
+template <typename Key, typename Value, class KeySerializer, class ValueSerializer>
+void TraceWriter<Key, Value, KeySerializer, ValueSerializer>::beginRecord(TraceOp op)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    uint64_t delta = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_).count();
+    last_ = now;
+    buffer_.push_back(static_cast<char>(op));
+    traceWriteVarint(buffer_, delta);
+}
+
+template <typename Key, typename Value, class KeySerializer, class ValueSerializer>
+void TraceWriter<Key, Value, KeySerializer, ValueSerializer>::insert(const Key& key, const Value& value)
+{
+    beginRecord(TRACE_INSERT);
+    KeySerializer::write(buffer_, key);
+    ValueSerializer::write(buffer_, value);
+    if (buffer_.size() >= BST_TRACE_BUFFER_SIZE) {
+        flush();
+    }
+}
+
+template <typename Key, typename Value, class KeySerializer, class ValueSerializer>
+void TraceWriter<Key, Value, KeySerializer, ValueSerializer>::find(const Key& key)
+{
+    beginRecord(TRACE_FIND);
+    KeySerializer::write(buffer_, key);
+    if (buffer_.size() >= BST_TRACE_BUFFER_SIZE) {
+        flush();
+    }
+}
+
+template <typename Key, typename Value, class KeySerializer, class ValueSerializer>
+void TraceWriter<Key, Value, KeySerializer, ValueSerializer>::remove(const Key& key)
+{
+    beginRecord(TRACE_REMOVE);
+    KeySerializer::write(buffer_, key);
+    if (buffer_.size() >= BST_TRACE_BUFFER_SIZE) {
+        flush();
+    }
+}
+
+template <typename Key, typename Value, class KeySerializer, class ValueSerializer>
+void TraceWriter<Key, Value, KeySerializer, ValueSerializer>::iterate(uint64_t count)
+{
+    beginRecord(TRACE_ITERATE);
+    traceWriteVarint(buffer_, count);
+    if (buffer_.size() >= BST_TRACE_BUFFER_SIZE) {
+        flush();
+    }
+}
+
+template <typename Key, typename Value, class KeySerializer, class ValueSerializer>
+void TraceWriter<Key, Value, KeySerializer, ValueSerializer>::flush()
+{
+    if (buffer_.empty()) {
+        return;
+    }
+    if (fwrite(buffer_.data(), 1, buffer_.size(), out_) != buffer_.size() || fflush(out_) != 0) {
+        throw std::runtime_error("Could not write trace " + path_);
+    }
+    buffer_.clear();
+}
+
+/**
+* Reads a whole trace into memory and decodes it one record at a time.
+*/
+template <typename Key, typename Value, class KeySerializer = SnapshotSerializer<Key>, class ValueSerializer = SnapshotSerializer<Value> >
+class TraceReader
+{
+public:
+    TraceReader(const std::string& path);
+
+    // Decodes the next record; returns false at the end of the trace
+    bool next(TraceRecord<Key, Value>& record);
+
+protected:
+    std::vector<char> data_;
+    const char* pos_;
+    const char* end_;
+    uint64_t timestamp_;
+};
+
+template <typename Key, typename Value, class KeySerializer, class ValueSerializer>
+TraceReader<Key, Value, KeySerializer, ValueSerializer>::TraceReader(const std::string& path) :
+    pos_(NULL),
+    end_(NULL),
+    timestamp_(0)
+{
+    FILE* in = fopen(path.c_str(), "rb");
+    if (in == NULL) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    char chunk[1 << 16];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        data_.insert(data_.end(), chunk, chunk + got);
+    }
+    fclose(in);
+
+    size_t headerSize = sizeof(BST_TRACE_MAGIC) + 4 * sizeof(uint32_t);
+    if (data_.size() < headerSize || memcmp(&data_[0], BST_TRACE_MAGIC, sizeof(BST_TRACE_MAGIC)) != 0) {
+        throw std::runtime_error(path + " is not a trace");
+    }
+    pos_ = &data_[0] + sizeof(BST_TRACE_MAGIC);
+    end_ = &data_[0] + data_.size();
+    if (SnapshotSerializer<uint32_t>::read(pos_, end_) != BST_TRACE_VERSION) {
+        throw std::runtime_error(path + " has an unsupported trace version");
+    }
+    SnapshotSerializer<uint32_t>::read(pos_, end_); // flags
+    uint32_t keySize = SnapshotSerializer<uint32_t>::read(pos_, end_);
+    uint32_t valueSize = SnapshotSerializer<uint32_t>::read(pos_, end_);
+    if (keySize != sizeof(Key) || valueSize != sizeof(Value)) {
+        throw std::runtime_error(path + " was recorded with different key/value types");
+    }
+}
+
+template <typename Key, typename Value, class KeySerializer, class ValueSerializer>
+bool TraceReader<Key, Value, KeySerializer, ValueSerializer>::next(TraceRecord<Key, Value>& record)
+{
+    if (pos_ == end_) {
+        return false;
+    }
+    record.op = static_cast<TraceOp>(static_cast<uint8_t>(*pos_++));
+    timestamp_ += traceReadVarint(pos_, end_);
+    record.timestamp = timestamp_;
+    switch (record.op) {
+        case TRACE_INSERT:
+            record.key = KeySerializer::read(pos_, end_);
+            record.value = ValueSerializer::read(pos_, end_);
+            break;
+        case TRACE_FIND:
+        case TRACE_REMOVE:
+            record.key = KeySerializer::read(pos_, end_);
+            break;
+        case TRACE_ITERATE:
+            record.count = traceReadVarint(pos_, end_);
+            break;
+        default:
+            throw std::runtime_error("Trace has an unknown operation");
+    }
+    return true;
+}
+
+/**
+* Wraps a tree and logs every operation made through it to a trace, then
+* forwards the operation to the tree. Tree is the tree's own type (any
+* BinarySearchTree-derived tree), so the calls reach the find, begin and
+* iterator it defines rather than the base versions. Operations made on
+* the tree directly are not recorded.
+*/
+template <typename Key, typename Value, class Tree = BinarySearchTree<Key, Value>,
+          class KeySerializer = SnapshotSerializer<Key>, class ValueSerializer = SnapshotSerializer<Value> >
+class TracingTree
+{
+public:
+    typedef typename Tree::iterator iterator;
+
+    TracingTree(Tree& tree, const std::string& tracePath);
+
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    iterator find(const Key& key);
+    Value& operator[](const Key& key);
+
+    // Calls fn on every item in order, recorded as one TRACE_ITERATE
+    template <class Function>
+    void iterate(Function fn);
+
+    iterator end() const
+    {
+        return tree_.end();
+    }
+
+    Tree& tree()
+    {
+        return tree_;
+    }
+
+    void flush()
+    {
+        writer_.flush();
+    }
+
+protected:
+    Tree& tree_;
+    TraceWriter<Key, Value, KeySerializer, ValueSerializer> writer_;
+};
+
+template <typename Key, typename Value, class Tree, class KeySerializer, class ValueSerializer>
+TracingTree<Key, Value, Tree, KeySerializer, ValueSerializer>::TracingTree(Tree& tree, const std::string& tracePath) :
+    tree_(tree),
+    writer_(tracePath)
+{
+
+}
+
+template <typename Key, typename Value, class Tree, class KeySerializer, class ValueSerializer>
+void TracingTree<Key, Value, Tree, KeySerializer, ValueSerializer>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    writer_.insert(keyValuePair.first, keyValuePair.second);
+    tree_.insert(keyValuePair);
+}
+
+template <typename Key, typename Value, class Tree, class KeySerializer, class ValueSerializer>
+void TracingTree<Key, Value, Tree, KeySerializer, ValueSerializer>::remove(const Key& key)
+{
+    writer_.remove(key);
+    tree_.remove(key);
+}
+
+template <typename Key, typename Value, class Tree, class KeySerializer, class ValueSerializer>
+typename TracingTree<Key, Value, Tree, KeySerializer, ValueSerializer>::iterator
+TracingTree<Key, Value, Tree, KeySerializer, ValueSerializer>::find(const Key& key)
+{
+    writer_.find(key);
+    return tree_.find(key);
+}
+
+template <typename Key, typename Value, class Tree, class KeySerializer, class ValueSerializer>
+Value& TracingTree<Key, Value, Tree, KeySerializer, ValueSerializer>::operator[](const Key& key)
+{
+    writer_.find(key);
+    return tree_[key];
+}
+
+template <typename Key, typename Value, class Tree, class KeySerializer, class ValueSerializer>
+template <class Function>
+void TracingTree<Key, Value, Tree, KeySerializer, ValueSerializer>::iterate(Function fn)
+{
+    uint64_t count = 0;
+    for (iterator it = tree_.begin(); it != tree_.end(); ++it) {
+        fn(*it);
+        ++count;
+    }
+    writer_.iterate(count);
+}
+
+#endif
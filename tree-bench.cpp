@@ -0,0 +1,801 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "bst.h"
+#include "avlbst.h"
+#include "buffered_avl.h"
+#include "tombstone_avl.h"
+#include "separated_avl.h"
+#include "aggregate_avl.h"
+#include "lazy_avl.h"
+#include "interval_tree.h"
+#include "bst_hash_index.h"
+#include "compact_avl.h"
+#include "stack_avl.h"
+
+using namespace std;
+
+// Throughput benchmark comparing BinarySearchTree, AVLTree, std::map and
+// the AVLTree variants (buffered: BufferedAVLTree; tombstone and
+// tombstone-nocompact: TombstoneAVLTree with the default compaction ratio
+// and with compaction off; aggregate: AggregateAVLTree keeping sums;
+// lazy: LazyAVLTree; hash: HashIndexedTree over an AVLTree; compact:
+// CompactAVLTree; stack: StackAVLTree).
+//
+// --scenarios adds workloads for what a particular variant is for, run at
+// every size on random u64 keys (pass --keys "" to run only those):
+//   large-values     insert and find with 2 KB values, avl vs. separated
+//                    (SeparatedAVLTree)
+//   range-aggregate  sum of the values over 10% of the keys, by
+//                    AggregateAVLTree::aggregate vs. an iterator scan
+//   range-update     add to the values over 10% of the keys, by
+//                    LazyAVLTree::applyRange vs. an iterator scan
+//   interval-stab    intervals containing a point, by IntervalTree::stabbing,
+//                    stabbingBatch (time per point) and a scan of every interval
+//
+// For every structure x key type x key distribution x size it measures
+// insert, find-hit, batched find-hit, find-miss, full iteration, a mixed workload and remove,
+// and prints one CSV line (or JSON object) per operation with ops/sec,
+// sampled ns/op percentiles, the peak RSS of the case and, for structures
+// that report it (compact), the structure's own memory after the operation.
+//
+// usage: tree-bench [--sizes 1000,100000]
+//                   [--structures bst,avl,map,buffered,tombstone,tombstone-nocompact,aggregate,lazy,hash,compact,stack]
+//                   [--dists sequential,reverse,random,zipf,clustered]
+//                   [--keys u64,string] [--format csv|json] [--seed N]
+//                   [--scenarios large-values,range-aggregate,range-update,interval-stab]
+
+// one in LATENCY_SAMPLE_EVERY operations is timed on its own for the percentiles
+#define LATENCY_SAMPLE_EVERY 16
+// BinarySearchTree degenerates into a list on sorted input (O(n^2) to build,
+// with recursion as deep as the list), so those cases are capped
+#define BST_SORTED_MAX_SIZE 10000
+// keys per findBatch call in the find_batch operation
+#define FIND_BATCH_SIZE 256
+
+typedef chrono::steady_clock Clock;
+
+struct Options
+{
+    vector<size_t> sizes;
+    vector<string> structures;
+    vector<string> dists;
+    vector<string> keyTypes;
+    vector<string> scenarios;
+    string format;
+    uint64_t seed;
+};
+
+struct Result
+{
+    string structure, keyType, dist, operation;
+    size_t size;
+    size_t ops;
+    double seconds;
+    vector<double> samples; // ns per sampled operation
+    long peakRssKb;
+    long structureKb; // -1 if the structure doesn't report its memory
+};
+
+/*
+  -----------------------------------------
+  Key generation
+  -----------------------------------------
+*/
+
+// All generated keys are even, so key + 1 is guaranteed to miss.
+vector<uint64_t> makeKeys(const string& dist, size_t n, mt19937_64& rng)
+{
+    vector<uint64_t> keys(n);
+    if (dist == "sequential") {
+        for (size_t i = 0; i < n; ++i) keys[i] = 2 * i;
+    }
+    else if (dist == "reverse") {
+        for (size_t i = 0; i < n; ++i) keys[i] = 2 * (n - i);
+    }
+    else if (dist == "random") {
+        for (size_t i = 0; i < n; ++i) keys[i] = rng() & ~1ULL;
+    }
+    else if (dist == "clustered") {
+        // runs of 64 consecutive keys starting at random places
+        for (size_t i = 0; i < n; i += 64) {
+            uint64_t base = (rng() >> 8) & ~1ULL;
+            for (size_t j = i; j < n && j < i + 64; ++j) keys[j] = base + 2 * (j - i);
+        }
+    }
+    else if (dist == "zipf") {
+        // ranks drawn from Zipf(s = 0.99) over [1, n] by inverting the
+        // continuous approximation of its CDF, then scattered over the key space
+        const double s = 0.99;
+        double top = pow(static_cast<double>(n), 1.0 - s) - 1.0;
+        uniform_real_distribution<double> uniform(0.0, 1.0);
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t rank = static_cast<uint64_t>(pow(top * uniform(rng) + 1.0, 1.0 / (1.0 - s)));
+            keys[i] = (rank * 0x9E3779B97F4A7C15ULL) & ~1ULL;
+        }
+    }
+    else {
+        cerr << "unknown distribution " << dist << endl;
+        exit(1);
+    }
+    return keys;
+}
+
+// Fixed-width hex so that string order matches numeric order
+template<typename Key> Key convertKey(uint64_t k);
+template<> uint64_t convertKey<uint64_t>(uint64_t k) { return k; }
+template<> string convertKey<string>(uint64_t k)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(k));
+    return string(buf, 16);
+}
+
+/*
+  -----------------------------------------
+  Structure adapters
+  -----------------------------------------
+*/
+
+// TombstoneAVLTree that never compacts, so removes only ever mark nodes
+template<typename Key, typename Value>
+struct UncompactedTombstoneTree : public TombstoneAVLTree<Key, Value>
+{
+    UncompactedTombstoneTree() : TombstoneAVLTree<Key, Value>(0) {}
+};
+
+// The iterator type findBatch fills in: the base tree's for the AVLTree variants
+template<typename Tree, typename Key, typename Iterator>
+Iterator findBatchIterator(void (Tree::*)(const vector<Key>&, vector<Iterator>&) const);
+
+template<typename Tree, typename Key>
+struct TreeAdapter
+{
+    Tree tree;
+    vector<decltype(findBatchIterator(&Tree::findBatch))> results;
+    void insert(const Key& k, uint64_t v) { tree.insert(make_pair(k, v)); }
+    bool find(const Key& k) const { return tree.find(k) != tree.end(); }
+    uint64_t findBatch(const vector<Key>& ks)
+    {
+        tree.findBatch(ks, results);
+        uint64_t hits = 0;
+        for (size_t i = 0; i < results.size(); ++i) hits += (results[i] != tree.end());
+        return hits;
+    }
+    void remove(const Key& k) { tree.remove(k); }
+    uint64_t iterate() const
+    {
+        uint64_t sum = 0;
+        for (typename Tree::iterator it = tree.begin(); it != tree.end(); ++it) sum += it->second;
+        return sum;
+    }
+    long memoryKb() const { return -1; }
+};
+
+template<typename Key>
+struct TreeAdapter<map<Key, uint64_t>, Key>
+{
+    map<Key, uint64_t> tree;
+    void insert(const Key& k, uint64_t v) { tree[k] = v; }
+    bool find(const Key& k) const { return tree.find(k) != tree.end(); }
+    uint64_t findBatch(const vector<Key>& ks)
+    {
+        uint64_t hits = 0;
+        for (size_t i = 0; i < ks.size(); ++i) hits += find(ks[i]);
+        return hits;
+    }
+    void remove(const Key& k) { tree.erase(k); }
+    uint64_t iterate() const
+    {
+        uint64_t sum = 0;
+        for (typename map<Key, uint64_t>::const_iterator it = tree.begin(); it != tree.end(); ++it) sum += it->second;
+        return sum;
+    }
+    long memoryKb() const { return -1; }
+};
+
+// For trees without findBatch: a batch is a loop over find
+template<typename Tree, typename Key>
+struct LoopedTreeAdapter
+{
+    Tree tree;
+    void insert(const Key& k, uint64_t v) { tree.insert(make_pair(k, v)); }
+    bool find(const Key& k) const { return tree.find(k) != tree.end(); }
+    uint64_t findBatch(const vector<Key>& ks)
+    {
+        uint64_t hits = 0;
+        for (size_t i = 0; i < ks.size(); ++i) hits += find(ks[i]);
+        return hits;
+    }
+    void remove(const Key& k) { tree.remove(k); }
+    uint64_t iterate() const
+    {
+        uint64_t sum = 0;
+        for (typename Tree::iterator it = tree.begin(); it != tree.end(); ++it) sum += it->second;
+        return sum;
+    }
+    long memoryKb() const { return -1; }
+};
+
+// CompactAVLTree also reports its memory
+template<typename Key>
+struct TreeAdapter<CompactAVLTree<Key, uint64_t>, Key> : LoopedTreeAdapter<CompactAVLTree<Key, uint64_t>, Key>
+{
+    long memoryKb() const { return static_cast<long>(this->tree.memoryUsage() / 1024); }
+};
+
+template<typename Key>
+struct TreeAdapter<StackAVLTree<Key, uint64_t>, Key> : LoopedTreeAdapter<StackAVLTree<Key, uint64_t>, Key>
+{
+};
+
+/*
+  -----------------------------------------
+  Measurement helpers
+  -----------------------------------------
+*/
+
+// Resets the kernel's peak-RSS counter (Linux >= 4.0) so each case reports its own peak
+void resetPeakRss()
+{
+    ofstream clearRefs("/proc/self/clear_refs");
+    if (clearRefs) clearRefs << "5";
+}
+
+long peakRssKb()
+{
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) return atol(line.c_str() + 6);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// keeps results alive so the optimizer can't drop the work
+volatile uint64_t sink;
+
+// Runs op(i) for i in [0, count), timing every LATENCY_SAMPLE_EVERY-th call by itself
+template<typename Op>
+void measure(Result& result, size_t count, Op op)
+{
+    result.ops = count;
+    result.samples.clear();
+    result.samples.reserve(count / LATENCY_SAMPLE_EVERY + 1);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        if (i % LATENCY_SAMPLE_EVERY == 0) {
+            Clock::time_point before = Clock::now();
+            op(i);
+            result.samples.push_back(chrono::duration<double, nano>(Clock::now() - before).count());
+        }
+        else {
+            op(i);
+        }
+    }
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+}
+
+double percentile(vector<double>& samples, double p)
+{
+    if (samples.empty()) return 0;
+    size_t index = min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+    nth_element(samples.begin(), samples.begin() + index, samples.end());
+    return samples[index];
+}
+
+void printResult(Result& r, const Options& options, bool& first)
+{
+    double p50 = percentile(r.samples, 0.50);
+    double p90 = percentile(r.samples, 0.90);
+    double p99 = percentile(r.samples, 0.99);
+    double p999 = percentile(r.samples, 0.999);
+    double opsPerSec = (r.seconds > 0) ? r.ops / r.seconds : 0;
+
+    if (options.format == "json") {
+        cout << (first ? "[\n  " : ",\n  ")
+             << "{\"structure\":\"" << r.structure << "\",\"key_type\":\"" << r.keyType
+             << "\",\"distribution\":\"" << r.dist << "\",\"size\":" << r.size
+             << ",\"operation\":\"" << r.operation << "\",\"ops\":" << r.ops
+             << ",\"seconds\":" << r.seconds << ",\"ops_per_sec\":" << opsPerSec
+             << ",\"ns_p50\":" << p50 << ",\"ns_p90\":" << p90 << ",\"ns_p99\":" << p99
+             << ",\"ns_p999\":" << p999 << ",\"peak_rss_kb\":" << r.peakRssKb << ",\"structure_kb\":";
+        if (r.structureKb < 0) cout << "null}";
+        else cout << r.structureKb << "}";
+    }
+    else {
+        if (first) {
+            cout << "structure,key_type,distribution,size,operation,ops,seconds,ops_per_sec,"
+                 << "ns_p50,ns_p90,ns_p99,ns_p999,peak_rss_kb,structure_kb\n";
+        }
+        cout << r.structure << "," << r.keyType << "," << r.dist << "," << r.size << ","
+             << r.operation << "," << r.ops << "," << r.seconds << "," << opsPerSec << ","
+             << p50 << "," << p90 << "," << p99 << "," << p999 << "," << r.peakRssKb << ",";
+        if (r.structureKb >= 0) cout << r.structureKb;
+        cout << "\n";
+    }
+    cout.flush();
+    first = false;
+}
+
+/*
+  -----------------------------------------
+  One benchmark case
+  -----------------------------------------
+*/
+
+template<typename Tree, typename Key>
+void runCase(const string& structure, const string& keyType, const string& dist, size_t n,
+             const Options& options, bool& first)
+{
+    mt19937_64 rng(options.seed);
+    vector<uint64_t> raw = makeKeys(dist, n, rng);
+    vector<Key> keys(n), misses(n), lookups(n);
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = convertKey<Key>(raw[i]);
+        misses[i] = convertKey<Key>(raw[i] + 1);
+    }
+    // lookups hit keys in random order, except zipf which keeps its skew
+    vector<size_t> order(n);
+    for (size_t i = 0; i < n; ++i) order[i] = i;
+    if (dist != "zipf") shuffle(order.begin(), order.end(), rng);
+    for (size_t i = 0; i < n; ++i) lookups[i] = keys[order[i]];
+
+    resetPeakRss();
+    TreeAdapter<Tree, Key>* adapter = new TreeAdapter<Tree, Key>();
+    TreeAdapter<Tree, Key>& a = *adapter;
+
+    Result r;
+    r.structure = structure;
+    r.keyType = keyType;
+    r.dist = dist;
+    r.size = n;
+
+    r.operation = "insert";
+    measure(r, n, [&](size_t i) { a.insert(keys[i], i); });
+    r.peakRssKb = peakRssKb();
+    r.structureKb = a.memoryKb();
+    printResult(r, options, first);
+
+    r.operation = "find_hit";
+    uint64_t found = 0;
+    measure(r, n, [&](size_t i) { found += a.find(lookups[i]); });
+    r.peakRssKb = peakRssKb();
+    r.structureKb = a.memoryKb();
+    printResult(r, options, first);
+
+    // the same hits as find_hit, looked up FIND_BATCH_SIZE keys at a time
+    // (ops_per_sec is per key, the latency percentiles per batch)
+    r.operation = "find_batch";
+    vector<Key> batch;
+    measure(r, (n + FIND_BATCH_SIZE - 1) / FIND_BATCH_SIZE, [&](size_t i) {
+        size_t begin = i * FIND_BATCH_SIZE;
+        batch.assign(lookups.begin() + begin, lookups.begin() + min(n, begin + FIND_BATCH_SIZE));
+        found += a.findBatch(batch);
+    });
+    r.ops = n;
+    r.peakRssKb = peakRssKb();
+    r.structureKb = a.memoryKb();
+    printResult(r, options, first);
+
+    r.operation = "find_miss";
+    measure(r, n, [&](size_t i) { found += a.find(misses[i]); });
+    r.peakRssKb = peakRssKb();
+    r.structureKb = a.memoryKb();
+    printResult(r, options, first);
+
+    // one full scan, reported per element
+    r.operation = "iterate";
+    Clock::time_point start = Clock::now();
+    sink = a.iterate();
+    r.seconds = chrono::duration<double>(Clock::now() - start).count();
+    r.ops = n;
+    r.samples.clear();
+    r.peakRssKb = peakRssKb();
+    r.structureKb = a.memoryKb();
+    printResult(r, options, first);
+
+    // 50% find, 25% insert, 25% remove over the same key population
+    r.operation = "mixed";
+    measure(r, n, [&](size_t i) {
+        const Key& k = lookups[(i * 7919) % n];
+        switch (i & 3) {
+            case 0: a.insert(k, i); break;
+            case 1: a.remove(k); break;
+            default: found += a.find(k); break;
+        }
+    });
+    r.peakRssKb = peakRssKb();
+    r.structureKb = a.memoryKb();
+    printResult(r, options, first);
+
+    r.operation = "remove";
+    measure(r, n, [&](size_t i) { a.remove(lookups[i]); });
+    r.peakRssKb = peakRssKb();
+    r.structureKb = a.memoryKb();
+    printResult(r, options, first);
+
+    sink = found;
+    delete adapter;
+}
+
+template<typename Key>
+void runKeyType(const string& keyType, const Options& options, bool& first)
+{
+    for (size_t s = 0; s < options.sizes.size(); ++s) {
+        for (size_t d = 0; d < options.dists.size(); ++d) {
+            for (size_t t = 0; t < options.structures.size(); ++t) {
+                const string& structure = options.structures[t];
+                const string& dist = options.dists[d];
+                size_t n = options.sizes[s];
+                if (structure == "bst") {
+                    if ((dist == "sequential" || dist == "reverse") && n > BST_SORTED_MAX_SIZE) {
+                        cerr << "skipping bst/" << dist << "/" << n << ": degenerate tree" << endl;
+                        continue;
+                    }
+                    runCase<BinarySearchTree<Key, uint64_t>, Key>(structure, keyType, dist, n, options, first);
+                }
+                else if (structure == "avl") {
+                    runCase<AVLTree<Key, uint64_t>, Key>(structure, keyType, dist, n, options, first);
+                }
+                else if (structure == "buffered") {
+                    runCase<BufferedAVLTree<Key, uint64_t>, Key>(structure, keyType, dist, n, options, first);
+                }
+                else if (structure == "tombstone") {
+                    runCase<TombstoneAVLTree<Key, uint64_t>, Key>(structure, keyType, dist, n, options, first);
+                }
+                else if (structure == "tombstone-nocompact") {
+                    runCase<UncompactedTombstoneTree<Key, uint64_t>, Key>(structure, keyType, dist, n, options, first);
+                }
+                else if (structure == "aggregate") {
+                    runCase<AggregateAVLTree<Key, uint64_t>, Key>(structure, keyType, dist, n, options, first);
+                }
+                else if (structure == "lazy") {
+                    runCase<LazyAVLTree<Key, uint64_t>, Key>(structure, keyType, dist, n, options, first);
+                }
+                else if (structure == "hash") {
+                    runCase<HashIndexedTree<Key, uint64_t>, Key>(structure, keyType, dist, n, options, first);
+                }
+                else if (structure == "compact") {
+                    runCase<CompactAVLTree<Key, uint64_t>, Key>(structure, keyType, dist, n, options, first);
+                }
+                else if (structure == "stack") {
+                    runCase<StackAVLTree<Key, uint64_t>, Key>(structure, keyType, dist, n, options, first);
+                }
+                else if (structure == "map") {
+                    runCase<map<Key, uint64_t>, Key>(structure, keyType, dist, n, options, first);
+                }
+                else {
+                    cerr << "unknown structure " << structure << endl;
+                    exit(1);
+                }
+            }
+        }
+    }
+}
+
+/*
+  -----------------------------------------
+  Scenarios
+  -----------------------------------------
+*/
+
+// A 2 KB value for the large-values scenario
+struct LargeValue
+{
+    uint64_t words[256];
+};
+
+// printRoot is instantiated along with the trees' virtual print()
+ostream& operator<<(ostream& out, const LargeValue& value)
+{
+    return out << value.words[0];
+}
+
+// Random u64 keys, and the same keys again in another random order for lookups
+void makeScenarioKeys(size_t n, const Options& options, vector<uint64_t>& keys, vector<uint64_t>& lookups)
+{
+    mt19937_64 rng(options.seed);
+    keys = makeKeys("random", n, rng);
+    lookups = keys;
+    shuffle(lookups.begin(), lookups.end(), rng);
+}
+
+Result scenarioResult(const string& structure, size_t n)
+{
+    Result r;
+    r.structure = structure;
+    r.keyType = "u64";
+    r.dist = "random";
+    r.size = n;
+    r.structureKb = -1;
+    return r;
+}
+
+template<typename Tree>
+void runLargeValues(const string& structure, size_t n, const Options& options, bool& first)
+{
+    vector<uint64_t> keys, lookups;
+    makeScenarioKeys(n, options, keys, lookups);
+    resetPeakRss();
+    Tree* tree = new Tree();
+    Result r = scenarioResult(structure, n);
+
+    LargeValue value;
+    memset(&value, 0, sizeof(value));
+    r.operation = "insert_2kb";
+    measure(r, n, [&](size_t i) {
+        value.words[0] = i;
+        tree->insert(make_pair(keys[i], value));
+    });
+    r.peakRssKb = peakRssKb();
+    printResult(r, options, first);
+
+    // reads a word of each value, so the value itself is fetched too
+    r.operation = "find_hit_2kb";
+    uint64_t sum = 0;
+    measure(r, n, [&](size_t i) { sum += tree->find(lookups[i])->second.words[0]; });
+    r.peakRssKb = peakRssKb();
+    printResult(r, options, first);
+
+    sink = sum;
+    delete tree;
+}
+
+// number of ranges each range query operation runs, and of ranges scanned
+// for comparison (scans are O(n / 10) each)
+#define RANGE_QUERIES 10000
+#define RANGE_SCANS 100
+
+// The range of range query i: from a random key over the next 10% of the keys
+void rangeBounds(const vector<uint64_t>& sorted, size_t i, uint64_t& lo, uint64_t& hi)
+{
+    size_t width = max<size_t>(1, sorted.size() / 10);
+    size_t start = (i * 7919) % (sorted.size() - width + 1);
+    lo = sorted[start];
+    hi = sorted[start + width - 1];
+}
+
+void runRangeAggregate(size_t n, const Options& options, bool& first)
+{
+    vector<uint64_t> keys, lookups;
+    makeScenarioKeys(n, options, keys, lookups);
+    vector<uint64_t> sorted(keys);
+    sort(sorted.begin(), sorted.end());
+    resetPeakRss();
+    AggregateAVLTree<uint64_t, uint64_t>* tree = new AggregateAVLTree<uint64_t, uint64_t>();
+    for (size_t i = 0; i < n; ++i) {
+        tree->insert(make_pair(keys[i], i));
+    }
+    Result r = scenarioResult("aggregate", n);
+    uint64_t sum = 0;
+
+    r.operation = "range_aggregate";
+    measure(r, RANGE_QUERIES, [&](size_t i) {
+        uint64_t lo, hi;
+        rangeBounds(sorted, i, lo, hi);
+        sum += tree->aggregate(lo, hi);
+    });
+    r.peakRssKb = peakRssKb();
+    printResult(r, options, first);
+
+    r.operation = "range_scan";
+    measure(r, RANGE_SCANS, [&](size_t i) {
+        uint64_t lo, hi;
+        rangeBounds(sorted, i, lo, hi);
+        for (AVLTree<uint64_t, uint64_t>::iterator it = tree->find(lo); it != tree->end() && it->first <= hi; ++it) {
+            sum += it->second;
+        }
+    });
+    r.peakRssKb = peakRssKb();
+    printResult(r, options, first);
+
+    sink = sum;
+    delete tree;
+}
+
+void runRangeUpdate(size_t n, const Options& options, bool& first)
+{
+    vector<uint64_t> keys, lookups;
+    makeScenarioKeys(n, options, keys, lookups);
+    vector<uint64_t> sorted(keys);
+    sort(sorted.begin(), sorted.end());
+    resetPeakRss();
+    LazyAVLTree<uint64_t, uint64_t>* tree = new LazyAVLTree<uint64_t, uint64_t>();
+    for (size_t i = 0; i < n; ++i) {
+        tree->insert(make_pair(keys[i], i));
+    }
+    Result r = scenarioResult("lazy", n);
+
+    r.operation = "range_update";
+    measure(r, RANGE_QUERIES, [&](size_t i) {
+        uint64_t lo, hi;
+        rangeBounds(sorted, i, lo, hi);
+        tree->applyRange(lo, hi, 1);
+    });
+    r.peakRssKb = peakRssKb();
+    printResult(r, options, first);
+
+    r.operation = "range_scan_update";
+    measure(r, RANGE_SCANS, [&](size_t i) {
+        uint64_t lo, hi;
+        rangeBounds(sorted, i, lo, hi);
+        for (LazyAVLTree<uint64_t, uint64_t>::iterator it = tree->find(lo); it != tree->end() && it->first <= hi; ++it) {
+            it->second += 1;
+        }
+    });
+    r.peakRssKb = peakRssKb();
+    printResult(r, options, first);
+
+    sink = tree->find(sorted[0])->second;
+    delete tree;
+}
+
+#define STAB_BATCH 1000
+#define STAB_SCANS 10
+
+void runIntervalStab(size_t n, const Options& options, bool& first)
+{
+    vector<uint64_t> keys, lookups;
+    makeScenarioKeys(n, options, keys, lookups);
+    resetPeakRss();
+    // short intervals: each spans up to 7 average key gaps, so a point is
+    // in a handful of them
+    uint64_t gap = UINT64_MAX / n;
+    IntervalTree<uint64_t, uint64_t>* tree = new IntervalTree<uint64_t, uint64_t>();
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t length = gap * (i % 8);
+        uint64_t end = (keys[i] > UINT64_MAX - length) ? UINT64_MAX : keys[i] + length;
+        tree->insert(keys[i], end, i);
+    }
+    Result r = scenarioResult("interval", n);
+    vector<IntervalTree<uint64_t, uint64_t>::iterator> found;
+    uint64_t count = 0;
+
+    r.operation = "stab";
+    measure(r, RANGE_QUERIES, [&](size_t i) {
+        tree->stabbing(lookups[i % n], found);
+        count += found.size();
+    });
+    r.peakRssKb = peakRssKb();
+    printResult(r, options, first);
+
+    // timed a batch at a time, then reported per point
+    vector<uint64_t> points;
+    vector<vector<IntervalTree<uint64_t, uint64_t>::iterator> > batchFound;
+    r.operation = "stab_batch";
+    measure(r, RANGE_QUERIES / STAB_BATCH, [&](size_t i) {
+        points.clear();
+        for (size_t j = 0; j < STAB_BATCH; ++j) {
+            points.push_back(lookups[(i * STAB_BATCH + j) % n]);
+        }
+        tree->stabbingBatch(points, batchFound);
+        count += batchFound.size();
+    });
+    r.ops *= STAB_BATCH;
+    for (size_t i = 0; i < r.samples.size(); ++i) {
+        r.samples[i] /= STAB_BATCH;
+    }
+    r.peakRssKb = peakRssKb();
+    printResult(r, options, first);
+
+    r.operation = "stab_scan";
+    measure(r, STAB_SCANS, [&](size_t i) {
+        uint64_t point = lookups[i % n];
+        for (IntervalTree<uint64_t, uint64_t>::iterator it = tree->begin(); it != tree->end(); ++it) {
+            if (it->first.start <= point && point <= it->first.end) {
+                ++count;
+            }
+        }
+    });
+    r.peakRssKb = peakRssKb();
+    printResult(r, options, first);
+
+    sink = count;
+    delete tree;
+}
+
+void runScenarios(const Options& options, bool& first)
+{
+    for (size_t c = 0; c < options.scenarios.size(); ++c) {
+        const string& scenario = options.scenarios[c];
+        for (size_t s = 0; s < options.sizes.size(); ++s) {
+            size_t n = options.sizes[s];
+            if (scenario == "large-values") {
+                runLargeValues<AVLTree<uint64_t, LargeValue> >("avl", n, options, first);
+                runLargeValues<SeparatedAVLTree<uint64_t, LargeValue> >("separated", n, options, first);
+            }
+            else if (scenario == "range-aggregate") {
+                runRangeAggregate(n, options, first);
+            }
+            else if (scenario == "range-update") {
+                runRangeUpdate(n, options, first);
+            }
+            else if (scenario == "interval-stab") {
+                runIntervalStab(n, options, first);
+            }
+            else {
+                cerr << "unknown scenario " << scenario << endl;
+                exit(1);
+            }
+        }
+    }
+}
+
+vector<string> splitList(const string& list)
+{
+    vector<string> items;
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+    options.sizes.push_back(1000);
+    options.sizes.push_back(10000);
+    options.sizes.push_back(100000);
+    options.sizes.push_back(1000000);
+    options.structures = splitList("bst,avl,map");
+    options.dists = splitList("sequential,reverse,random,zipf,clustered");
+    options.keyTypes = splitList("u64,string");
+    options.format = "csv";
+    options.seed = 104;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "usage: " << argv[0] << " [--sizes N,...] [--structures bst,avl,map,buffered,tombstone,tombstone-nocompact,aggregate,lazy,hash,compact,stack] "
+                 << "[--dists sequential,reverse,random,zipf,clustered] [--keys u64,string] "
+                 << "[--format csv|json] [--seed N] [--scenarios large-values,range-aggregate,range-update,interval-stab]" << endl;
+            return 1;
+        }
+        string value = argv[++i];
+        if (arg == "--sizes") {
+            vector<string> sizes = splitList(value);
+            options.sizes.clear();
+            for (size_t s = 0; s < sizes.size(); ++s) options.sizes.push_back(strtoull(sizes[s].c_str(), NULL, 10));
+        }
+        else if (arg == "--structures") options.structures = splitList(value);
+        else if (arg == "--dists") options.dists = splitList(value);
+        else if (arg == "--keys") options.keyTypes = splitList(value);
+        else if (arg == "--scenarios") options.scenarios = splitList(value);
+        else if (arg == "--format") options.format = value;
+        else if (arg == "--seed") options.seed = strtoull(value.c_str(), NULL, 10);
+        else {
+            cerr << "unknown option " << arg << endl;
+            return 1;
+        }
+    }
+
+    bool first = true;
+    for (size_t k = 0; k < options.keyTypes.size(); ++k) {
+        if (options.keyTypes[k] == "u64") runKeyType<uint64_t>("u64", options, first);
+        else if (options.keyTypes[k] == "string") runKeyType<string>("string", options, first);
+        else {
+            cerr << "unknown key type " << options.keyTypes[k] << endl;
+            return 1;
+        }
+    }
+    runScenarios(options, first);
+    if (options.format == "json") cout << (first ? "[]\n" : "\n]\n");
+    return 0;
+}
@@ -0,0 +1,279 @@
+#ifndef TREE_RECLAIMER_H
+#define TREE_RECLAIMER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "work_pool.h"
+
+// Background teardown of detached trees.
+//
+// BinarySearchTree::clearAsync() (and clear()/the destructor in deferred
+// destruction mode) hands its root to TreeReclaimer::shared() in O(1). A
+// single reclaimer thread then frees the nodes in slices of
+// TREE_RECLAIM_SLICE, taking turns between pending trees and yielding
+// between slices so it never holds the allocator for long.
+//
+// A tree that is still going after TREE_RECLAIM_PARALLEL_THRESHOLD frees is
+// considered huge: the subtrees left on its walk stack are handed to a
+// WorkStealingPool owned by the reclaimer and freed in parallel. (Not the
+// shared pool, which may already be gone when the reclaimer drains at exit.)
+// Like parallelVisit, each of those tasks hands the right children of its
+// top log2(threads) + TREE_RECLAIM_EXTRA_SPLIT_DEPTH levels to new tasks,
+// so one huge subtree still spreads over every thread.
+
+#define TREE_RECLAIM_SLICE 4096
+#define TREE_RECLAIM_PARALLEL_THRESHOLD (1 << 20)
+#define TREE_RECLAIM_EXTRA_SPLIT_DEPTH 4
+
+/**
+* A piece of deferred teardown. step() frees at most budget nodes and
+* returns true once everything is freed.
+*/
+class ReclaimJob
+{
+public:
+    virtual ~ReclaimJob()
+    {
+
+    }
+
+    virtual bool step(size_t budget) = 0;
+
+    // Runs the rest of the job on the pool, in parallel
+    virtual void finishInParallel(WorkStealingPool& pool) = 0;
+
+    // Nodes freed so far
+    virtual size_t freed() const = 0;
+};
+
+/**
+* Frees a detached tree of NodeType (anything with getLeft/getRight and a
+* destructor that doesn't touch its children), depth-first with an
+* explicit stack so skinny trees can't overflow the call stack.
+*/
+template <class NodeType>
+class NodeReclaimJob : public ReclaimJob
+{
+public:
+    NodeReclaimJob(NodeType* root) : freed_(0)
+    {
+        if (root != NULL) {
+            pending_.push_back(root);
+        }
+    }
+
+    virtual ~NodeReclaimJob()
+    {
+        // only reached early if the reclaimer is shutting down
+        while (!step(TREE_RECLAIM_SLICE)) {
+        }
+    }
+
+    virtual bool step(size_t budget)
+    {
+        freed_ += freeSome(pending_, budget);
+        return pending_.empty();
+    }
+
+    virtual void finishInParallel(WorkStealingPool& pool)
+    {
+        int splitDepth = TREE_RECLAIM_EXTRA_SPLIT_DEPTH;
+        while ((1u << (splitDepth - TREE_RECLAIM_EXTRA_SPLIT_DEPTH)) < pool.size()) {
+            ++splitDepth;
+        }
+        TaskGroup group;
+        WorkStealingPool* poolPtr = &pool;
+        TaskGroup* groupPtr = &group;
+        for (size_t i = 0; i < pending_.size(); ++i) {
+            NodeType* subtree = pending_[i];
+            pool.submit(group, [poolPtr, groupPtr, subtree, splitDepth]() {
+                freeSplit(*poolPtr, *groupPtr, subtree, 0, splitDepth);
+            });
+        }
+        pending_.clear();
+        pool.wait(group);
+    }
+
+    virtual size_t freed() const
+    {
+        return freed_;
+    }
+
+protected:
+    static size_t freeSome(std::vector<NodeType*>& stack, size_t budget)
+    {
+        size_t count = 0;
+        while (count < budget && !stack.empty()) {
+            NodeType* node = stack.back();
+            stack.pop_back();
+            if (node->getLeft() != NULL) {
+                stack.push_back(static_cast<NodeType*>(node->getLeft()));
+            }
+            if (node->getRight() != NULL) {
+                stack.push_back(static_cast<NodeType*>(node->getRight()));
+            }
+            delete node;
+            ++count;
+        }
+        return count;
+    }
+
+    // Frees a subtree, down its left spine while depth < splitDepth,
+    // submitting each right child met on the way as a task of its own
+    static void freeSplit(WorkStealingPool& pool, TaskGroup& group, NodeType* node, int depth, int splitDepth)
+    {
+        while (node != NULL && depth < splitDepth) {
+            NodeType* left = static_cast<NodeType*>(node->getLeft());
+            NodeType* right = static_cast<NodeType*>(node->getRight());
+            delete node;
+            if (right != NULL) {
+                WorkStealingPool* poolPtr = &pool;
+                TaskGroup* groupPtr = &group;
+                int childDepth = depth + 1;
+                pool.submit(group, [poolPtr, groupPtr, right, childDepth, splitDepth]() {
+                    freeSplit(*poolPtr, *groupPtr, right, childDepth, splitDepth);
+                });
+            }
+            node = left;
+            ++depth;
+        }
+        if (node != NULL) {
+            std::vector<NodeType*> stack(1, node);
+            while (!stack.empty()) {
+                freeSome(stack, TREE_RECLAIM_SLICE);
+            }
+        }
+    }
+
+    std::vector<NodeType*> pending_;
+    size_t freed_;
+};
+
+class TreeReclaimer
+{
+public:
+    static TreeReclaimer& shared()
+    {
+        static TreeReclaimer reclaimer;
+        return reclaimer;
+    }
+
+    /**
+    * Takes ownership of job and runs it on the reclaimer thread. After the
+    * reclaimer has been destroyed (static teardown at exit) the job runs
+    * right here instead.
+    */
+    static void defer(ReclaimJob* job)
+    {
+        if (shutDown().load(std::memory_order_acquire)) {
+            delete job;
+            return;
+        }
+        shared().enqueue(job);
+    }
+
+    // Blocks until every tree handed over so far has been freed
+    void drain()
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        idle_.wait(guard, [this]() { return jobs_.empty() && running_ == 0; });
+    }
+
+    ~TreeReclaimer()
+    {
+        drain();
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        delete pool_;
+        shutDown().store(true, std::memory_order_release);
+    }
+
+private:
+    TreeReclaimer() : running_(0), stopping_(false), pool_(NULL)
+    {
+
+    }
+
+    // Trivially destructible, so still usable during static teardown
+    static std::atomic<bool>& shutDown()
+    {
+        static std::atomic<bool> flag(false);
+        return flag;
+    }
+
+    void enqueue(ReclaimJob* job)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            jobs_.push_back(job);
+            if (!thread_.joinable()) {
+                thread_ = std::thread(&TreeReclaimer::run, this);
+            }
+        }
+        wake_.notify_one();
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        while (true) {
+            wake_.wait(guard, [this]() { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty()) {
+                return;
+            }
+            ReclaimJob* job = jobs_.front();
+            jobs_.pop_front();
+            ++running_;
+            guard.unlock();
+
+            bool done = job->step(TREE_RECLAIM_SLICE);
+            if (!done && job->freed() >= TREE_RECLAIM_PARALLEL_THRESHOLD) {
+                if (pool_ == NULL) {
+                    pool_ = new WorkStealingPool();
+                }
+                job->finishInParallel(*pool_);
+                done = true;
+            }
+            if (done) {
+                delete job;
+            }
+            std::this_thread::yield();
+
+            guard.lock();
+            --running_;
+            if (!done) {
+                // back of the line, so several pending trees take turns
+                jobs_.push_back(job);
+            }
+            if (jobs_.empty() && running_ == 0) {
+                idle_.notify_all();
+            }
+        }
+    }
+
+    std::mutex lock_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    std::deque<ReclaimJob*> jobs_;
+    size_t running_;
+    bool stopping_;
+    std::thread thread_;
+    WorkStealingPool* pool_; // only touched by the reclaimer thread
+
+    // Not copyable: owns a thread
+    TreeReclaimer(const TreeReclaimer& other);
+    TreeReclaimer& operator=(const TreeReclaimer& other);
+};
+
+#endif
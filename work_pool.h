@@ -0,0 +1,267 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small work-stealing thread pool for the parallel tree traversals.
+//
+// Every worker owns a deque of tasks. It pushes and pops its own tasks at
+// the back (so nested subtree tasks stay hot in its cache) and, when it
+// runs dry, steals from the front of another worker's deque, which holds
+// the oldest and usually largest pieces of work.
+//
+// Tasks are grouped in a TaskGroup. wait() on a group runs queued tasks
+// instead of blocking, so a task can safely split itself and wait for its
+// children, and the thread that started the job works too.
+
+/**
+* Knobs for the parallel traversals in BinarySearchTree.
+*
+* ordered: split the tree into chunks that are contiguous in-order key
+*   ranges, visit each chunk in key order, and merge reduce results in key
+*   order. Needed when the merge isn't commutative (e.g. concatenating
+*   exported text). Unordered jobs split adaptively and may merge partial
+*   results in any order.
+* threads: worker count; 0 uses the shared pool (one per hardware thread).
+* chunksPerThread: how finely ordered jobs are split, for load balancing.
+*/
+struct ParallelOptions
+{
+    ParallelOptions(bool inOrder = false, unsigned threadCount = 0) :
+        ordered(inOrder),
+        threads(threadCount),
+        chunksPerThread(8)
+    {
+
+    }
+
+    bool ordered;
+    unsigned threads;
+    unsigned chunksPerThread;
+};
+
+/**
+* Tracks a set of tasks so their submitter can wait for them. The first
+* exception thrown by a task is kept and rethrown by wait().
+*/
+class TaskGroup
+{
+public:
+    TaskGroup() : outstanding_(0)
+    {
+
+    }
+
+private:
+    friend class WorkStealingPool;
+
+    std::atomic<size_t> outstanding_;
+    std::mutex errorLock_;
+    std::exception_ptr error_;
+
+    // Not copyable: tasks hold a pointer to it
+    TaskGroup(const TaskGroup& other);
+    TaskGroup& operator=(const TaskGroup& other);
+};
+
+class WorkStealingPool
+{
+public:
+    // 0 threads means one per hardware thread
+    explicit WorkStealingPool(unsigned threads = 0) :
+        nextQueue_(0),
+        pending_(0),
+        stopping_(false)
+    {
+        if (threads == 0) {
+            threads = std::thread::hardware_concurrency();
+        }
+        if (threads == 0) {
+            threads = 1;
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            queues_.push_back(new Queue());
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            workers_.push_back(std::thread(&WorkStealingPool::workerLoop, this, i));
+        }
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(sleepLock_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            workers_[i].join();
+        }
+        for (size_t i = 0; i < queues_.size(); ++i) {
+            delete queues_[i];
+        }
+    }
+
+    unsigned size() const
+    {
+        return static_cast<unsigned>(queues_.size());
+    }
+
+    // The process-wide pool used when ParallelOptions::threads is 0
+    static WorkStealingPool& shared()
+    {
+        static WorkStealingPool pool;
+        return pool;
+    }
+
+    /**
+    * Queues a task in the group. Called from one of this pool's workers it
+    * goes on that worker's own deque; otherwise the deques are used in turn.
+    */
+    void submit(TaskGroup& group, const std::function<void()>& task)
+    {
+        group.outstanding_.fetch_add(1, std::memory_order_relaxed);
+        TaskGroup* groupPtr = &group;
+        std::function<void()> wrapped = [groupPtr, task]() {
+            try {
+                task();
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> guard(groupPtr->errorLock_);
+                if (!groupPtr->error_) {
+                    groupPtr->error_ = std::current_exception();
+                }
+            }
+            groupPtr->outstanding_.fetch_sub(1, std::memory_order_release);
+        };
+
+        int self = currentWorker(this);
+        size_t index = (self >= 0) ? static_cast<size_t>(self)
+                                   : nextQueue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+        {
+            // counted before it is visible, so pending_ never undercounts
+            std::lock_guard<std::mutex> guard(sleepLock_);
+            ++pending_;
+        }
+        {
+            std::lock_guard<std::mutex> guard(queues_[index]->lock);
+            queues_[index]->tasks.push_back(wrapped);
+        }
+        wake_.notify_one();
+    }
+
+    /**
+    * Returns once every task in the group has finished, running queued
+    * tasks in the meantime. Rethrows the first exception a task threw.
+    */
+    void wait(TaskGroup& group)
+    {
+        int self = currentWorker(this);
+        while (group.outstanding_.load(std::memory_order_acquire) != 0) {
+            if (!runOne(self)) {
+                std::this_thread::yield();
+            }
+        }
+        if (group.error_) {
+            std::exception_ptr error = group.error_;
+            group.error_ = std::exception_ptr();
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<std::function<void()> > tasks;
+    };
+
+    // Index of the calling thread in pool, or -1 if it isn't one of its workers
+    static int currentWorker(const WorkStealingPool* pool)
+    {
+        return (workerPool() == pool) ? workerIndex() : -1;
+    }
+
+    static const WorkStealingPool*& workerPool()
+    {
+        static thread_local const WorkStealingPool* pool = NULL;
+        return pool;
+    }
+
+    static int& workerIndex()
+    {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    // Runs one task: the newest of our own, else the oldest one we can steal
+    bool runOne(int self)
+    {
+        std::function<void()> task;
+        size_t count = queues_.size();
+        if (self >= 0) {
+            Queue& own = *queues_[self];
+            std::lock_guard<std::mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task.swap(own.tasks.back());
+                own.tasks.pop_back();
+            }
+        }
+        size_t start = (self >= 0) ? static_cast<size_t>(self) + 1 : 0;
+        for (size_t i = 0; !task && i < count; ++i) {
+            Queue& victim = *queues_[(start + i) % count];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task.swap(victim.tasks.front());
+                victim.tasks.pop_front();
+            }
+        }
+        if (!task) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> guard(sleepLock_);
+            --pending_;
+        }
+        task();
+        return true;
+    }
+
+    void workerLoop(unsigned index)
+    {
+        workerPool() = this;
+        workerIndex() = static_cast<int>(index);
+        while (true) {
+            {
+                std::unique_lock<std::mutex> guard(sleepLock_);
+                wake_.wait(guard, [this]() { return stopping_ || pending_ > 0; });
+                if (stopping_ && pending_ == 0) {
+                    return;
+                }
+            }
+            runOne(static_cast<int>(index));
+        }
+    }
+
+    std::vector<Queue*> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<size_t> nextQueue_;
+
+    std::mutex sleepLock_;
+    std::condition_variable wake_;
+    size_t pending_;
+    bool stopping_;
+
+    // Not copyable: owns threads
+    WorkStealingPool(const WorkStealingPool& other);
+    WorkStealingPool& operator=(const WorkStealingPool& other);
+};
+
+#endif